@@ -0,0 +1,325 @@
+/*
+ * slab.h - a cache of fixed size objects
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+/*
+ * Objects are carved from slabs which are mapped directly, so the
+ * system malloc is never used on a fast path. Every thread keeps
+ * its own free list of up to KMEM_PCP_HIGH objects, an empty list
+ * is refilled from a shared depot by KMEM_PCP_BATCH objects and an
+ * overflowed one gives back the same amount. Slabs are released
+ * only when a cache is destroyed.
+ *
+ * A slab is a page, or a 2MB huge page if KMEM_HUGEPAGE is set. If
+ * hugetlb pages are not reserved, transparent ones are requested.
+ */
+#define KMEM_PAGE_SIZE (4096UL)
+#define KMEM_HPAGE_SIZE (2UL << 20)
+
+enum kmem_cache_flags {
+	KMEM_HUGEPAGE = 0x1,
+};
+
+enum {
+	KMEM_PCP_BATCH = 32,
+	KMEM_PCP_HIGH = 128,
+};
+
+struct kmem_object {
+	struct kmem_object *next;
+};
+
+/* Placed at the beginning of every slab. */
+struct kmem_slab {
+	struct kmem_slab *next;
+} __attribute__((aligned(64)));
+
+struct kmem_pcp {
+	struct kmem_cache *cache;
+	struct kmem_object *head;
+	unsigned int nr;
+};
+
+struct kmem_cache {
+	const char *name;
+	size_t size;
+	size_t slab_size;
+	unsigned int flags;
+	pthread_key_t key;
+
+	pthread_spinlock_t lock;
+	struct kmem_object *depot;
+	unsigned long nr_depot;
+	struct kmem_slab *slabs;
+	unsigned long nr_slabs;
+};
+
+static inline void *
+kmem_map_slab(struct kmem_cache *c)
+{
+	void *p, *aligned;
+	size_t extra;
+
+	if (!(c->flags & KMEM_HUGEPAGE))
+		goto map;
+
+	p = mmap(NULL, c->slab_size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (p != MAP_FAILED)
+		return p;
+
+	/* Map twice as much and trim to a huge page boundary. */
+	p = mmap(NULL, c->slab_size * 2, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	aligned = (void *) (((unsigned long) p + c->slab_size - 1) &
+		~(c->slab_size - 1));
+
+	extra = (char *) aligned - (char *) p;
+	if (extra)
+		munmap(p, extra);
+
+	munmap((char *) aligned + c->slab_size, c->slab_size - extra);
+	(void) madvise(aligned, c->slab_size, MADV_HUGEPAGE);
+	return aligned;
+
+map:
+	p = mmap(NULL, c->slab_size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	return (p == MAP_FAILED) ? NULL:p;
+}
+
+/*
+ * Maps a new slab and carves all its objects into a list of the
+ * calling thread, it is not visible to others until then.
+ */
+static inline int
+kmem_grow(struct kmem_cache *c, struct kmem_pcp *pcp)
+{
+	struct kmem_slab *slab;
+	char *obj, *end;
+
+	slab = kmem_map_slab(c);
+	if (!slab)
+		return -1;
+
+	end = (char *) slab + c->slab_size;
+	for (obj = (char *) (slab + 1); obj + c->size <= end; obj += c->size) {
+		((struct kmem_object *) obj)->next = pcp->head;
+		pcp->head = (struct kmem_object *) obj;
+		pcp->nr++;
+	}
+
+	pthread_spin_lock(&c->lock);
+	slab->next = c->slabs;
+	c->slabs = slab;
+	c->nr_slabs++;
+	pthread_spin_unlock(&c->lock);
+
+	return 0;
+}
+
+static inline void
+kmem_refill(struct kmem_cache *c, struct kmem_pcp *pcp)
+{
+	struct kmem_object *obj;
+
+	pthread_spin_lock(&c->lock);
+	while (c->depot && pcp->nr < KMEM_PCP_BATCH) {
+		obj = c->depot;
+		c->depot = obj->next;
+		c->nr_depot--;
+
+		obj->next = pcp->head;
+		pcp->head = obj;
+		pcp->nr++;
+	}
+	pthread_spin_unlock(&c->lock);
+}
+
+static inline void
+kmem_drain(struct kmem_cache *c, struct kmem_pcp *pcp, unsigned int nr)
+{
+	struct kmem_object *obj;
+
+	pthread_spin_lock(&c->lock);
+	while (pcp->head && nr--) {
+		obj = pcp->head;
+		pcp->head = obj->next;
+		pcp->nr--;
+
+		obj->next = c->depot;
+		c->depot = obj;
+		c->nr_depot++;
+	}
+	pthread_spin_unlock(&c->lock);
+}
+
+/* Called when a thread exits. */
+static inline void
+kmem_pcp_release(void *arg)
+{
+	struct kmem_pcp *pcp = arg;
+
+	kmem_drain(pcp->cache, pcp, pcp->nr);
+	free(pcp);
+}
+
+static inline struct kmem_pcp *
+kmem_this_pcp(struct kmem_cache *c)
+{
+	struct kmem_pcp *pcp = pthread_getspecific(c->key);
+
+	if (__builtin_expect(!pcp, 0)) {
+		/* Once per a thread. */
+		pcp = calloc(1, sizeof(*pcp));
+		if (!pcp)
+			return NULL;
+
+		pcp->cache = c;
+		(void) pthread_setspecific(c->key, pcp);
+	}
+
+	return pcp;
+}
+
+static inline void *
+kmem_cache_alloc(struct kmem_cache *c)
+{
+	struct kmem_pcp *pcp = kmem_this_pcp(c);
+	struct kmem_object *obj;
+
+	if (__builtin_expect(!pcp, 0))
+		return NULL;
+
+	if (__builtin_expect(!pcp->head, 0)) {
+		kmem_refill(c, pcp);
+
+		if (!pcp->head && kmem_grow(c, pcp))
+			return NULL;
+	}
+
+	obj = pcp->head;
+	pcp->head = obj->next;
+	pcp->nr--;
+
+	return obj;
+}
+
+static inline void *
+kmem_cache_zalloc(struct kmem_cache *c)
+{
+	void *obj = kmem_cache_alloc(c);
+
+	if (obj)
+		memset(obj, 0, c->size);
+
+	return obj;
+}
+
+static inline void
+kmem_cache_free(struct kmem_cache *c, void *p)
+{
+	struct kmem_pcp *pcp = kmem_this_pcp(c);
+	struct kmem_object *obj = p;
+
+	if (__builtin_expect(!obj, 0))
+		return;
+
+	/* No memory for a list, keep it in the depot. */
+	if (__builtin_expect(!pcp, 0)) {
+		pthread_spin_lock(&c->lock);
+		obj->next = c->depot;
+		c->depot = obj;
+		c->nr_depot++;
+		pthread_spin_unlock(&c->lock);
+		return;
+	}
+
+	obj->next = pcp->head;
+	pcp->head = obj;
+
+	if (++pcp->nr > KMEM_PCP_HIGH)
+		kmem_drain(c, pcp, KMEM_PCP_BATCH);
+}
+
+/*
+ * An object size is rounded up to a pointer size, it must fit into
+ * a slab together with its header.
+ */
+static inline int
+kmem_cache_init(struct kmem_cache *c, const char *name,
+	size_t size, unsigned int flags)
+{
+	memset(c, 0, sizeof(*c));
+
+	c->name = name;
+	c->flags = flags;
+	c->size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	c->slab_size = (flags & KMEM_HUGEPAGE) ?
+		KMEM_HPAGE_SIZE:KMEM_PAGE_SIZE;
+
+	if (c->size < sizeof(struct kmem_object))
+		c->size = sizeof(struct kmem_object);
+
+	if (c->size + sizeof(struct kmem_slab) > c->slab_size)
+		return -1;
+
+	if (pthread_key_create(&c->key, kmem_pcp_release))
+		return -1;
+
+	pthread_spin_init(&c->lock, PTHREAD_PROCESS_PRIVATE);
+	return 0;
+}
+
+/*
+ * All objects must be freed and nobody uses the cache anymore.
+ * Lists of other threads which are still alive are leaked.
+ */
+static inline void
+kmem_cache_destroy(struct kmem_cache *c)
+{
+	struct kmem_pcp *pcp = pthread_getspecific(c->key);
+	struct kmem_slab *slab;
+
+	if (pcp) {
+		(void) pthread_setspecific(c->key, NULL);
+		free(pcp);
+	}
+
+	(void) pthread_key_delete(c->key);
+
+	while ((slab = c->slabs)) {
+		c->slabs = slab->next;
+		munmap(slab, c->slab_size);
+	}
+
+	pthread_spin_destroy(&c->lock);
+}
+
+#endif	/* __SLAB_H__ */
@@ -4,11 +4,24 @@
 
 #include "b+tree.h"				/* Main header */
 #include "array.h"
+#include "slab.h"
+
+static struct kmem_cache bpn_cachep;
+
+/* BPT_KMEM_HUGEPAGE=1 backs nodes by huge pages. */
+__attribute__((constructor)) static void
+bpn_kmem_init(void)
+{
+	unsigned int flags = getenv("BPT_KMEM_HUGEPAGE") ? KMEM_HUGEPAGE:0;
+
+	if (kmem_cache_init(&bpn_cachep, "bpn", sizeof(struct bpn), flags))
+		BUG();
+}
 
 static struct bpn *
 bpn_calloc_init(u8 type)
 {
-	struct bpn *n = calloc(1, sizeof(*n));
+	struct bpn *n = kmem_cache_zalloc(&bpn_cachep);
 
 	if (unlikely(!n))
 		assert(0);
@@ -199,7 +212,7 @@ bpn_merge_siblings(struct bpn *p, int pos)
 	slot_move(p, pos, pos + 1);
 	subl_move(p, pos + 1, pos + 2);
 	p->entries--;
-	free(r);
+	kmem_cache_free(&bpn_cachep, r);
 
 	return l;
 }
@@ -440,7 +453,7 @@ void *bpt_po_delete(struct bpt_root *root, ulong val)
 				if (!parent->entries && parent == root->node) {
 					n->info.parent = NULL;
 					root->node = n;
-					free(parent);
+					kmem_cache_free(&bpn_cachep, parent);
 				}
 			}
 		}
@@ -469,6 +482,6 @@ void bpt_root_destroy(struct bpt_root *root)
 {
 	/* list_del(&root->node->page.external.list); */
 	list_init(&root->head);
-	free(root->node);
+	kmem_cache_free(&bpn_cachep, root->node);
 	root->node = NULL;
 }
@@ -28,8 +28,16 @@ typedef unsigned char u8;
  * maximum keys:     m - 1 = 7
  * minimum keys:     (m - 1) / 2 = 3
  */
+#ifndef BPT_ORDER
+#define BPT_ORDER 4
+#endif
+
+/* It is set at build time by -DBPT_ORDER=<m>. */
+#if BPT_ORDER < 4 || BPT_ORDER > 256
+#error "BPT_ORDER has to be within 4..256"
+#endif
+
 enum tree_properties {
-	BPT_ORDER = 4,
 	MAX_ENTRIES = (BPT_ORDER - 1),
 	MAX_CHILDREN = (BPT_ORDER),
 	MIN_CHILDREN = (BPT_ORDER >> 1),
@@ -45,7 +53,7 @@ enum {
 /* Aliases. */
 #define SUB_LINKS page.internal.subl
 
-/* A common node structure. */
+/* A common node structure, it starts at a cache line. */
 struct bpn {
 	struct {
 		struct bpn *parent;
@@ -75,7 +83,7 @@ struct bpn {
 #ifdef DEBUG_BP_TREE
 	unsigned long num;			/* for debug */
 #endif
-};
+} __attribute__((aligned(64)));
 
 struct bpt_root {
 	struct bpn *node;
@@ -42,11 +42,22 @@ array_copy(void *dst, void *src, size_t n)
 	memcpy(dst, src, sizeof(ulong) * n);
 }
 
+/*
+ * Slot helpers of a leaf also maintain the inline copy of VA
+ * ranges, for a leaf a "val" is a pointer to the vmap_area.
+ */
 static __always_inline void
 slot_insert(struct bpn *n, size_t pos, ulong val)
 {
 	BUG_ON(pos >= MAX_ENTRIES);
 	array_insert(n->slot, pos, n->entries, val);
+
+	if (is_bpn_external(n)) {
+		array_insert(n->LEAF_VA_START, pos, n->entries,
+			((vmap_area *) val)->va_start);
+		array_insert(n->LEAF_VA_END, pos, n->entries,
+			((vmap_area *) val)->va_end);
+	}
 }
 
 static __always_inline void
@@ -54,18 +65,33 @@ slot_remove(struct bpn *n, size_t pos)
 {
 	BUG_ON(pos >= MAX_ENTRIES);
 	array_remove(n->slot, pos, n->entries);
+
+	if (is_bpn_external(n)) {
+		array_remove(n->LEAF_VA_START, pos, n->entries);
+		array_remove(n->LEAF_VA_END, pos, n->entries);
+	}
 }
 
 static __always_inline void
 slot_move(struct bpn *n, size_t i, size_t j)
 {
 	array_move(n->slot, i, j, n->entries);
+
+	if (is_bpn_external(n)) {
+		array_move(n->LEAF_VA_START, i, j, n->entries);
+		array_move(n->LEAF_VA_END, i, j, n->entries);
+	}
 }
 
 static __always_inline void
 slot_copy(struct bpn *dst, size_t i, struct bpn *src, size_t j, size_t entries)
 {
 	array_copy(dst->slot + i, src->slot + j, entries);
+
+	if (is_bpn_external(src)) {
+		array_copy(dst->LEAF_VA_START + i, src->LEAF_VA_START + j, entries);
+		array_copy(dst->LEAF_VA_END + i, src->LEAF_VA_END + j, entries);
+	}
 }
 
 static __always_inline void
@@ -87,23 +113,42 @@ subl_copy(struct bpn *dst, size_t i, struct bpn *src, size_t j, size_t entries)
 	array_copy(dst->SUB_LINKS + i, src->SUB_LINKS + j, entries);
 }
 
+/*
+ * Sub-avail helpers also maintain a size class mask of children,
+ * both are 32-bit arrays.
+ */
 static __always_inline void
 suba_copy(struct bpn *dst, size_t i, struct bpn *src, size_t j, size_t entries)
 {
-	array_copy(dst->SUB_AVAIL + i, src->SUB_AVAIL + j, entries);
+	memcpy(dst->SUB_AVAIL + i, src->SUB_AVAIL + j, sizeof(u32) * entries);
+	memcpy(dst->SUB_CLASS + i, src->SUB_CLASS + j, sizeof(u32) * entries);
 }
 
 static __always_inline void
-suba_insert(struct bpn *n, size_t pos, ulong val)
+suba_insert(struct bpn *n, size_t pos, u32 val, u32 class)
 {
+	size_t entries = nr_sub_entries(n);
+
 	BUG_ON(pos >= MAX_CHILDREN);
-	array_insert(n->SUB_AVAIL, pos, nr_sub_entries(n), val);
+
+	if (pos < entries) {
+		memmove(n->SUB_AVAIL + pos + 1, n->SUB_AVAIL + pos,
+			sizeof(u32) * (entries - pos));
+		memmove(n->SUB_CLASS + pos + 1, n->SUB_CLASS + pos,
+			sizeof(u32) * (entries - pos));
+	}
+
+	n->SUB_AVAIL[pos] = val;
+	n->SUB_CLASS[pos] = class;
 }
 
 static __always_inline void
 suba_move(struct bpn *n, size_t i, size_t j)
 {
-	array_move(n->SUB_AVAIL, i, j, nr_sub_entries(n));
+	memmove(n->SUB_AVAIL + i, n->SUB_AVAIL + j,
+		sizeof(u32) * (nr_sub_entries(n) - j));
+	memmove(n->SUB_CLASS + i, n->SUB_CLASS + j,
+		sizeof(u32) * (nr_sub_entries(n) - j));
 }
 
 #endif
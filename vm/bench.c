@@ -0,0 +1,175 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "vm.h"
+#include "vm_ops.h"
+#include "vm_simd.h"
+
+/*
+ * Descent microbenchmark. It builds a fragmented free space and
+ * measures bpt_lookup_lowest_leaf() with every search kernel which
+ * is supported by a CPU. Build it with -O2 or -O3 for real numbers.
+ */
+struct query {
+	ulong length;
+	ulong vstart;
+};
+
+static inline ulong
+now_nsec(void)
+{
+	struct timespec t;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &t);
+	return (t.tv_sec * 1000000000UL) + t.tv_nsec;
+}
+
+/*
+ * Allocates 2 * nr areas one after another and releases every
+ * second one, so the tree ends up with about nr free blocks.
+ */
+static void
+build_free_space(struct bpt_root *root, ulong nr)
+{
+	struct vmap_area **array;
+	ulong i;
+
+	array = calloc(nr * 2, sizeof(*array));
+	if (!array)
+		BUG();
+
+	vm_init_free_space(root, VMALLOC_START, VMALLOC_END);
+
+	for (i = 0; i < nr * 2; i++) {
+		ulong size = ((rand() % 16) + 1) * PAGE_SIZE;
+
+		array[i] = alloc_vmap_area(root, size, PAGE_SIZE,
+			VMALLOC_START, VMALLOC_END);
+		if (!array[i])
+			BUG();
+	}
+
+	for (i = 0; i < nr * 2; i += 2)
+		(void) free_vmap_area(root, array[i]);
+
+	/* Busy ones are not needed anymore. */
+	for (i = 1; i < nr * 2; i += 2)
+		vmap_area_free(array[i]);
+
+	free(array);
+}
+
+static ulong
+run_descent(struct bpt_root *root, struct query *q, ulong nr_q, int loops)
+{
+	volatile struct bpn *sink;
+	ulong a, b, i;
+	int j;
+
+	a = now_nsec();
+	for (j = 0; j < loops; j++)
+		for (i = 0; i < nr_q; i++)
+			sink = bpt_lookup_lowest_leaf(root, q[i].length, q[i].vstart);
+	b = now_nsec();
+
+	(void) sink;
+	return b - a;
+}
+
+/* Internal nodes and leaves of a sub-tree. */
+static void
+count_nodes(struct bpn *n, ulong *nr_inter, ulong *nr_leaf)
+{
+	int i;
+
+	if (!is_bpn_internal(n)) {
+		(*nr_leaf)++;
+		return;
+	}
+
+	(*nr_inter)++;
+	for (i = 0; i < n->entries + 1; i++)
+		count_nodes(n->SUB_LINKS[i], nr_inter, nr_leaf);
+}
+
+static void
+usage(const char *name)
+{
+	printf("Usage: %s [-n free blocks] [-q queries] [-l loops]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	const char *kernels[] = { "scalar", "avx2", "avx512" };
+	struct bpt_root root;
+	ulong nr_free = 1000000;
+	ulong nr_q = 100000;
+	int loops = 10;
+	struct query *q;
+	ulong i, nsec;
+	ulong nr_inter = 0, nr_leaf = 0;
+	int opt, high;
+
+	while ((opt = getopt(argc, argv, "n:q:l:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			nr_free = strtoul(optarg, NULL, 10);
+			break;
+		case 'q':
+			nr_q = strtoul(optarg, NULL, 10);
+			break;
+		case 'l':
+			loops = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : -1;
+		}
+	}
+
+	srand(0);
+	build_free_space(&root, nr_free);
+	high = bpt_high(root.node);
+	count_nodes(root.node, &nr_inter, &nr_leaf);
+
+	q = calloc(nr_q, sizeof(*q));
+	if (!q)
+		BUG();
+
+	for (i = 0; i < nr_q; i++) {
+		q[i].length = ((rand() % 16) + 1) * PAGE_SIZE;
+		q[i].vstart = VMALLOC_START +
+			(rand() % (nr_free * 16)) * PAGE_SIZE;
+	}
+
+	printf("-> free blocks: %lu, tree high: %d, queries: %lu x %d\n",
+		nr_free, high, nr_q, loops);
+
+	/* Internal nodes are what a descent mostly touches. */
+	printf("-> internal: %lu x %lu B = %lu KB, leaves: %lu x %lu B, "
+		"%.1f B per free block\n", nr_inter, BPN_INTER_SIZE,
+		(nr_inter * BPN_INTER_SIZE) >> 10, nr_leaf, BPN_LEAF_SIZE,
+		(double) (nr_inter * BPN_INTER_SIZE + nr_leaf * BPN_LEAF_SIZE) /
+		nr_free);
+
+	for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+		if (bpn_search_select(kernels[i])) {
+			printf("%8s: not supported\n", kernels[i]);
+			continue;
+		}
+
+		/* Warm up. */
+		(void) run_descent(&root, q, nr_q, 1);
+
+		nsec = run_descent(&root, q, nr_q, loops);
+		printf("%8s: %6.1f nsec/descent, %5.1f nsec/level\n",
+			kernels[i], (double) nsec / (nr_q * loops),
+			(double) nsec / (nr_q * loops * (high ? high : 1)));
+	}
+
+	free(q);
+	return 0;
+}
@@ -30,12 +30,12 @@ build_graph(struct bpn *n)
 
 	for (i = 0; i < n->entries; i++) {
 		if (i + 1 == n->entries) {
-			printf("\t\t\t<TD PORT=\"p%d\">%lu</TD>\n", i, n->SUB_AVAIL[i]);
+			printf("\t\t\t<TD PORT=\"p%d\">%u</TD>\n", i, n->SUB_AVAIL[i]);
 			printf("\t\t\t<TD BGCOLOR=\"lightgreen\">%lu</TD>\n",
 				   (unsigned long) bpn_get_key(n, i));
-			printf("\t\t\t<TD PORT=\"p%d\">%lu</TD>\n", i + 1, n->SUB_AVAIL[i + 1]);
+			printf("\t\t\t<TD PORT=\"p%d\">%u</TD>\n", i + 1, n->SUB_AVAIL[i + 1]);
 		} else {
-			printf("\t\t\t<TD PORT=\"p%d\">%lu</TD>\n", i, n->SUB_AVAIL[i]);
+			printf("\t\t\t<TD PORT=\"p%d\">%u</TD>\n", i, n->SUB_AVAIL[i]);
 			printf("\t\t\t<TD BGCOLOR=\"lightgreen\">%lu</TD>\n",
 				(unsigned long) bpn_get_key(n, i));
 		}
@@ -0,0 +1,773 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+#include "vm_ops.h"
+#include "vm_olc.h"
+#include "vm_class.h"
+#include "vm_stat.h"
+
+/*
+ * Differential fuzzing of the allocator. Random allocs and frees
+ * with random sizes, alignments and [vstart, vend) windows are run
+ * against a tree, over all fit policies, the OLC path and the size
+ * classes. A free is immediate, lazy, OLC or goes to a class list.
+ * Every allocation is checked against a shadow map of busy pages and
+ * against an oracle, a linear walk over free areas, and the tree
+ * invariants are checked periodically. Live areas are also grown and
+ * shrunk in place. A run depends on its seed only, so a failure is
+ * reproduced by it.
+ *
+ * A page aligned first fit over the whole space is also done by the
+ * linear lin_lookup_smallest_va(), both lookups are timed and a
+ * speedup of the tree is reported per a number of free areas. Build
+ * it with -O2 or -O3 for numbers.
+ */
+#define FUZZ_START VMALLOC_START
+#define FUZZ_SPACE (16UL << 30)
+#define FUZZ_END (FUZZ_START + FUZZ_SPACE)
+#define FUZZ_PAGES (FUZZ_SPACE / PAGE_SIZE)
+#define FUZZ_NR_BUCKETS 32
+#define FUZZ_NR_POLICIES 4
+
+#define FUZZ_FAIL(fmt, ...)						\
+do {									\
+	printf("-> FAIL at op %lu, seed %lu: " fmt "\n",		\
+		op, seed, ##__VA_ARGS__);				\
+	exit(-1);							\
+} while (0)
+
+struct fuzz_bucket {
+	ulong nr;
+	ulong tree_nsec;
+	ulong lin_nsec;
+};
+
+static ulong seed = 1;
+static ulong nr_ops = 1000000;
+static ulong max_live = 20000;
+static ulong check_every = 10000;
+static ulong op;
+
+static ulong rng_state;
+static pthread_spinlock_t root_lock;	/* for the class cache */
+static ulong *shadow;			/* a bit per busy page */
+static ulong nr_busy_pages;
+static ulong clock_nsec;		/* a cost of a timestamp */
+static struct fuzz_bucket buckets[FUZZ_NR_BUCKETS];
+
+static const char *policy_name[FUZZ_NR_POLICIES] = {
+	[VMAP_FIRST_FIT] = "first",
+	[VMAP_BEST_FIT] = "best",
+	[VMAP_NEXT_FIT] = "next",
+	[VMAP_TOP_DOWN] = "top",
+};
+
+enum fuzz_path {
+	FUZZ_TREE,
+	FUZZ_OLC,
+	FUZZ_CLASS,
+};
+
+static struct {
+	ulong allocs;
+	ulong failed;
+	ulong policy[FUZZ_NR_POLICIES];
+	ulong olc;
+	ulong classes;
+	ulong windows;
+	ulong frees;
+	ulong lazy_frees;
+	ulong olc_frees;
+	ulong class_frees;
+	ulong aligned;
+	ulong extends;
+	ulong extend_failed;
+	ulong shrinks;
+	ulong checks;
+} fs;
+
+/* xorshift64*, a sequence does not depend on a libc. */
+static inline ulong
+rng(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545f4914f6cdd1dUL;
+}
+
+static inline ulong
+rng_range(ulong n)
+{
+	return rng() % n;
+}
+
+static inline ulong
+page_idx(ulong addr)
+{
+	return (addr - FUZZ_START) / PAGE_SIZE;
+}
+
+/* Returns true if every page of [start, end) is in "busy" state. */
+static bool
+shadow_test(ulong start, ulong end, bool busy)
+{
+	ulong i;
+
+	for (i = page_idx(start); i < page_idx(end); i++)
+		if (!!(shadow[i / 64] & (1UL << (i % 64))) != busy)
+			return false;
+
+	return true;
+}
+
+static void
+shadow_set(ulong start, ulong end, bool busy)
+{
+	ulong i;
+
+	for (i = page_idx(start); i < page_idx(end); i++) {
+		if (busy)
+			shadow[i / 64] |= 1UL << (i % 64);
+		else
+			shadow[i / 64] &= ~(1UL << (i % 64));
+	}
+
+	if (busy)
+		nr_busy_pages += page_idx(end) - page_idx(start);
+	else
+		nr_busy_pages -= page_idx(end) - page_idx(start);
+}
+
+/*
+ * Walks a sub-tree within split keys [lo, hi), checks keys, parent
+ * links, inline ranges and cached metadata against what is below.
+ * Returns the max size of a sub-tree, "mask" gets its classes.
+ */
+static ulong
+check_node(struct bpn *n, ulong lo, ulong hi, u32 *mask)
+{
+	struct vmap_area *va;
+	struct bpn *child;
+	ulong max = 0, m, l, h;
+	u32 cm;
+	int i;
+
+	*mask = 0;
+
+	if (is_bpn_external(n)) {
+		for (i = 0; i < n->entries; i++) {
+			va = bpn_get_val(n, i);
+
+			if (va->va_start != n->LEAF_VA_START[i] ||
+					va->va_end != n->LEAF_VA_END[i])
+				FUZZ_FAIL("stale leaf range of %#lx-%#lx",
+					va->va_start, va->va_end);
+
+			if (va->va_start >= va->va_end ||
+					va->va_start < lo || va->va_end > hi)
+				FUZZ_FAIL("%#lx-%#lx is out of [%#lx, %#lx)",
+					va->va_start, va->va_end, lo, hi);
+
+			if (va_size(va) > max)
+				max = va_size(va);
+
+			*mask |= 1U << va_size_class(va_size(va));
+		}
+
+		if (n->LEAF_MAX_AVAIL != max || n->LEAF_CLASS != *mask)
+			FUZZ_FAIL("leaf cache %lu/%#x, must be %lu/%#x",
+				n->LEAF_MAX_AVAIL, n->LEAF_CLASS, max, *mask);
+
+		return max;
+	}
+
+	for (i = 0; i < n->entries + 1; i++) {
+		child = n->SUB_LINKS[i];
+		l = i ? n->slot[i - 1]:lo;
+		h = (i < n->entries) ? n->slot[i]:hi;
+
+		if (l >= h)
+			FUZZ_FAIL("split keys %#lx >= %#lx", l, h);
+
+		if (child->info.parent != n)
+			FUZZ_FAIL("a wrong parent of a child %d", i);
+
+		m = check_node(child, l, h, &cm);
+
+		if (n->SUB_AVAIL[i] != va_avail_pages(m) ||
+				n->SUB_CLASS[i] != cm)
+			FUZZ_FAIL("SUB_AVAIL %u/%#x of a child %d, must be %u/%#x",
+				n->SUB_AVAIL[i], n->SUB_CLASS[i], i,
+				va_avail_pages(m), cm);
+
+		if (m > max)
+			max = m;
+
+		*mask |= cm;
+	}
+
+	return max;
+}
+
+/*
+ * Besides the tree itself, free areas have to be merged, must not
+ * be busy in the shadow map and together with busy pages they have
+ * to cover the whole space.
+ */
+static void
+check_tree(struct bpt_root *root)
+{
+	ulong free_pages = 0, nr_free = 0, prev_end = 0;
+	struct list_head *pos;
+	struct vmap_area *va;
+	struct bpn *n;
+	u32 mask;
+	int i;
+
+	(void) check_node(root->node, 0, ULONG_MAX, &mask);
+
+	list_for_each(pos, &root->head) {
+		n = list_entry(pos, struct bpn, page.external.list);
+
+		for (i = 0; i < n->entries; i++) {
+			va = bpn_get_val(n, i);
+
+			if (prev_end && va->va_start <= prev_end)
+				FUZZ_FAIL("%#lx-%#lx is not merged or overlaps",
+					va->va_start, va->va_end);
+
+			if (!shadow_test(va->va_start, va->va_end, false))
+				FUZZ_FAIL("free %#lx-%#lx is busy",
+					va->va_start, va->va_end);
+
+			prev_end = va->va_end;
+			free_pages += va_size(va) / PAGE_SIZE;
+			nr_free++;
+		}
+	}
+
+	if (free_pages + nr_busy_pages != FUZZ_PAGES)
+		FUZZ_FAIL("%lu free and %lu busy pages out of %lu",
+			free_pages, nr_busy_pages, FUZZ_PAGES);
+
+	if (root->frag->nr_free != nr_free ||
+			root->frag->free_bytes != free_pages * PAGE_SIZE)
+		FUZZ_FAIL("free space counters %lu/%lu, must be %lu/%lu",
+			root->frag->nr_free, root->frag->free_bytes,
+			nr_free, free_pages * PAGE_SIZE);
+
+	fs.checks++;
+}
+
+static void
+clock_calibrate(void)
+{
+	ulong a, b;
+	int i;
+
+	clock_nsec = ULONG_MAX;
+
+	for (i = 0; i < 1000; i++) {
+		a = vm_stat_now();
+		b = vm_stat_now();
+
+		if (b - a < clock_nsec)
+			clock_nsec = b - a;
+	}
+}
+
+static void
+account(ulong nr_free, ulong tree_nsec, ulong lin_nsec)
+{
+	struct fuzz_bucket *b;
+	int i = 0;
+
+	if (nr_free > 1)
+		i = (sizeof(ulong) * 8 - 1) - __builtin_clzl(nr_free);
+
+	b = &buckets[i < FUZZ_NR_BUCKETS ? i:FUZZ_NR_BUCKETS - 1];
+	b->nr++;
+	b->tree_nsec += (tree_nsec > clock_nsec) ? tree_nsec - clock_nsec:0;
+	b->lin_nsec += (lin_nsec > clock_nsec) ? lin_nsec - clock_nsec:0;
+}
+
+/*
+ * The lowest or the highest address of free areas where the request
+ * fits, zero if there is none. Only the tree is seen, not lazily
+ * freed or listed areas.
+ */
+static ulong
+oracle_fit(struct bpt_root *root, ulong size, ulong align,
+	ulong vstart, ulong vend, bool highest)
+{
+	ulong s, e, addr, found = 0;
+	struct list_head *pos;
+	struct vmap_area *va;
+	struct bpn *n;
+	int i;
+
+	list_for_each(pos, &root->head) {
+		n = list_entry(pos, struct bpn, page.external.list);
+
+		for (i = 0; i < n->entries; i++) {
+			va = bpn_get_val(n, i);
+			if (va->va_start >= vend)
+				return found;
+
+			if (highest) {
+				addr = top_down_addr(va->va_start, va->va_end,
+					size, align, vstart, vend);
+				if (addr)
+					found = addr;
+
+				continue;
+			}
+
+			s = va->va_start > vstart ? va->va_start:vstart;
+			e = va->va_end < vend ? va->va_end:vend;
+			addr = ALIGN(s, align);
+
+			if (addr < e && e - addr >= size)
+				return addr;
+		}
+	}
+
+	return found;
+}
+
+/*
+ * Only a page aligned first fit over the whole space is seen by the
+ * linear lookup, it has to return exactly what the tree does.
+ */
+static void
+time_lookup(struct bpt_root *root, ulong size, ulong vstart)
+{
+	struct vmap_area *tva, *lva;
+	ulong a, b, c;
+	struct bpn *n;
+
+	a = vm_stat_now();
+	tva = lookup_smallest_va(root, size, PAGE_SIZE, vstart, FUZZ_END, &n);
+	b = vm_stat_now();
+	lva = lin_lookup_smallest_va(root, size, PAGE_SIZE, vstart, NULL);
+	c = vm_stat_now();
+
+	account(root->frag->nr_free, b - a, c - b);
+
+	if (tva != lva)
+		FUZZ_FAIL("size %#lx, vstart %#lx: tree %#lx, linear %#lx",
+			size, vstart, tva ? tva->va_start:0,
+			lva ? lva->va_start:0);
+}
+
+/*
+ * An allocation is checked against the tree which is left after it.
+ * Only the placed area is gone from it, so if there is a better place
+ * now, there was one at the time of the request. Lazily freed areas
+ * have to be purged by a failed request, a failed class request has
+ * given back all lists as well, so nothing has to fit then.
+ *
+ * A page aligned first fit has to be the lowest place, a top-down
+ * one the highest, a next fit the lowest one at or above the cursor
+ * and only if there is none, the lowest one at all. A bigger
+ * alignment does not always give the best place and a best fit is
+ * not always the smallest area, but they have to fit.
+ */
+static void
+check_alloc(struct bpt_root *root, struct vmap_area *va,
+	enum vmap_fit_policy policy, ulong cursor, ulong size,
+	ulong align, ulong vstart, ulong vend, enum fuzz_path path)
+{
+	ulong addr = va ? va->va_start:0, better = 0;
+
+	if (!va) {
+		if (root->lazy.nr)
+			FUZZ_FAIL("alloc of %#lx failed with %lu areas queued",
+				size, root->lazy.nr);
+
+		better = oracle_fit(root, size, align, vstart, vend, false);
+		if (better)
+			FUZZ_FAIL("%s alloc of %#lx, align %#lx in "
+				"[%#lx, %#lx) failed, it fits at %#lx",
+				policy_name[policy], size, align, vstart, vend,
+				better);
+		return;
+	}
+
+	if (va_size(va) != size || addr < vstart || va->va_end > vend ||
+			(addr & (align - 1)))
+		FUZZ_FAIL("alloc %#lx-%#lx, must be %#lx, align %#lx "
+			"in [%#lx, %#lx)", addr, va->va_end, size, align,
+			vstart, vend);
+
+	if (!shadow_test(va->va_start, va->va_end, false))
+		FUZZ_FAIL("alloc %#lx-%#lx is busy", va->va_start, va->va_end);
+
+	/* A list does not keep an order. */
+	if (path == FUZZ_CLASS || align > PAGE_SIZE)
+		return;
+
+	switch (policy) {
+	case VMAP_FIRST_FIT:
+		better = oracle_fit(root, size, align, vstart, vend, false);
+		if (better > addr)
+			better = 0;
+		break;
+	case VMAP_TOP_DOWN:
+		better = oracle_fit(root, size, align, vstart, vend, true);
+		if (better < addr)
+			better = 0;
+		break;
+	case VMAP_NEXT_FIT:
+		if (cursor > vstart && cursor < vend) {
+			better = oracle_fit(root, size, align, cursor,
+				vend, false);
+			if (addr >= cursor && better > addr)
+				better = 0;
+
+			/* Or it has wrapped around while there is a place. */
+			if (addr >= cursor || better)
+				break;
+		}
+
+		better = oracle_fit(root, size, align, vstart, vend, false);
+		if (better > addr)
+			better = 0;
+		break;
+	default:
+		break;
+	}
+
+	if (better)
+		FUZZ_FAIL("%s alloc %#lx-%#lx, cursor %#lx, in [%#lx, %#lx), "
+			"it fits at %#lx", policy_name[policy], addr,
+			va->va_end, cursor, vstart, vend, better);
+}
+
+static struct vmap_area *
+do_alloc(struct bpt_root *root, struct vmap_class_cache *cc,
+	ulong size, ulong align, ulong vstart, ulong vend)
+{
+	enum vmap_fit_policy policy = root->fit.policy;
+	ulong cursor = root->fit.cursor;
+	enum fuzz_path path = FUZZ_TREE;
+	struct vmap_area *va;
+
+	/* A class cache serves the whole space. */
+	if (vstart == FUZZ_START && vend == FUZZ_END && !rng_range(3))
+		path = FUZZ_CLASS;
+	else if (!rng_range(3))
+		path = FUZZ_OLC;
+
+	if (path != FUZZ_CLASS && policy == VMAP_FIRST_FIT &&
+			align <= PAGE_SIZE && vend == FUZZ_END)
+		time_lookup(root, size, vstart);
+
+	if (path == FUZZ_CLASS)
+		va = vmap_class_alloc(cc, size, align);
+	else if (path == FUZZ_OLC)
+		va = alloc_vmap_area_olc(root, size, align, vstart, vend);
+	else
+		va = alloc_vmap_area(root, size, align, vstart, vend);
+
+	check_alloc(root, va, policy, cursor, size, align,
+		vstart, vend, path);
+
+	fs.allocs++;
+	fs.policy[policy]++;
+	fs.olc += path == FUZZ_OLC;
+	fs.classes += path == FUZZ_CLASS;
+	fs.aligned += align > PAGE_SIZE;
+	fs.windows += vstart != FUZZ_START || vend != FUZZ_END;
+
+	if (!va) {
+		fs.failed++;
+		return NULL;
+	}
+
+	shadow_set(va->va_start, va->va_end, true);
+	return va;
+}
+
+/* Areas of any size can go to the class cache, it sorts them out. */
+static void
+do_free(struct bpt_root *root, struct vmap_class_cache *cc,
+	struct vmap_area *va)
+{
+	ulong addr = va->va_start;
+	int rv;
+
+	shadow_set(va->va_start, va->va_end, false);
+
+	switch (rng_range(4)) {
+	case 0:
+		rv = free_vmap_area(root, va);
+		break;
+	case 1:
+		rv = free_vmap_area_lazy(root, va);
+		fs.lazy_frees++;
+		break;
+	case 2:
+		rv = free_vmap_area_olc(root, va);
+		fs.olc_frees++;
+		break;
+	default:
+		rv = vmap_class_free(cc, va);
+		fs.class_frees++;
+		break;
+	}
+
+	if (rv)
+		FUZZ_FAIL("free of %#lx failed", addr);
+
+	fs.frees++;
+}
+
+/* The tree owns all free space after it. */
+static void
+settle(struct bpt_root *root, struct vmap_class_cache *cc)
+{
+	vmap_class_flush(cc);
+	purge_vmap_area_lazy(root);
+}
+
+static ulong
+class_nr_listed(struct vmap_class_cache *cc)
+{
+	ulong nr = 0;
+	int i;
+
+	for (i = 0; i < VMAP_CLASS_MAX_PAGES; i++)
+		nr += cc->list[i].nr;
+
+	return nr;
+}
+
+/*
+ * An extend has to succeed if and only if the pages right after an
+ * area are free, they are one free block then. Listed areas are not
+ * seen by the tree, so it may fail while there are some. A shrunk
+ * tail has to be merged back, it is seen by check_tree().
+ */
+static void
+do_resize(struct bpt_root *root, struct vmap_class_cache *cc,
+	struct vmap_area *va, ulong size)
+{
+	ulong old_end = va->va_start + va_size(va);
+	ulong end = va->va_start + size;
+	bool fit, done;
+
+	if (end > old_end) {
+		fit = end <= FUZZ_END && shadow_test(old_end, end, false);
+		done = !extend_vmap_area(root, va, size, FUZZ_END);
+
+		if (done != fit && (done || !class_nr_listed(cc)))
+			FUZZ_FAIL("extend %#lx-%#lx to %#lx is %s, must be %s",
+				va->va_start, old_end, end, fit ? "failed":"done",
+				fit ? "done":"failed");
+
+		fs.extends++;
+		if (!done) {
+			fs.extend_failed++;
+			return;
+		}
+
+		shadow_set(old_end, end, true);
+	} else if (end < old_end) {
+		if (shrink_vmap_area(root, va, size))
+			FUZZ_FAIL("shrink %#lx-%#lx to %#lx failed",
+				va->va_start, old_end, end);
+
+		fs.shrinks++;
+		shadow_set(end, old_end, false);
+	}
+
+	if (va->va_end != end)
+		FUZZ_FAIL("resized %#lx-%#lx, must end at %#lx",
+			va->va_start, va->va_end, end);
+}
+
+/*
+ * A number of live areas follows a triangle wave, from zero to
+ * max_live and back twice, so a free list goes over all sizes.
+ */
+static bool
+want_alloc(ulong nr_live)
+{
+	ulong period = nr_ops / 2 ? nr_ops / 2:1;
+	ulong half = period / 2 ? period / 2:1;
+	ulong phase = op % period;
+	ulong target;
+
+	target = (phase < half ? phase:period - phase) * max_live / half;
+
+	if (!nr_live)
+		return true;
+
+	return rng_range(10) < (nr_live < target ? 7:3);
+}
+
+static void
+print_speedup(void)
+{
+	struct fuzz_bucket *b;
+	int i;
+
+	printf("%16s %10s %10s %10s %8s\n", "free areas", "lookups",
+		"tree nsec", "lin nsec", "speedup");
+
+	for (i = 0; i < FUZZ_NR_BUCKETS; i++) {
+		b = &buckets[i];
+		if (!b->nr)
+			continue;
+
+		printf("%7lu-%-8lu %10lu %10lu %10lu %8.1f\n",
+			i ? 1UL << i:0, (1UL << (i + 1)) - 1, b->nr,
+			b->tree_nsec / b->nr, b->lin_nsec / b->nr,
+			(double) b->lin_nsec / (b->tree_nsec ? b->tree_nsec:1));
+	}
+}
+
+static void
+usage(const char *name)
+{
+	printf("Usage: %s [-s seed] [-n ops] [-l live] [-k ops]\n"
+		"  -s  a seed, 1 by default, it picks policies, paths,\n"
+		"      windows and frees as well\n"
+		"  -n  number of operations, default 1000000\n"
+		"  -l  max number of live areas, default 20000\n"
+		"  -k  check the tree every N operations, default 10000,\n"
+		"      0 checks it only at the end\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	struct vmap_area **live, *va;
+	struct vmap_class_cache cc;
+	struct bpt_root root;
+	ulong nr_live = 0, i;
+	ulong size, align, vstart, vend;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:n:l:k:h")) != -1) {
+		switch (opt) {
+		case 's':
+			seed = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			nr_ops = strtoul(optarg, NULL, 10);
+			break;
+		case 'l':
+			max_live = strtoul(optarg, NULL, 10);
+			break;
+		case 'k':
+			check_every = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : -1;
+		}
+	}
+
+	if (!max_live) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	rng_state = seed * 0x9e3779b97f4a7c15UL | 1;
+
+	live = calloc(max_live, sizeof(*live));
+	shadow = calloc(FUZZ_PAGES / 64, sizeof(*shadow));
+	if (!live || !shadow)
+		BUG();
+
+	vm_init_free_space(&root, FUZZ_START, FUZZ_END);
+	if (vm_init_frag_stat(&root))
+		BUG();
+
+	pthread_spin_init(&root_lock, PTHREAD_PROCESS_PRIVATE);
+	if (vmap_class_init(&cc, &root, &root_lock, FUZZ_START, FUZZ_END))
+		BUG();
+
+	clock_calibrate();
+
+	printf("-> seed %lu, %lu ops, %lu live at most, %lu MB space\n",
+		seed, nr_ops, max_live, FUZZ_SPACE >> 20);
+
+	for (op = 0; op < nr_ops; op++) {
+		if (nr_live && !rng_range(8)) {
+			i = rng_range(nr_live);
+			size = va_size(live[i]);
+
+			if (rng_range(2))
+				size += (1 + rng_range(16)) * PAGE_SIZE;
+			else if (size > PAGE_SIZE)
+				size -= (1 + rng_range(size / PAGE_SIZE - 1)) * PAGE_SIZE;
+
+			do_resize(&root, &cc, live[i], size);
+		} else if (nr_live < max_live && want_alloc(nr_live)) {
+			/* A policy is kept for a while, a next fit has to go on. */
+			if (!rng_range(64))
+				vm_set_fit_policy(&root,
+					rng_range(FUZZ_NR_POLICIES));
+
+			size = (rng_range(5) ? 1 + rng_range(16):
+				1 + rng_range(1024)) * PAGE_SIZE;
+			align = rng_range(4) ? PAGE_SIZE:
+				PAGE_SIZE << (1 + rng_range(8));
+			vstart = rng_range(4) ? FUZZ_START:
+				FUZZ_START + rng_range(FUZZ_PAGES) * PAGE_SIZE;
+			vend = rng_range(4) ? FUZZ_END:
+				vstart + (1 + rng_range((FUZZ_END - vstart) /
+					PAGE_SIZE)) * PAGE_SIZE;
+
+			va = do_alloc(&root, &cc, size, align, vstart, vend);
+			if (va)
+				live[nr_live++] = va;
+		} else {
+			i = rng_range(nr_live);
+			do_free(&root, &cc, live[i]);
+			live[i] = live[--nr_live];
+		}
+
+		if (check_every && !((op + 1) % check_every)) {
+			settle(&root, &cc);
+			check_tree(&root);
+		}
+	}
+
+	while (nr_live)
+		do_free(&root, &cc, live[--nr_live]);
+
+	settle(&root, &cc);
+	check_tree(&root);
+
+	/* Everything is back, it must be one area again. */
+	va = bpn_get_val(root.node, 0);
+	if (root.node->entries != 1 || va->va_start != FUZZ_START ||
+			va->va_end != FUZZ_END)
+		FUZZ_FAIL("the space is not one area at the end");
+
+	printf("-> OK: %lu allocs, %lu failed, %lu frees, %lu aligned, "
+		"%lu extends, %lu not in place, %lu shrinks, %lu tree checks\n",
+		fs.allocs, fs.failed, fs.frees, fs.aligned, fs.extends,
+		fs.extend_failed, fs.shrinks, fs.checks);
+	printf("-> allocs: %lu first, %lu best, %lu next, %lu top, "
+		"%lu OLC, %lu classes, %lu windows\n",
+		fs.policy[VMAP_FIRST_FIT], fs.policy[VMAP_BEST_FIT],
+		fs.policy[VMAP_NEXT_FIT], fs.policy[VMAP_TOP_DOWN],
+		fs.olc, fs.classes, fs.windows);
+	printf("-> frees: %lu lazy, %lu OLC, %lu to classes\n",
+		fs.lazy_frees, fs.olc_frees, fs.class_frees);
+	print_speedup();
+
+	vmap_class_destroy(&cc);
+	bpt_root_destroy(&root);
+	free(shadow);
+	free(live);
+	return 0;
+}
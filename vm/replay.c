@@ -0,0 +1,345 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+#include "vm_ops.h"
+#include "vm_engine.h"
+#include "vm_stat.h"
+#include "vm_trace.h"
+
+/*
+ * Replays a trace recorded with VM_TRACE=<file> at full speed, in
+ * one thread. A free space is [lowest vstart, highest vend) of all
+ * allocations of the trace. Build it with -O2 or -O3 for numbers.
+ * -E selects an engine, so they can be compared on one trace.
+ */
+struct addr_map {
+	ulong *key;
+	struct vmap_area **val;
+	ulong mask;
+};
+
+static inline ulong
+addr_hash(ulong addr)
+{
+	return (addr / PAGE_SIZE) * 0x9e3779b97f4a7c15UL;
+}
+
+static int
+addr_map_init(struct addr_map *m, ulong nr)
+{
+	ulong size = 16;
+
+	while (size < nr * 2)
+		size <<= 1;
+
+	m->key = calloc(size, sizeof(*m->key));
+	m->val = calloc(size, sizeof(*m->val));
+	m->mask = size - 1;
+
+	return (m->key && m->val) ? 0:-1;
+}
+
+static void
+addr_map_free(struct addr_map *m)
+{
+	free(m->key);
+	free(m->val);
+}
+
+static void
+addr_map_insert(struct addr_map *m, ulong addr, struct vmap_area *va)
+{
+	ulong i = addr_hash(addr) & m->mask;
+
+	while (m->key[i] && m->key[i] != addr)
+		i = (i + 1) & m->mask;
+
+	m->key[i] = addr;
+	m->val[i] = va;
+}
+
+/* Removes by a backward shift, so there are no tombstones. */
+static struct vmap_area *
+addr_map_remove(struct addr_map *m, ulong addr)
+{
+	ulong i = addr_hash(addr) & m->mask, j, h;
+	struct vmap_area *va;
+
+	while (m->key[i] != addr) {
+		if (!m->key[i])
+			return NULL;
+
+		i = (i + 1) & m->mask;
+	}
+
+	va = m->val[i];
+
+	for (j = (i + 1) & m->mask; m->key[j]; j = (j + 1) & m->mask) {
+		h = addr_hash(m->key[j]) & m->mask;
+
+		/* Can not be moved before its home slot. */
+		if (((j - h) & m->mask) < ((j - i) & m->mask))
+			continue;
+
+		m->key[i] = m->key[j];
+		m->val[i] = m->val[j];
+		i = j;
+	}
+
+	m->key[i] = 0;
+	m->val[i] = NULL;
+	return va;
+}
+
+static struct vm_trace_rec *
+trace_load(const char *path, ulong *nr)
+{
+	struct vm_trace_rec *recs;
+	struct vm_trace_hdr hdr;
+	long size;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return NULL;
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+			memcmp(hdr.magic, VM_TRACE_MAGIC, sizeof(VM_TRACE_MAGIC)) ||
+			hdr.version != VM_TRACE_VERSION ||
+			hdr.rec_size != sizeof(struct vm_trace_rec)) {
+		fprintf(stderr, "%s: not a trace or a version mismatch\n", path);
+		fclose(f);
+		return NULL;
+	}
+
+	(void) fseek(f, 0, SEEK_END);
+	size = ftell(f) - sizeof(hdr);
+	(void) fseek(f, sizeof(hdr), SEEK_SET);
+
+	*nr = size / sizeof(*recs);
+	if (!*nr) {
+		fprintf(stderr, "%s: no records\n", path);
+		fclose(f);
+		return NULL;
+	}
+
+	recs = malloc(*nr * sizeof(*recs));
+	if (recs && fread(recs, sizeof(*recs), *nr, f) != *nr) {
+		free(recs);
+		recs = NULL;
+	}
+
+	fclose(f);
+	return recs;
+}
+
+static void
+print_hist(const char *name, struct vm_stat_histogram *h)
+{
+	printf("%6s: %10lu %8lu %8lu %8lu %8lu %8lu %10lu\n", name, h->count,
+		h->count ? h->sum / h->count:0,
+		vm_stat_percentile(h, 50), vm_stat_percentile(h, 90),
+		vm_stat_percentile(h, 99), vm_stat_percentile(h, 99.9),
+		h->max);
+}
+
+static void
+print_free_space(const struct vmap_engine_ops *e, void *root)
+{
+	struct vm_frag f;
+	int i;
+
+	e->frag_scan(root, &f);
+
+	printf("-> free: %lu MB, largest: %lu MB, areas: %lu, frag: %.1f%%\n",
+		f.free_bytes >> 20, f.largest >> 20, f.nr_free,
+		100.0 * vm_frag_index(&f));
+
+	printf("-> areas per size class, pages:");
+	for (i = 0; i < VA_NR_CLASSES; i++)
+		if (f.nr_class[i])
+			printf(" %lu+: %lu", 1UL << i, f.nr_class[i]);
+	printf("\n");
+}
+
+static const struct {
+	const char *name;
+	enum vmap_fit_policy policy;
+} policies[] = {
+	{ "first", VMAP_FIRST_FIT },
+	{ "best", VMAP_BEST_FIT },
+	{ "next", VMAP_NEXT_FIT },
+	{ "top", VMAP_TOP_DOWN },
+};
+
+static void
+usage(const char *name)
+{
+	int i;
+
+	printf("Usage: %s [-E engine] [-P first|best|next|top] [-l] <trace>\n"
+		"  -E  a free space engine, default bpt:", name);
+	for (i = 0; i < nr_vmap_engines; i++)
+		printf(" %s", vmap_engines[i].name);
+
+	printf("\n"
+		"  -P  a fit policy, default first\n"
+		"  -l  free lazily\n");
+}
+
+int main(int argc, char **argv)
+{
+	enum vmap_fit_policy policy = VMAP_FIRST_FIT;
+	ulong nr, i, nr_allocs = 0, nr_traced_failed = 0;
+	ulong nr_failed = 0, nr_extra = 0, nr_unknown = 0;
+	ulong vstart = ULONG_MAX, vend = 0;
+	const struct vmap_engine_ops *e = &vmap_engines[0];
+	struct vm_trace_rec *recs, *r;
+	struct vmap_area *va;
+	struct addr_map map;
+	struct vm_stat *st;
+	bool lazy = false;
+	void *root;
+	ulong a, b;
+	int opt, j;
+
+	while ((opt = getopt(argc, argv, "E:P:lh")) != -1) {
+		switch (opt) {
+		case 'E':
+			e = vmap_engine_lookup(optarg);
+			if (!e) {
+				usage(argv[0]);
+				return -1;
+			}
+			break;
+		case 'P':
+			for (j = 0; j < sizeof(policies) / sizeof(policies[0]); j++)
+				if (!strcmp(policies[j].name, optarg))
+					break;
+
+			if (j == sizeof(policies) / sizeof(policies[0])) {
+				usage(argv[0]);
+				return -1;
+			}
+
+			policy = policies[j].policy;
+			break;
+		case 'l':
+			lazy = true;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : -1;
+		}
+	}
+
+	if (optind >= argc) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	if ((policy != VMAP_FIRST_FIT && !e->set_policy) ||
+			(lazy && !e->free_lazy)) {
+		fprintf(stderr, "%s: -P and -l are not supported\n", e->name);
+		return -1;
+	}
+
+	recs = trace_load(argv[optind], &nr);
+	if (!recs)
+		return -1;
+
+	for (i = 0; i < nr; i++) {
+		if (recs[i].op != VM_TRACE_ALLOC)
+			continue;
+
+		if (recs[i].vstart < vstart)
+			vstart = recs[i].vstart;
+		if (recs[i].vend > vend)
+			vend = recs[i].vend;
+
+		nr_allocs++;
+		nr_traced_failed += !recs[i].addr;
+	}
+
+	if (!nr_allocs) {
+		printf("-> no allocations in the trace\n");
+		return 0;
+	}
+
+	if (addr_map_init(&map, nr_allocs))
+		BUG();
+
+	root = e->create(vstart, vend);
+	if (!root)
+		BUG();
+
+	if (e->set_policy)
+		e->set_policy(root, policy);
+
+	printf("-> %s, %lu records, %lu allocs, %lu frees, space %#lx-%#lx\n",
+		e->name, nr, nr_allocs, nr - nr_allocs, vstart, vend);
+
+	vm_stat_enable();
+	vm_stat_reset();
+
+	a = vm_stat_now();
+	for (i = 0; i < nr; i++) {
+		r = &recs[i];
+
+		if (r->op == VM_TRACE_ALLOC) {
+			va = e->alloc(root, r->size, r->align,
+				r->vstart, r->vend);
+
+			if (!va) {
+				nr_failed++;
+			} else if (r->addr) {
+				addr_map_insert(&map, r->addr, va);
+			} else {
+				/* Failed when traced, so it is never freed. */
+				(void) e->free(root, va);
+				nr_extra++;
+			}
+		} else {
+			va = addr_map_remove(&map, r->addr);
+			if (!va) {
+				nr_unknown++;
+				continue;
+			}
+
+			if (lazy)
+				(void) e->free_lazy(root, va);
+			else
+				(void) e->free(root, va);
+		}
+	}
+	b = vm_stat_now();
+
+	if (e->purge)
+		e->purge(root);
+
+	st = malloc(sizeof(*st));
+	if (!st)
+		BUG();
+
+	vm_stat_sum(st);
+
+	printf("-> %.1f msec, %.2f Mops/s\n", (double) (b - a) / 1000000,
+		(double) nr * 1000 / (b - a));
+	printf("%6s  %10s %8s %8s %8s %8s %8s %10s\n", "nsec", "count",
+		"mean", "p50", "p90", "p99", "p999", "max");
+	print_hist("alloc", &st->hist[VM_STAT_ALLOC]);
+	print_hist("free", &st->hist[VM_STAT_FREE]);
+	printf("-> failed allocs: %lu (traced: %lu), given back at once: %lu, "
+		"unknown frees: %lu\n", nr_failed, nr_traced_failed, nr_extra,
+		nr_unknown);
+	print_free_space(e, root);
+
+	e->destroy(root);
+	addr_map_free(&map);
+	free(st);
+	free(recs);
+	return 0;
+}
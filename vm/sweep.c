@@ -0,0 +1,184 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+#include "vm_stat.h"
+
+/*
+ * Alloc and free latency and node memory per tree order. The tree is linked in once
+ * per order of SWEEP_ORDERS, see vm_names.h and the Makefile, which
+ * defines it as X(8) X(16) ... An order is bounded by a slab, the
+ * build of its objects fails if its nodes do not fit, see vm.h.
+ * Every order runs the same workload: a fragmented free space is
+ * built and then churned. Build it with -O2 or -O3 for real numbers.
+ */
+#ifndef SWEEP_ORDERS
+#define SWEEP_ORDERS X(24)
+#endif
+
+#define X(m)								\
+	extern struct kmem_cache bpn_inter_cachep_o##m;			\
+	extern struct kmem_cache bpn_leaf_cachep_o##m;			\
+	extern int vm_init_free_space_o##m(struct bpt_root *,		\
+		ulong, ulong);						\
+	extern struct vmap_area *alloc_vmap_area_o##m(struct bpt_root *, \
+		ulong, ulong, ulong, ulong);				\
+	extern int free_vmap_area_o##m(struct bpt_root *,		\
+		struct vmap_area *);
+SWEEP_ORDERS
+#undef X
+
+struct sweep_order {
+	int order;
+	struct kmem_cache *inter;
+	struct kmem_cache *leaf;
+	int (*init)(struct bpt_root *, ulong, ulong);
+	struct vmap_area *(*alloc)(struct bpt_root *,
+		ulong, ulong, ulong, ulong);
+	int (*free)(struct bpt_root *, struct vmap_area *);
+};
+
+static const struct sweep_order orders[] = {
+#define X(m)								\
+	{ m, &bpn_inter_cachep_o##m, &bpn_leaf_cachep_o##m,		\
+		vm_init_free_space_o##m,				\
+		alloc_vmap_area_o##m, free_vmap_area_o##m },
+	SWEEP_ORDERS
+#undef X
+};
+
+#define NR_ORDERS (sizeof(orders) / sizeof(orders[0]))
+
+/* Bytes of slabs of both node caches. */
+static inline ulong
+nodes_bytes(const struct sweep_order *o)
+{
+	return o->inter->nr_slabs * o->inter->slab_size +
+		o->leaf->nr_slabs * o->leaf->slab_size;
+}
+
+static inline ulong
+rand_size(void)
+{
+	return ((rand() % 16) + 1) * PAGE_SIZE;
+}
+
+/*
+ * Allocates 2 * nr areas and frees every second one, so there are
+ * about nr free blocks. Then every op frees a random live area and
+ * allocates a new one, only the churn is measured.
+ */
+static void
+run_order(const struct sweep_order *o, ulong nr, ulong nr_ops)
+{
+	struct vmap_area **live;
+	struct bpt_root root;
+	struct vm_stat *st;
+	ulong i, k, nr_live;
+
+	live = calloc(nr * 2, sizeof(*live));
+	st = malloc(sizeof(*st));
+	if (!live || !st)
+		BUG();
+
+	srand(0);
+	o->init(&root, VMALLOC_START, VMALLOC_END);
+
+	for (i = 0; i < nr * 2; i++) {
+		live[i] = o->alloc(&root, rand_size(), PAGE_SIZE,
+			VMALLOC_START, VMALLOC_END);
+		if (!live[i])
+			BUG();
+	}
+
+	for (i = 0, nr_live = 0; i < nr * 2; i++) {
+		if (i & 1)
+			live[nr_live++] = live[i];
+		else
+			(void) o->free(&root, live[i]);
+	}
+
+	vm_stat_reset();
+
+	for (i = 0; i < nr_ops; i++) {
+		k = rand() % nr_live;
+		(void) o->free(&root, live[k]);
+
+		live[k] = o->alloc(&root, rand_size(), PAGE_SIZE,
+			VMALLOC_START, VMALLOC_END);
+		if (!live[k])
+			BUG();
+	}
+
+	vm_stat_sum(st);
+
+	/* Slabs are never given back, it is a peak per a free area. */
+	printf("%6d %7lu %7lu %9lu %6.1f %7lu %7lu %7lu %7lu %7lu %7lu\n",
+		o->order, o->inter->size, o->leaf->size,
+		nodes_bytes(o) >> 10, (double) nodes_bytes(o) / nr,
+		st->hist[VM_STAT_ALLOC].sum / nr_ops,
+		vm_stat_percentile(&st->hist[VM_STAT_ALLOC], 50),
+		vm_stat_percentile(&st->hist[VM_STAT_ALLOC], 99),
+		st->hist[VM_STAT_FREE].sum / nr_ops,
+		vm_stat_percentile(&st->hist[VM_STAT_FREE], 50),
+		vm_stat_percentile(&st->hist[VM_STAT_FREE], 99));
+
+	while (nr_live)
+		(void) o->free(&root, live[--nr_live]);
+
+	free(live);
+	free(st);
+}
+
+static void
+usage(const char *name)
+{
+	printf("Usage: %s [-n free blocks] [-i ops] [-o order]\n"
+		"  -o  only this order, all of them by default\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	ulong nr_free = 100000;
+	ulong nr_ops = 1000000;
+	int opt, order = 0;
+	int i;
+
+	while ((opt = getopt(argc, argv, "n:i:o:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			nr_free = strtoul(optarg, NULL, 10);
+			break;
+		case 'i':
+			nr_ops = strtoul(optarg, NULL, 10);
+			break;
+		case 'o':
+			order = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : -1;
+		}
+	}
+
+	if (!nr_free || !nr_ops) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	vm_stat_enable();
+
+	printf("-> free blocks: %lu, ops: %lu, nsec per op\n",
+		nr_free, nr_ops);
+	printf("%6s %7s %7s %9s %6s %7s %7s %7s %7s %7s %7s\n", "order",
+		"inner B", "leaf B", "nodes KB", "B/area", "alloc", "p50",
+		"p99", "free", "p50", "p99");
+
+	for (i = 0; i < NR_ORDERS; i++)
+		if (!order || orders[i].order == order)
+			run_order(&orders[i], nr_free, nr_ops);
+
+	return 0;
+}
@@ -5,15 +5,29 @@
 #include <assert.h>
 #include <time.h>
 #include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
 
 #include "vm.h"
 #include "vm_ops.h"
+#include "vm_pcpu.h"
+#include "vm_olc.h"
+#include "vm_zone.h"
+#include "vm_reclaim.h"
+#include "vm_mmap.h"
+#include "vm_class.h"
+#include "vm_engine.h"
+#include "vm_stat.h"
 #include "debug.h"
 
 static struct bpt_root free_area_root;
 static pthread_spinlock_t free_area_lock;
+static struct vmap_pcpu free_area_pcpu;
 ulong free_area_vstart = PAGE_SIZE;
 ulong free_area_vend = ULONG_MAX;
+static int nr_iterations = 100;
+static bool lazy_free;
+static bool busy_index;
 
 static int
 ascending_order(const void *a, const void *b)
@@ -97,11 +111,13 @@ verify_meta_data(struct bpt_root *root)
 			bool va_start_sort_broken = false;
 			bool sub_avail_broken = false;
 
-			tmp = lookup_smallest_va(root, va_size(va), 1, va->va_start, &node);
+			tmp = lookup_smallest_va(root, va_size(va), 1, va->va_start,
+				ULONG_MAX, &node);
 			if (tmp != va)
 				sub_avail_broken = true;
 
-			tmp = lookup_smallest_va(root, 1, 1, va->va_start, &node);
+			tmp = lookup_smallest_va(root, 1, 1, va->va_start,
+				ULONG_MAX, &node);
 			if (tmp != va)
 				va_start_sort_broken = true;
 
@@ -118,13 +134,32 @@ verify_meta_data(struct bpt_root *root)
 	return 0;
 }
 
+static __always_inline int
+do_free_vmap_area(struct vmap_area *va)
+{
+	if (busy_index) {
+		ulong addr = va->va_start;
+
+		/* Any address within it. */
+		BUG_ON(find_vmap_area(&free_area_root,
+			addr + (va_size(va) >> 1)) != va);
+
+		return vfree_addr(&free_area_root, addr);
+	}
+
+	if (lazy_free)
+		return free_vmap_area_lazy(&free_area_root, va);
+
+	return free_vmap_area(&free_area_root, va);
+}
+
 static void *
 thread_job(void *arg)
 {
 	struct vmap_area *va;
 	struct vmap_area **array;
 	int max_defer_free = 10000;
-	int iteration = 100;
+	int iteration = nr_iterations;
 	ulong alloc_nsec;
 	ulong free_nsec;
 	int i, j, k;
@@ -163,7 +198,7 @@ thread_job(void *arg)
 				pthread_spin_lock(&free_area_lock);
 				for (k = 0; k < j; k++) {
 					time_now(&a);
-					(void) free_vmap_area(&free_area_root, array[k]);
+					(void) do_free_vmap_area(array[k]);
 					time_now(&b);
 
 					free_nsec += time_diff(&a, &b);
@@ -181,9 +216,9 @@ thread_job(void *arg)
 				(void) verify_meta_data(&free_area_root);
 				pthread_spin_unlock(&free_area_lock);
 
-				printf("-> Nr nodes: %d, high is: %d, "
-					   "node size: %ld, alloc: %ld nsec, free: %ld nsec\n",
-					   nr, high, sizeof(struct bpn), alloc_nsec, free_nsec);
+				printf("-> Nr leaves: %d, high is: %d, "
+					   "leaf size: %lu, alloc: %ld nsec, free: %ld nsec\n",
+					   nr, high, BPN_LEAF_SIZE, alloc_nsec, free_nsec);
 
 				alloc_nsec = 0;
 				free_nsec = 0;
@@ -198,7 +233,7 @@ thread_job(void *arg)
 	if (j) {
 		pthread_spin_lock(&free_area_lock);
 		for (i = 0; i < j; i++)
-			(void) free_vmap_area(&free_area_root, array[i]);
+			(void) do_free_vmap_area(array[i]);
 		pthread_spin_unlock(&free_area_lock);
 	}
 
@@ -206,19 +241,88 @@ thread_job(void *arg)
 	return NULL;
 }
 
-static void test_alloc_free(int nr_jobs)
+/*
+ * Small, page aligned requests served by per-CPU blocks. The
+ * global lock is taken internally and only on refill or release.
+ */
+static void *
+pcpu_thread_job(void *arg)
+{
+	struct vmap_area **array;
+	struct vmap_area *va;
+	int max_defer_free = 10000;
+	int iteration = nr_iterations;
+	struct timespec a, b;
+	ulong alloc_nsec = 0;
+	ulong nr_alloc = 0;
+	int i, j, k;
+
+	srand(time(NULL));
+	array = calloc(max_defer_free, sizeof(struct vmap_area *));
+	j = 0;
+
+	while (iteration--) {
+		for (i = 0; i < 100000; i++) {
+			ulong size = ((rand() % VMAP_MAX_ALLOC_PAGES) + 1) * PAGE_SIZE;
+			int mask = rand_mask(3);
+
+			time_now(&a);
+			va = vmap_pcpu_alloc(&free_area_pcpu, size, PAGE_SIZE);
+			time_now(&b);
+			if (va)
+				array[j++] = va;
+
+			alloc_nsec += time_diff(&a, &b);
+			nr_alloc++;
+
+			if (mask & 0x1 || j == max_defer_free) {
+				shuffle(array, j, sizeof(ulong *), mask);
+
+				for (k = 0; k < j; k++)
+					(void) vmap_pcpu_free(&free_area_pcpu, array[k]);
+				j = 0;
+			}
+		}
+	}
+
+	for (i = 0; i < j; i++)
+		(void) vmap_pcpu_free(&free_area_pcpu, array[i]);
+
+	printf("-> %d per-CPU DONE, alloc: %lu nsec avg\n",
+		gettid(), alloc_nsec / (nr_alloc ? nr_alloc : 1));
+
+	free(array);
+	return NULL;
+}
+
+static void test_alloc_free(int nr_jobs, bool pcpu)
 {
 	pthread_t th_array[nr_jobs];
 	int i, rv;
 
 	vm_init_free_space(&free_area_root, free_area_vstart, free_area_vend);
+	if (busy_index && vm_init_busy_index(&free_area_root))
+		BUG();
+
+	/* A free by address goes to the queue as well. */
+	if (lazy_free)
+		free_area_root.flags |= BPT_LAZY_FREE;
+
 	rv = pthread_spin_init(&free_area_lock, PTHREAD_PROCESS_PRIVATE);
 	if (rv)
 		BUG();
 
+	if (pcpu) {
+		rv = vmap_pcpu_init(&free_area_pcpu, &free_area_root,
+			&free_area_lock, VMALLOC_START, VMALLOC_END);
+		if (rv)
+			BUG();
+	}
+
 	pthread_spin_lock(&free_area_lock);
 	for (i = 0; i < nr_jobs; i++) {
-		(void) pthread_create(&th_array[i], NULL, thread_job, NULL);
+		(void) pthread_create(&th_array[i], NULL,
+			pcpu ? pcpu_thread_job : thread_job, NULL);
 	}
 	pthread_spin_unlock(&free_area_lock);
 	printf("-> Started %d jobs...\n", nr_jobs);
@@ -226,11 +330,1197 @@ static void test_alloc_free(int nr_jobs)
 	for (i = 0; i < nr_jobs; i++)
 		(void) pthread_join(th_array[i], NULL);
 
+	if (pcpu)
+		vmap_pcpu_destroy(&free_area_pcpu);
+
+	purge_vmap_area_lazy(&free_area_root);
+
 	dump_tree(&free_area_root);
 }
 
+struct scale_job {
+	ulong vstart;
+	ulong vend;
+	ulong nr_ops;
+	bool olc;
+};
+
+/*
+ * Every thread allocates within its own part of the space, so with
+ * fine-grained locking threads touch different leafs. Areas are
+ * released in batches, in a random order.
+ */
+static void *
+scale_thread_job(void *arg)
+{
+	struct scale_job *job = arg;
+	struct vmap_area **array, *va;
+	int max_defer_free = 1000;
+	unsigned int seed = job->vstart >> 32;
+	ulong i;
+	int j, k, l;
+
+	array = calloc(max_defer_free, sizeof(struct vmap_area *));
+	if (!array)
+		BUG();
+
+	for (i = 0, j = 0; i < job->nr_ops; i++) {
+		ulong size = ((rand_r(&seed) % 16) + 1) * PAGE_SIZE;
+
+		if (job->olc) {
+			va = alloc_vmap_area_olc(&free_area_root, size, PAGE_SIZE,
+				job->vstart, job->vend);
+		} else {
+			pthread_spin_lock(&free_area_lock);
+			va = alloc_vmap_area(&free_area_root, size, PAGE_SIZE,
+				job->vstart, job->vend);
+			pthread_spin_unlock(&free_area_lock);
+		}
+
+		if (va)
+			array[j++] = va;
+
+		if (j < max_defer_free && i + 1 < job->nr_ops)
+			continue;
+
+		for (k = j - 1; k > 0; k--) {
+			l = rand_r(&seed) % (k + 1);
+			va = array[k], array[k] = array[l], array[l] = va;
+		}
+
+		for (k = 0; k < j; k++) {
+			if (job->olc) {
+				(void) free_vmap_area_olc(&free_area_root, array[k]);
+			} else {
+				pthread_spin_lock(&free_area_lock);
+				(void) free_vmap_area(&free_area_root, array[k]);
+				pthread_spin_unlock(&free_area_lock);
+			}
+		}
+
+		j = 0;
+	}
+
+	free(array);
+	return NULL;
+}
+
+static double
+run_scale(int nr_jobs, ulong nr_ops, bool olc)
+{
+	ulong part = (VMALLOC_END - VMALLOC_START) / nr_jobs;
+	struct scale_job jobs[nr_jobs];
+	pthread_t th_array[nr_jobs];
+	struct timespec a, b;
+	struct vmap_area *va;
+	ulong nsec;
+	int i;
+
+	vm_init_free_space(&free_area_root, VMALLOC_START, VMALLOC_END);
+
+	for (i = 0; i < nr_jobs; i++) {
+		jobs[i].vstart = VMALLOC_START + part * i;
+		jobs[i].vend = jobs[i].vstart + part;
+		jobs[i].nr_ops = nr_ops;
+		jobs[i].olc = olc;
+	}
+
+	time_now(&a);
+	for (i = 0; i < nr_jobs; i++)
+		(void) pthread_create(&th_array[i], NULL,
+			scale_thread_job, &jobs[i]);
+
+	for (i = 0; i < nr_jobs; i++)
+		(void) pthread_join(th_array[i], NULL);
+	time_now(&b);
+
+	nsec = time_diff(&a, &b);
+
+	/* Everything is back, it must be one area again. */
+	va = bpn_get_val(free_area_root.node, 0);
+	BUG_ON(free_area_root.node->entries != 1);
+	BUG_ON(va->va_start != VMALLOC_START || va->va_end != VMALLOC_END);
+
+	vmap_area_free(va);
+	bpt_root_destroy(&free_area_root);
+
+	/* An alloc and a free per op. */
+	return (double) nr_jobs * nr_ops * 1000 / nsec;
+}
+
+/*
+ * Compares concurrent entry points with the generic ones under a
+ * global lock, in million alloc/free pairs per second.
+ */
+static void test_scaling(void)
+{
+	ulong nr_ops = nr_iterations * 1000UL;
+	double global, olc;
+	int nr_jobs;
+
+	if (pthread_spin_init(&free_area_lock, PTHREAD_PROCESS_PRIVATE))
+		BUG();
+
+	printf("-> %lu alloc/free per thread, %ld online CPUs\n",
+		nr_ops, sysconf(_SC_NPROCESSORS_ONLN));
+	printf("%8s %14s %14s %8s\n", "threads", "global Mops/s",
+		"olc Mops/s", "ratio");
+
+	for (nr_jobs = 1; nr_jobs <= 64; nr_jobs <<= 1) {
+		global = run_scale(nr_jobs, nr_ops, false);
+		olc = run_scale(nr_jobs, nr_ops, true);
+
+		printf("%8d %14.2f %14.2f %8.2f\n",
+			nr_jobs, global, olc, olc / global);
+	}
+}
+
+struct zone_job {
+	struct vmap_zones *vz;
+	struct vmap_area **array;
+	ulong nr_ops;
+	ulong nr_failed;
+	int nr_live;
+};
+
+/*
+ * Allocations are kept alive in batches and some of them are freed
+ * in a random order, whatever is left is measured by a caller.
+ */
+static void *
+zone_thread_job(void *arg)
+{
+	struct zone_job *job = arg;
+	int max_live = 1000;
+	unsigned int seed = gettid();
+	struct vmap_area *va;
+	ulong i;
+	int k;
+
+	job->array = calloc(max_live, sizeof(struct vmap_area *));
+	if (!job->array)
+		BUG();
+
+	for (i = 0, job->nr_live = 0; i < job->nr_ops; i++) {
+		ulong size = ((rand_r(&seed) % 64) + 1) * PAGE_SIZE;
+
+		va = vmap_zones_alloc(job->vz, size, PAGE_SIZE);
+		if (va)
+			job->array[job->nr_live++] = va;
+		else
+			job->nr_failed++;
+
+		if (job->nr_live < max_live)
+			continue;
+
+		/* Free a random half. */
+		for (k = 0; k < max_live / 2; k++) {
+			int l = rand_r(&seed) % job->nr_live;
+
+			(void) vmap_zones_free(job->vz, job->array[l]);
+			job->array[l] = job->array[--job->nr_live];
+		}
+	}
+
+	return NULL;
+}
+
+static void
+run_zones(int nr_jobs, int nr_zones, ulong space)
+{
+	struct zone_job jobs[nr_jobs];
+	pthread_t th_array[nr_jobs];
+	struct vmap_zones_stat st;
+	struct vmap_zones vz;
+	struct timespec a, b;
+	ulong nr_failed = 0;
+	ulong nsec;
+	int i, k;
+
+	if (vmap_zones_init(&vz, nr_zones, VMALLOC_START, VMALLOC_START + space))
+		BUG();
+
+	memset(jobs, 0, sizeof(jobs));
+
+	time_now(&a);
+	for (i = 0; i < nr_jobs; i++) {
+		jobs[i].vz = &vz;
+		jobs[i].nr_ops = nr_iterations * 1000UL;
+		(void) pthread_create(&th_array[i], NULL, zone_thread_job, &jobs[i]);
+	}
+
+	for (i = 0; i < nr_jobs; i++)
+		(void) pthread_join(th_array[i], NULL);
+	time_now(&b);
+
+	nsec = time_diff(&a, &b);
+	vmap_zones_stat(&vz, &st);
+
+	for (i = 0; i < nr_jobs; i++) {
+		for (k = 0; k < jobs[i].nr_live; k++)
+			(void) vmap_zones_free(&vz, jobs[i].array[k]);
+
+		nr_failed += jobs[i].nr_failed;
+		free(jobs[i].array);
+	}
+
+	printf("%6d %10.2f %10lu %10lu %8lu %7.1f%% %8lu\n", nr_zones,
+		(double) nr_jobs * nr_iterations * 1000UL * 1000 / nsec,
+		st.free >> 20, st.largest >> 20, st.nr_areas,
+		st.free ? 100.0 - (100.0 * st.largest / st.free):0.0,
+		nr_failed);
+
+	vmap_zones_destroy(&vz);
+}
+
+/*
+ * A single zone against "nr_zones" ones. The space is small enough,
+ * so zones get exhausted and threads fall back to neighbours.
+ */
+static void test_zones(int nr_jobs, int nr_zones)
+{
+	ulong space = 1UL << 32;
+
+	printf("-> %d threads, %lu allocs per thread, %lu MB space\n",
+		nr_jobs, nr_iterations * 1000UL, space >> 20);
+	printf("%6s %10s %10s %10s %8s %8s %8s\n", "zones", "Mops/s",
+		"free MB", "max MB", "areas", "frag", "failed");
+
+	run_zones(nr_jobs, 1, space);
+	if (nr_zones > 1)
+		run_zones(nr_jobs, nr_zones, space);
+}
+
+struct reclaim_job {
+	struct vmap_reclaim *rc;
+	ulong vstart;
+	ulong vend;
+	ulong nr_ops;
+	ulong free_nsec;
+};
+
+/*
+ * Same as scale_thread_job(), but areas are freed either under the
+ * global lock or to a reclaimer and only a free is measured.
+ */
+static void *
+reclaim_thread_job(void *arg)
+{
+	struct reclaim_job *job = arg;
+	struct vmap_area **array, *va;
+	int max_defer_free = 1000;
+	unsigned int seed = gettid();
+	struct timespec a, b;
+	ulong i;
+	int j, k, l;
+
+	array = calloc(max_defer_free, sizeof(struct vmap_area *));
+	if (!array)
+		BUG();
+
+	for (i = 0, j = 0; i < job->nr_ops; i++) {
+		ulong size = ((rand_r(&seed) % 16) + 1) * PAGE_SIZE;
+
+		if (job->rc) {
+			va = vmap_reclaim_alloc(job->rc, size, PAGE_SIZE);
+		} else {
+			pthread_spin_lock(&free_area_lock);
+			va = alloc_vmap_area(&free_area_root, size, PAGE_SIZE,
+				job->vstart, job->vend);
+			pthread_spin_unlock(&free_area_lock);
+		}
+
+		if (va)
+			array[j++] = va;
+
+		if (j < max_defer_free && i + 1 < job->nr_ops)
+			continue;
+
+		for (k = j - 1; k > 0; k--) {
+			l = rand_r(&seed) % (k + 1);
+			va = array[k], array[k] = array[l], array[l] = va;
+		}
+
+		time_now(&a);
+		for (k = 0; k < j; k++) {
+			if (job->rc) {
+				(void) vmap_reclaim_free(job->rc, array[k]);
+			} else {
+				pthread_spin_lock(&free_area_lock);
+				(void) free_vmap_area(&free_area_root, array[k]);
+				pthread_spin_unlock(&free_area_lock);
+			}
+		}
+		time_now(&b);
+
+		job->free_nsec += time_diff(&a, &b);
+		j = 0;
+	}
+
+	free(array);
+	return NULL;
+}
+
+static void
+run_reclaim(int nr_jobs, ulong space, bool async)
+{
+	ulong nr_ops = nr_iterations * 1000UL;
+	struct reclaim_job jobs[nr_jobs];
+	pthread_t th_array[nr_jobs];
+	struct vmap_reclaim rc;
+	struct timespec a, b;
+	struct vm_stat *st;
+	struct vmap_area *va;
+	ulong nsec, free_nsec = 0;
+	int i;
+
+	vm_init_free_space(&free_area_root, VMALLOC_START, VMALLOC_START + space);
+	if (async && vmap_reclaim_init(&rc, &free_area_root, &free_area_lock,
+			VMALLOC_START, VMALLOC_START + space))
+		BUG();
+
+	vm_stat_reset();
+
+	for (i = 0; i < nr_jobs; i++) {
+		jobs[i].rc = async ? &rc : NULL;
+		jobs[i].vstart = VMALLOC_START;
+		jobs[i].vend = VMALLOC_START + space;
+		jobs[i].nr_ops = nr_ops;
+		jobs[i].free_nsec = 0;
+	}
+
+	time_now(&a);
+	for (i = 0; i < nr_jobs; i++)
+		(void) pthread_create(&th_array[i], NULL,
+			reclaim_thread_job, &jobs[i]);
+
+	for (i = 0; i < nr_jobs; i++) {
+		(void) pthread_join(th_array[i], NULL);
+		free_nsec += jobs[i].free_nsec;
+	}
+	time_now(&b);
+
+	if (async)
+		vmap_reclaim_destroy(&rc);
+
+	nsec = time_diff(&a, &b);
+
+	st = malloc(sizeof(*st));
+	if (!st)
+		BUG();
+
+	vm_stat_sum(st);
+
+	printf("%6s %10.2f %10lu %10lu %10lu %10lu\n", async ? "async":"sync",
+		(double) nr_jobs * nr_ops * 1000 / nsec,
+		free_nsec / st->hist[VM_STAT_FREE].count,
+		st->counter[VM_STAT_RECLAIMED],
+		st->counter[VM_STAT_RECLAIM_SYNC],
+		st->counter[VM_STAT_RECLAIM_FULL]);
+
+	/* Everything is back, it must be one area again. */
+	va = bpn_get_val(free_area_root.node, 0);
+	BUG_ON(free_area_root.node->entries != 1);
+	BUG_ON(va->va_start != VMALLOC_START ||
+		va->va_end != VMALLOC_START + space);
+
+	vmap_area_free(va);
+	bpt_root_destroy(&free_area_root);
+	free(st);
+}
+
+/*
+ * Frees under the global lock against the reclaimer. The space is
+ * small enough, so allocators have to drain the queue sometimes.
+ */
+static void test_reclaim(int nr_jobs)
+{
+	ulong space = nr_jobs * 1000UL * 16 * PAGE_SIZE;
+
+	if (pthread_spin_init(&free_area_lock, PTHREAD_PROCESS_PRIVATE))
+		BUG();
+
+	vm_stat_enable();
+
+	printf("-> %d threads, %lu alloc/free per thread, %lu MB space\n",
+		nr_jobs, nr_iterations * 1000UL, space >> 20);
+	printf("%6s %10s %10s %10s %10s %10s\n", "free", "Mops/s",
+		"free nsec", "reclaimed", "sync", "full");
+
+	run_reclaim(nr_jobs, space, false);
+	run_reclaim(nr_jobs, space, true);
+}
+
+/*
+ * Batches of same sized areas, one by one against alloc_vmap_areas().
+ * Every second batch is kept, so the tree gets fragmented.
+ */
+static void test_batch(int nr)
+{
+	struct vmap_area *out[nr];
+	ulong sizes[nr], size;
+	ulong single = 0, batch = 0;
+	ulong nr_rounds = nr_iterations * 100UL;
+	struct vmap_area **keep;
+	struct timespec a, b;
+	ulong i, nr_keep = 0;
+	int j, pass;
+
+	keep = calloc(nr_rounds * nr, sizeof(*keep));
+	if (!keep)
+		BUG();
+
+	vm_init_free_space(&free_area_root, VMALLOC_START, VMALLOC_END);
+	srand(0);
+
+	for (i = 0; i < nr_rounds; i++) {
+		size = ((rand() % 16) + 1) * PAGE_SIZE;
+		for (j = 0; j < nr; j++)
+			sizes[j] = size;
+
+		for (pass = 0; pass < 2; pass++) {
+			time_now(&a);
+			if (pass) {
+				if (alloc_vmap_areas(&free_area_root, nr, sizes,
+						PAGE_SIZE, VMALLOC_START, VMALLOC_END, out))
+					BUG();
+			} else {
+				for (j = 0; j < nr; j++) {
+					out[j] = alloc_vmap_area(&free_area_root, size,
+						PAGE_SIZE, VMALLOC_START, VMALLOC_END);
+					BUG_ON(!out[j]);
+				}
+			}
+			time_now(&b);
+
+			if (pass)
+				batch += time_diff(&a, &b);
+			else
+				single += time_diff(&a, &b);
+
+			for (j = 0; j < nr; j++) {
+				if (i & 1)
+					keep[nr_keep++] = out[j];
+				else
+					(void) free_vmap_area(&free_area_root, out[j]);
+			}
+		}
+	}
+
+	for (i = 0; i < nr_keep; i++)
+		(void) free_vmap_area(&free_area_root, keep[i]);
+
+	printf("-> %lu batches of %d areas, single: %lu nsec/area, "
+		"batch: %lu nsec/area\n", nr_rounds, nr,
+		single / (nr_rounds * nr), batch / (nr_rounds * nr));
+
+	free(keep);
+}
+
+/*
+ * Mostly small areas with a few big ones. A live set is churned in
+ * a small space, so a policy decides how fragmented it gets.
+ */
+static void run_fit(enum vmap_fit_policy policy, const char *name, ulong space)
+{
+	ulong nr_ops = nr_iterations * 1000UL;
+	ulong nsec = 0, nr_failed = 0;
+	int max_live = 20000, nr_live = 0;
+	struct vmap_area **array, *va;
+	struct vm_frag scan, kept;
+	struct timespec a, b;
+	ulong i, size;
+	int k;
+
+	array = calloc(max_live, sizeof(*array));
+	if (!array)
+		BUG();
+
+	vm_init_free_space(&free_area_root, VMALLOC_START, VMALLOC_START + space);
+	vm_set_fit_policy(&free_area_root, policy);
+	if (vm_init_frag_stat(&free_area_root))
+		BUG();
+
+	srand(0);
+
+	for (i = 0; i < nr_ops; i++) {
+		size = ((rand() % 16) + 1) * PAGE_SIZE;
+		if (!(rand() % 16))
+			size *= 16;
+
+		time_now(&a);
+		array[nr_live] = alloc_vmap_area(&free_area_root, size,
+			PAGE_SIZE, VMALLOC_START, VMALLOC_START + space);
+		time_now(&b);
+		nsec += time_diff(&a, &b);
+
+		if (array[nr_live])
+			nr_live++;
+		else
+			nr_failed++;
+
+		if (nr_live < max_live)
+			continue;
+
+		/* Free a random half. */
+		for (k = 0; k < max_live / 2; k++) {
+			int l = rand() % nr_live;
+
+			(void) free_vmap_area(&free_area_root, array[l]);
+			array[l] = array[--nr_live];
+		}
+	}
+
+	/* Kept counters have to match a scan. */
+	vm_frag_scan(&free_area_root, &scan);
+	if (vm_frag_sample(&free_area_root, &kept))
+		BUG();
+	BUG_ON(memcmp(&scan, &kept, sizeof(scan)));
+
+	printf("%6s %10lu %10lu %10lu %8lu %7.1f%% %8lu\n", name,
+		nsec / nr_ops, scan.free_bytes >> 20, scan.largest >> 20,
+		scan.nr_free, 100.0 * vm_frag_index(&scan), nr_failed);
+
+	while (nr_live)
+		(void) free_vmap_area(&free_area_root, array[--nr_live]);
+
+	/* Everything is back, it must be one block of the whole space. */
+	if (vm_frag_sample(&free_area_root, &kept))
+		BUG();
+	BUG_ON(kept.nr_free != 1 || kept.free_bytes != space);
+	BUG_ON(kept.nr_class[va_size_class(space)] != 1);
+
+	va = bpn_get_val(free_area_root.node, 0);
+	BUG_ON(free_area_root.node->entries != 1);
+	vmap_area_free(va);
+	bpt_root_destroy(&free_area_root);
+
+	free(array);
+}
+
+/* Both trees have the same free areas in the same order. */
+static void
+compare_free_space(struct bpt_root *r1, struct bpt_root *r2)
+{
+	struct list_head *p1 = r1->head.next, *p2 = r2->head.next;
+	struct bpn *n1, *n2;
+	int i1 = 0, i2 = 0;
+
+	while (p1 != &r1->head && p2 != &r2->head) {
+		n1 = list_entry(p1, struct bpn, page.external.list);
+		n2 = list_entry(p2, struct bpn, page.external.list);
+
+		if (i1 == n1->entries) {
+			p1 = p1->next;
+			i1 = 0;
+			continue;
+		}
+
+		if (i2 == n2->entries) {
+			p2 = p2->next;
+			i2 = 0;
+			continue;
+		}
+
+		BUG_ON(n1->LEAF_VA_START[i1] != n2->LEAF_VA_START[i2]);
+		BUG_ON(n1->LEAF_VA_END[i1++] != n2->LEAF_VA_END[i2++]);
+	}
+
+	/* Both are walked up to the end, empty leafs are not expected. */
+	BUG_ON(p1 != &r1->head && i1 != n1->entries);
+	BUG_ON(p2 != &r2->head && i2 != n2->entries);
+}
+
+/*
+ * A fragmented free map is restored by an insert per area and by a
+ * bulk load, then the loaded tree is churned and compared again.
+ */
+static void test_load(void)
+{
+	ulong nr = nr_iterations * 1000UL, addr = VMALLOC_START;
+	ulong i, nr_live, insert, load;
+	struct vmap_area **va, **copy;
+	struct bpt_root root;
+	struct timespec a, b;
+
+	va = calloc(nr, sizeof(*va));
+	copy = calloc(nr, sizeof(*copy));
+	if (!va || !copy)
+		BUG();
+
+	srand(0);
+	for (i = 0; i < nr; i++) {
+		va[i] = vmap_area_alloc();
+		copy[i] = vmap_area_alloc();
+		BUG_ON(!va[i] || !copy[i]);
+
+		/* A busy gap and a free area. */
+		addr += ((rand() % 16) + 1) * PAGE_SIZE;
+		va[i]->va_start = copy[i]->va_start = addr;
+		addr += ((rand() % 16) + 1) * PAGE_SIZE;
+		va[i]->va_end = copy[i]->va_end = addr;
+	}
+
+	time_now(&a);
+	if (bpt_root_init(&root))
+		BUG();
+
+	for (i = 0; i < nr; i++)
+		if (bpt_po_insert(&root, va[i]))
+			BUG();
+	time_now(&b);
+	insert = time_diff(&a, &b);
+
+	time_now(&a);
+	if (vm_load_free_space(&free_area_root, copy, nr))
+		BUG();
+	time_now(&b);
+	load = time_diff(&a, &b);
+
+	compare_free_space(&root, &free_area_root);
+	(void) verify_meta_data(&free_area_root);
+
+	printf("-> %lu areas, insert: %lu usec, bulk load: %lu usec, "
+		"high: %d vs %d\n", nr, insert / 1000, load / 1000,
+		bpt_high(root.node), bpt_high(free_area_root.node));
+
+	/* Splits and merges over the loaded tree, copies are reused. */
+	for (nr_live = 0; nr_live < nr; nr_live++) {
+		copy[nr_live] = alloc_vmap_area(&free_area_root,
+			((rand() % 4) + 1) * PAGE_SIZE, PAGE_SIZE,
+			VMALLOC_START, VMALLOC_END);
+		if (!copy[nr_live])
+			break;
+	}
+
+	while (nr_live) {
+		i = rand() % nr_live;
+		(void) free_vmap_area(&free_area_root, copy[i]);
+		copy[i] = copy[--nr_live];
+	}
+
+	compare_free_space(&root, &free_area_root);
+	(void) verify_meta_data(&free_area_root);
+
+	free(copy);
+	free(va);
+}
+
+/*
+ * Buffers grow by a few pages at a time until they are big, then
+ * they are shrunk back to a page. It is done in place, or by alloc
+ * of a new area and free of the old one. A copy is not counted.
+ */
+static ulong
+run_grow(bool in_place, ulong *nr_in_place)
+{
+	ulong nr = nr_iterations * 100UL, nr_ops = nr_iterations * 1000UL;
+	struct vmap_area **buf, *va;
+	struct timespec a, b;
+	ulong i, k, size;
+
+	buf = calloc(nr, sizeof(*buf));
+	if (!buf)
+		BUG();
+
+	vm_init_free_space(&free_area_root, VMALLOC_START, VMALLOC_END);
+	if (busy_index && vm_init_busy_index(&free_area_root))
+		BUG();
+
+	srand(0);
+	for (i = 0; i < nr; i++) {
+		buf[i] = alloc_vmap_area(&free_area_root,
+			((rand() % 4) + 1) * PAGE_SIZE, PAGE_SIZE,
+			VMALLOC_START, VMALLOC_END);
+		BUG_ON(!buf[i]);
+	}
+
+	*nr_in_place = 0;
+	time_now(&a);
+
+	for (i = 0; i < nr_ops; i++) {
+		k = rand() % nr;
+		size = va_size(buf[k]) + ((rand() % 4) + 1) * PAGE_SIZE;
+
+		if (size > 256 * PAGE_SIZE) {
+			size = PAGE_SIZE;
+			if (in_place) {
+				if (shrink_vmap_area(&free_area_root, buf[k], size))
+					BUG();
+				(*nr_in_place)++;
+				continue;
+			}
+		} else if (in_place && !extend_vmap_area(&free_area_root,
+				buf[k], size, VMALLOC_END)) {
+			(*nr_in_place)++;
+			continue;
+		}
+
+		va = alloc_vmap_area(&free_area_root, size, PAGE_SIZE,
+			VMALLOC_START, VMALLOC_END);
+		BUG_ON(!va);
+
+		(void) free_vmap_area(&free_area_root, buf[k]);
+		buf[k] = va;
+	}
+
+	time_now(&b);
+
+	for (i = 0; i < nr; i++)
+		(void) free_vmap_area(&free_area_root, buf[i]);
+
+	(void) verify_meta_data(&free_area_root);
+	bpt_root_destroy(&free_area_root);
+	free(buf);
+
+	return time_diff(&a, &b) / nr_ops;
+}
+
+static void test_grow(void)
+{
+	ulong nr_ops = nr_iterations * 1000UL;
+	ulong in_place, realloc, nr_in_place, unused;
+
+	in_place = run_grow(true, &nr_in_place);
+	realloc = run_grow(false, &unused);
+
+	printf("-> %lu resizes, in place: %lu nsec/op (%lu%% done in place), "
+		"alloc + free: %lu nsec/op\n", nr_ops, in_place,
+		nr_in_place * 100 / nr_ops, realloc);
+}
+
+/*
+ * Mostly small areas with some big ones are churned, over the size
+ * class lists and over the tree alone. The whole space has to be
+ * one free area again at the end.
+ */
+static ulong
+run_class(bool classes)
+{
+	ulong nr = nr_iterations * 100UL, nr_ops = nr_iterations * 1000UL;
+	struct vmap_class_cache cc;
+	struct vmap_area **live;
+	struct timespec a, b;
+	ulong i, k, size;
+
+	live = calloc(nr, sizeof(*live));
+	if (!live)
+		BUG();
+
+	vm_init_free_space(&free_area_root, VMALLOC_START, VMALLOC_END);
+	if (busy_index && vm_init_busy_index(&free_area_root))
+		BUG();
+
+	pthread_spin_init(&free_area_lock, PTHREAD_PROCESS_PRIVATE);
+	if (classes && vmap_class_init(&cc, &free_area_root, &free_area_lock,
+			VMALLOC_START, VMALLOC_END))
+		BUG();
+
+	srand(0);
+	time_now(&a);
+
+	for (i = 0; i < nr + nr_ops; i++) {
+		k = i < nr ? i:rand() % nr;
+
+		if (i >= nr) {
+			if (classes) {
+				(void) vmap_class_free(&cc, live[k]);
+			} else {
+				pthread_spin_lock(&free_area_lock);
+				(void) free_vmap_area(&free_area_root, live[k]);
+				pthread_spin_unlock(&free_area_lock);
+			}
+		}
+
+		size = (rand() % 10) ? (rand() % 16) + 1:(rand() % 240) + 17;
+		size *= PAGE_SIZE;
+
+		if (classes) {
+			live[k] = vmap_class_alloc(&cc, size, PAGE_SIZE);
+		} else {
+			pthread_spin_lock(&free_area_lock);
+			live[k] = alloc_vmap_area(&free_area_root, size, PAGE_SIZE,
+				VMALLOC_START, VMALLOC_END);
+			pthread_spin_unlock(&free_area_lock);
+		}
+
+		BUG_ON(!live[k]);
+	}
+
+	time_now(&b);
+
+	for (i = 0; i < nr; i++) {
+		if (classes)
+			(void) vmap_class_free(&cc, live[i]);
+		else
+			(void) free_vmap_area(&free_area_root, live[i]);
+	}
+
+	if (classes)
+		vmap_class_destroy(&cc);
+
+	(void) verify_meta_data(&free_area_root);
+	BUG_ON(!is_bpn_external(free_area_root.node) ||
+		free_area_root.node->entries != 1);
+
+	bpt_root_destroy(&free_area_root);
+	free(live);
+
+	return time_diff(&a, &b) / (nr + nr_ops);
+}
+
+static void test_class(void)
+{
+	ulong tree, classes;
+
+	tree = run_class(false);
+	classes = run_class(true);
+
+	printf("-> %lu ops, tree: %lu nsec/op, size classes: %lu nsec/op\n",
+		nr_iterations * 1100UL, tree, classes);
+}
+
+/*
+ * Same requests against every engine. Random: an area of a random
+ * slot is replaced. LIFO: up to 16 of the latest areas are freed
+ * from the top and allocated again. A first fit is exact in both
+ * engines, so placements are the same, they are compared by a hash
+ * of addresses. The whole space has to be one free area at the end.
+ */
+static ulong
+run_engine(const struct vmap_engine_ops *e, bool lifo, ulong *hash)
+{
+	ulong nr = nr_iterations * 100UL, nr_ops = nr_iterations * 1000UL;
+	ulong i, j, k, d, size, nr_done = 0;
+	struct vmap_area **live;
+	struct timespec a, b;
+	struct vm_frag f;
+	void *root;
+
+	live = calloc(nr, sizeof(*live));
+	root = e->create(VMALLOC_START, VMALLOC_END);
+	if (!live || !root)
+		BUG();
+
+	srand(0);
+	*hash = 0;
+	time_now(&a);
+
+	for (i = 0; i < nr + nr_ops; i++) {
+		if (i < nr) {
+			k = d = i;
+		} else if (lifo) {
+			d = (rand() % 16) + 1;
+			for (j = 0; j < d; j++)
+				(void) e->free(root, live[nr - 1 - j]);
+
+			k = nr - d;
+			d = nr - 1;
+		} else {
+			k = d = rand() % nr;
+			(void) e->free(root, live[k]);
+		}
+
+		for (; k <= d; k++) {
+			size = (rand() % 10) ? (rand() % 16) + 1:(rand() % 240) + 17;
+
+			live[k] = e->alloc(root, size * PAGE_SIZE, PAGE_SIZE,
+				VMALLOC_START, VMALLOC_END);
+			BUG_ON(!live[k]);
+
+			*hash = *hash * 31 + live[k]->va_start;
+			nr_done++;
+		}
+	}
+
+	time_now(&b);
+
+	for (i = 0; i < nr; i++)
+		(void) e->free(root, live[i]);
+
+	e->frag_scan(root, &f);
+	BUG_ON(f.nr_free != 1 ||
+		f.free_bytes != VMALLOC_END - VMALLOC_START);
+
+	e->destroy(root);
+	free(live);
+
+	return time_diff(&a, &b) / nr_done;
+}
+
+static void test_engines(void)
+{
+	ulong hash[2], ref[2];
+	int i, j;
+
+	printf("%8s %14s %14s\n", "engine", "random nsec", "LIFO nsec");
+
+	for (i = 0; i < nr_vmap_engines; i++) {
+		printf("%8s", vmap_engines[i].name);
+
+		for (j = 0; j < 2; j++) {
+			printf(" %14lu", run_engine(&vmap_engines[i], j, &hash[j]));
+
+			if (!i)
+				ref[j] = hash[j];
+			else if (hash[j] != ref[j])
+				printf(" (placements differ from %s)",
+					vmap_engines[0].name);
+		}
+
+		printf("\n");
+	}
+}
+
+#define MMAP_MAX_LIVE 256
+
+static struct vmap_mmap free_area_mmap;
+static sigjmp_buf mmap_fault_jmp;
+
+static void
+mmap_fault(int sig)
+{
+	siglongjmp(mmap_fault_jmp, 1);
+}
+
+/* Returns true if a write to "p" faults. */
+static bool
+mmap_faults(volatile char *p)
+{
+	struct sigaction sa, old;
+	bool faulted = true;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = mmap_fault;
+	(void) sigaction(SIGSEGV, &sa, &old);
+
+	if (!sigsetjmp(mmap_fault_jmp, 1)) {
+		*p = 1;
+		faulted = false;
+	}
+
+	(void) sigaction(SIGSEGV, &old, NULL);
+	return faulted;
+}
+
+/*
+ * Every page of a buffer is tagged by a thread. A new one has to be
+ * zeroed, a tag has to be intact when it is freed.
+ */
+static void *
+mmap_thread_job(void *arg)
+{
+	ulong nr_ops = nr_iterations * 1000UL;
+	char *live[MMAP_MAX_LIVE] = { NULL };
+	ulong size[MMAP_MAX_LIVE];
+	unsigned int seed = gettid();
+	char tag = (seed % 255) + 1;
+	ulong i, off;
+	int k;
+
+	for (i = 0; i < nr_ops; i++) {
+		k = rand_r(&seed) % MMAP_MAX_LIVE;
+
+		if (live[k]) {
+			for (off = 0; off < size[k]; off += PAGE_SIZE)
+				BUG_ON(live[k][off] != tag);
+
+			if (vmap_mmap_free(&free_area_mmap, live[k]))
+				BUG();
+		}
+
+		size[k] = ((rand_r(&seed) % 16) + 1) * PAGE_SIZE;
+		live[k] = vmap_mmap_alloc(&free_area_mmap, size[k], PAGE_SIZE);
+		BUG_ON(!live[k]);
+
+		for (off = 0; off < size[k]; off += PAGE_SIZE) {
+			BUG_ON(live[k][off] || live[k][off + PAGE_SIZE - 1]);
+			live[k][off] = tag;
+		}
+	}
+
+	for (k = 0; k < MMAP_MAX_LIVE; k++)
+		if (live[k] && vmap_mmap_free(&free_area_mmap, live[k]))
+			BUG();
+
+	return NULL;
+}
+
+static void test_mmap(int nr_jobs)
+{
+	pthread_t th_array[nr_jobs];
+	struct timespec a, b;
+	char *p;
+	int i;
+
+	if (vmap_mmap_init(&free_area_mmap, 1UL << 30, 1))
+		BUG();
+
+	/* A guard page after an area and a freed area have to fault. */
+	p = vmap_mmap_alloc(&free_area_mmap, PAGE_SIZE, PAGE_SIZE);
+	BUG_ON(!p || mmap_faults(p) || !mmap_faults(p + PAGE_SIZE));
+
+	if (vmap_mmap_free(&free_area_mmap, p) || !mmap_faults(p))
+		BUG();
+
+	BUG_ON(vmap_mmap_free(&free_area_mmap, p) != -1);
+
+	time_now(&a);
+	for (i = 0; i < nr_jobs; i++)
+		(void) pthread_create(&th_array[i], NULL, mmap_thread_job, NULL);
+
+	for (i = 0; i < nr_jobs; i++)
+		(void) pthread_join(th_array[i], NULL);
+	time_now(&b);
+
+	(void) verify_meta_data(&free_area_mmap.root);
+	printf("-> %d threads, %lu alloc + free of committed memory, "
+		"%lu nsec/op\n", nr_jobs, nr_iterations * 1000UL * nr_jobs,
+		time_diff(&a, &b) / (nr_iterations * 1000UL * nr_jobs));
+
+	vmap_mmap_destroy(&free_area_mmap);
+}
+
+static void test_fit(void)
+{
+	ulong space = 3UL << 29;
+
+	printf("-> %lu allocs, %lu MB space\n",
+		nr_iterations * 1000UL, space >> 20);
+	printf("%6s %10s %10s %10s %8s %8s %8s\n", "fit", "nsec",
+		"free MB", "max MB", "areas", "frag", "failed");
+
+	run_fit(VMAP_FIRST_FIT, "first", space);
+	run_fit(VMAP_BEST_FIT, "best", space);
+	run_fit(VMAP_NEXT_FIT, "next", space);
+	run_fit(VMAP_TOP_DOWN, "top", space);
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s [-j jobs] [-i iterations] [-p] [-l] [-b] [-a batch] [-s] [-z zones]\n"
+		"  [-f] [-r] [-q] [-g] [-m] [-c] [-e]\n"
+		"  -j  number of threads, default 10\n"
+		"  -i  iterations per thread(x100000), default 100\n"
+		"  -p  serve small requests from per-CPU blocks\n"
+		"  -l  free lazily, merge freed areas in batches\n"
+		"  -b  index busy areas, free them by an address\n"
+		"  -a  batches of N areas, alloc_vmap_areas() against\n"
+		"      single ones, iterations are x100\n"
+		"  -s  scaling of 1..64 threads, global lock vs OLC,\n"
+		"      iterations are x1000 per thread\n"
+		"  -z  zones, compare with a single zone, iterations\n"
+		"      are x1000 per thread\n"
+		"  -f  fit policies, latency and fragmentation,\n"
+		"      iterations are x1000\n"
+		"  -r  restore a free map by a bulk load against an\n"
+		"      insert per area, iterations are x1000 areas\n"
+		"  -q  free to an asynchronous reclaimer against under\n"
+		"      the global lock, iterations are x1000 per thread\n"
+		"  -g  grow and shrink areas in place against alloc + free,\n"
+		"      -b indexes them, iterations are x1000\n"
+		"  -m  buffers over mmap() with guard pages, they are\n"
+		"      checked, iterations are x1000 per thread\n"
+		"  -c  small areas over size class lists against the tree,\n"
+		"      iterations are x1000\n"
+		"  -e  free space engines on random and LIFO patterns, same\n"
+		"      placements are checked, iterations are x1000\n"
+		"VM_STAT=<file> writes latency percentiles and tree counters\n"
+		"as JSON to the file at exit, \"-\" is stdout\n"
+		"VM_TRACE=<file> records all requests, see ./replay\n", name);
+}
+
 int main(int argc, char **argv)
 {
-	test_alloc_free(10);
+	bool pcpu = false;
+	bool scaling = false;
+	bool fit = false;
+	bool load = false;
+	bool reclaim = false;
+	bool grow = false;
+	bool mmap = false;
+	bool class = false;
+	bool engines = false;
+	int nr_zones = 0;
+	int nr_batch = 0;
+	int nr_jobs = 10;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "j:i:plba:sz:frqgmceh")) != -1) {
+		switch (opt) {
+		case 'j':
+			nr_jobs = atoi(optarg);
+			break;
+		case 'i':
+			nr_iterations = atoi(optarg);
+			break;
+		case 'p':
+			pcpu = true;
+			break;
+		case 'l':
+			lazy_free = true;
+			break;
+		case 'b':
+			busy_index = true;
+			break;
+		case 'a':
+			nr_batch = atoi(optarg);
+			break;
+		case 's':
+			scaling = true;
+			break;
+		case 'z':
+			nr_zones = atoi(optarg);
+			break;
+		case 'f':
+			fit = true;
+			break;
+		case 'r':
+			load = true;
+			break;
+		case 'q':
+			reclaim = true;
+			break;
+		case 'g':
+			grow = true;
+			break;
+		case 'm':
+			mmap = true;
+			break;
+		case 'c':
+			class = true;
+			break;
+		case 'e':
+			engines = true;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : -1;
+		}
+	}
+
+	if (scaling)
+		test_scaling();
+	else if (fit)
+		test_fit();
+	else if (load)
+		test_load();
+	else if (reclaim)
+		test_reclaim(nr_jobs);
+	else if (grow)
+		test_grow();
+	else if (mmap)
+		test_mmap(nr_jobs);
+	else if (class)
+		test_class();
+	else if (engines)
+		test_engines();
+	else if (nr_zones)
+		test_zones(nr_jobs, nr_zones);
+	else if (nr_batch > 0)
+		test_batch(nr_batch);
+	else
+		test_alloc_free(nr_jobs, pcpu);
+
 	return 0;
 }
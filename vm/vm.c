@@ -5,11 +5,40 @@
 #include "vm.h"				/* Main header */
 #include "vm_ops.h"
 #include "array.h"
+#include "vm_stat.h"
+
+struct kmem_cache bpn_inter_cachep;
+struct kmem_cache bpn_leaf_cachep;
+struct kmem_cache vmap_area_cachep;
+
+/*
+ * Internal nodes and leaves have caches of their own sizes, none
+ * of them takes a page of the other type. VM_KMEM_HUGEPAGE=1 backs
+ * all caches by huge pages.
+ */
+__attribute__((constructor)) static void
+vm_kmem_init(void)
+{
+	unsigned int flags = getenv("VM_KMEM_HUGEPAGE") ? KMEM_HUGEPAGE:0;
+
+	if (kmem_cache_init(&bpn_inter_cachep, "bpn_inter",
+			BPN_INTER_SIZE, flags))
+		BUG();
+
+	if (kmem_cache_init(&bpn_leaf_cachep, "bpn_leaf",
+			BPN_LEAF_SIZE, flags))
+		BUG();
+
+	if (kmem_cache_init(&vmap_area_cachep, "vmap_area",
+			sizeof(struct vmap_area), flags))
+		BUG();
+}
 
 static struct bpn *
 bpn_calloc_init(u8 type)
 {
-	struct bpn *n = calloc(1, sizeof(*n));
+	struct bpn *n = kmem_cache_zalloc(type == BPN_TYPE_INTER ?
+		&bpn_inter_cachep:&bpn_leaf_cachep);
 
 	if (unlikely(!n))
 		assert(0);
@@ -22,36 +51,62 @@ bpn_calloc_init(u8 type)
 	return n;
 }
 
-static __always_inline int
-bpn_insert_to_leaf(struct bpn *n, int pos, vmap_area *va)
+static void
+bpn_free(struct bpn *n)
+{
+	kmem_cache_free(is_bpn_internal(n) ?
+		&bpn_inter_cachep:&bpn_leaf_cachep, n);
+}
+
+/*
+ * Recalculates a cached max size and class mask of a leaf. It is
+ * done when they can go down, or entries are moved between leaves.
+ */
+void bpn_leaf_meta_scan(struct bpn *n)
 {
-	struct vmap_area *sibling;
+	ulong size, max_avail = 0;
+	u32 mask = 0;
+	int i;
+
+	for (i = 0; i < n->entries; i++) {
+		size = bpn_va_size(n, i);
+		if (size > max_avail)
+			max_avail = size;
+
+		mask |= 1U << va_size_class(size);
+	}
+
+	n->LEAF_MAX_AVAIL = max_avail;
+	n->LEAF_CLASS = mask;
+	vm_stat_inc(VM_STAT_META_SCANS);
+}
 
+static __always_inline int
+bpn_insert_to_leaf(struct bpt_root *root, struct bpn *n, int pos,
+	vmap_area *va)
+{
 	BUG_ON(pos >= MAX_ENTRIES);
 
 	/* Sanity check for the right. */
-	if (pos < n->entries) {
-		sibling = bpn_get_val(n, pos);
-
-		if (unlikely(va->va_end > sibling->va_start))
+	if (pos < n->entries)
+		if (unlikely(va->va_end > n->LEAF_VA_START[pos]))
 			return -1;
-	}
 
 	/* Sanity check for the left. */
-	if (pos > 0) {
-		sibling = bpn_get_val(n, pos - 1);
-
-		if (unlikely(va->va_start < sibling->va_end))
+	if (pos > 0)
+		if (unlikely(va->va_start < n->LEAF_VA_END[pos - 1]))
 			return -1;
-	}
 
 	slot_insert(n, pos, (ulong) va);
 	n->entries++;
+	bpn_leaf_meta_add(n, va_size(va));
+	vm_frag_add(root, va_size(va));
 	return 0;
 }
 
 static __always_inline
-vmap_area *bpn_remove_from_leaf(struct bpn *n, int pos, ulong key)
+vmap_area *bpn_remove_from_leaf(struct bpt_root *root, struct bpn *n,
+	int pos, ulong key)
 {
 	vmap_area *va;
 
@@ -64,6 +119,8 @@ vmap_area *bpn_remove_from_leaf(struct bpn *n, int pos, ulong key)
 	va = bpn_get_val(n, pos);
 	slot_remove(n, pos);
 	n->entries--;
+	bpn_leaf_meta_scan(n);
+	vm_frag_del(root, va_size(va));
 	return va;
 }
 
@@ -96,12 +153,13 @@ bpn_try_shift_left(struct bpn *l, struct bpn *r, struct bpn *p, int pos)
 
 		/* Update sub-avail. */
 		l->SUB_AVAIL[l->entries + 1] = r->SUB_AVAIL[0];
+		l->SUB_CLASS[l->entries + 1] = r->SUB_CLASS[0];
 		suba_move(r, 0, 1);
 
 		/* Update sub-parent. */
 		((struct bpn *) l->SUB_LINKS[l->entries + 1])->info.parent = l;
 	} else {
-		l->slot[l->entries] = r->slot[0];
+		slot_copy(l, l->entries, r, 0, 1);
 		p->slot[pos] = bpn_get_key(r, 1);
 	}
 
@@ -110,6 +168,12 @@ bpn_try_shift_left(struct bpn *l, struct bpn *r, struct bpn *p, int pos)
 
 	r->entries--;
 	l->entries++;
+
+	if (is_bpn_external(l)) {
+		bpn_leaf_meta_scan(l);
+		bpn_leaf_meta_scan(r);
+	}
+
 	return true;
 }
 
@@ -138,7 +202,8 @@ bpn_try_shift_right(struct bpn *l, struct bpn *r, struct bpn *p, int pos)
 	if (is_bpn_internal(l)) {
 		slot_insert(r, 0, p->slot[pos]);
 		subl_insert(r, 0, l->SUB_LINKS[l->entries]);
-		suba_insert(r, 0, l->SUB_AVAIL[l->entries]);
+		suba_insert(r, 0, l->SUB_AVAIL[l->entries],
+			l->SUB_CLASS[l->entries]);
 
 		((struct bpn *) r->SUB_LINKS[0])->info.parent = r;
 	} else {
@@ -150,6 +215,12 @@ bpn_try_shift_right(struct bpn *l, struct bpn *r, struct bpn *p, int pos)
 
 	l->entries--;
 	r->entries++;
+
+	if (is_bpn_external(l)) {
+		bpn_leaf_meta_scan(l);
+		bpn_leaf_meta_scan(r);
+	}
+
 	return true;
 }
 
@@ -160,6 +231,8 @@ bpn_merge_siblings(struct bpn *p, int pos)
 	struct bpn *r = bpn_get_right(p, pos);
 	int i;
 
+	vm_stat_inc(VM_STAT_MERGES);
+
 	/* Adjust position. */
 	if (pos == p->entries)
 		pos--;
@@ -183,6 +256,7 @@ bpn_merge_siblings(struct bpn *p, int pos)
 		slot_copy(l, l->entries, r, 0, r->entries);
 		list_del(&r->page.external.list);
 		l->entries += r->entries;
+		bpn_leaf_meta_scan(l);
 	}
 
 	/* Shrink it. -1 element in the parent. */
@@ -193,7 +267,7 @@ bpn_merge_siblings(struct bpn *p, int pos)
 	/* printf("-> update SUB_AVAIL: copy to %d from %d pos\n", pos + 1, pos + 2); */
 
 	p->entries--;
-	free(r);
+	bpn_free(r);
 	return l;
 }
 
@@ -254,6 +328,9 @@ bpn_split_external(struct bpn *l, struct bpn *r)
 
 	/* Copy keys to the new node (right part). */
 	slot_copy(r, 0, l, l->entries, r->entries);
+	bpn_leaf_meta_scan(l);
+	bpn_leaf_meta_scan(r);
+
 	/* Add a new entry to a double-linked list. */
 	list_add(&r->page.external.list, &l->page.external.list);
 }
@@ -268,6 +345,8 @@ bpn_split(struct bpn *n, struct bpn *parent, int pindex)
 	if (unlikely(!right))
 		return;
 
+	vm_stat_inc(VM_STAT_SPLITS);
+
 	if (is_bpn_internal(n)) {
 		bpn_split_internal(n, right);
 		split_key = bpn_get_key(n, n->entries); /* will be moved. */
@@ -283,12 +362,11 @@ bpn_split(struct bpn *n, struct bpn *parent, int pindex)
 	subl_insert(parent, pindex + 1, right);
 
 	/* Update left avail. */
-	array_insert(parent->SUB_AVAIL, pindex,
-		parent->entries + 1, bpn_max_avail(parent->SUB_LINKS[pindex]));
+	suba_insert(parent, pindex, 0, 0);
+	bpn_set_sub_meta(parent, pindex);
 
 	/* Update right avail. */
-	parent->SUB_AVAIL[pindex + 1] =
-		bpn_max_avail(parent->SUB_LINKS[pindex + 1]);
+	bpn_set_sub_meta(parent, pindex + 1);
 
 	/* Set the parent for both kids */
 	right->info.parent = n->info.parent = parent;
@@ -356,12 +434,15 @@ bpt_insert_non_full(struct bpt_root *root, struct vmap_area *va)
 
 	/* It is guaranteed "n" is not full. */
 	(void) bpn_bin_search(n, va->va_start, &pos);
-	merged = try_merge_va(root, n, va, pos);
+	merged = !(root->flags & BPT_NO_MERGE) &&
+		try_merge_va(root, n, va, pos);
 
 	if (!merged) {
-		rv = bpn_insert_to_leaf(n, pos, va);
-		if (!rv)
+		rv = bpn_insert_to_leaf(root, n, pos, va);
+		if (!rv) {
+			leaf_fixup_upper_bound(root, n, va->va_end);
 			fixup_metadata(n);
+		}
 	}
 
 	return (merged || !rv) ? 0 : -1;
@@ -436,6 +517,306 @@ leaf_get_va_cond(struct bpn *n, ulong size, ulong align, ulong vstart)
 	return NULL;
 }
 
+/*
+ * Same as bpt_find_leaf() but it also records a route, i.e. the
+ * "ppos" of every visited node, so fixup_metadata() can be used
+ * on a returned leaf.
+ */
+struct bpn *
+bpt_lookup_leaf(struct bpt_root *root, ulong val)
+{
+	struct bpn *n = root->node;
+	pos_cc_t pos_cc;
+	int pos;
+
+	while (is_bpn_internal(n)) {
+		pos_cc = bpn_bin_search(n, val, &pos);
+
+		if (pos_cc == POS_CC_EQ) {
+			/* Follow right. */
+			n->info.ppos = pos + 1;
+			n = n->SUB_LINKS[pos + 1];
+		} else {
+			/* Follow left. */
+			n->info.ppos = pos;
+			n = n->SUB_LINKS[pos];
+		}
+	}
+
+	return n;
+}
+
+/*
+ * Returns a separator key above a leaf, all keys of the leaf are
+ * less than that value. A route has to be recorded.
+ */
+static inline ulong
+leaf_upper_bound(struct bpn *n)
+{
+	struct bpn *p;
+
+	for (p = n->info.parent; p; p = p->info.parent)
+		if (p->info.ppos < p->entries)
+			return p->slot[p->info.ppos];
+
+	return ULONG_MAX;
+}
+
+/*
+ * Moves to the next leaf by a recorded route, so the route stays
+ * valid for the new leaf. It is the same leaf as the list gives.
+ */
+static inline struct bpn *
+leaf_next_by_route(struct bpn *n)
+{
+	struct bpn *p;
+
+	for (p = n->info.parent; p; n = p, p = p->info.parent) {
+		if (p->info.ppos < p->entries) {
+			n = p->SUB_LINKS[++p->info.ppos];
+
+			while (is_bpn_internal(n)) {
+				n->info.ppos = 0;
+				n = n->SUB_LINKS[0];
+			}
+
+			return n;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Places a VA into a leaf if it does not require any structural
+ * change of the tree, i.e. no split, no merge with other leaves
+ * and no underflow. Metadata is not updated here.
+ */
+static bool
+bpn_try_place_va(struct bpt_root *root, struct bpn *n, struct vmap_area *va)
+{
+	bool left = false, right = false;
+	struct vmap_area *tmp;
+	pos_cc_t pos_cc;
+	int pos;
+
+	pos_cc = bpn_bin_search(n, va->va_start, &pos);
+	if (pos_cc == POS_CC_EQ)
+		return false;
+
+	if (pos > 0) {
+		if (n->LEAF_VA_END[pos - 1] > va->va_start)
+			return false;
+
+		left = (n->LEAF_VA_END[pos - 1] == va->va_start);
+	} else {
+		/* Adjacent to a previous leaf? */
+		tmp = leaf_prev_last_entry(root, n);
+		if (tmp && tmp->va_end >= va->va_start)
+			return false;
+	}
+
+	if (pos < n->entries) {
+		if (va->va_end > n->LEAF_VA_START[pos])
+			return false;
+
+		right = (n->LEAF_VA_START[pos] == va->va_end);
+	} else {
+		/* Adjacent to a next leaf? */
+		tmp = leaf_next_first_entry(root, n);
+		if (tmp && va->va_end >= tmp->va_start)
+			return false;
+	}
+
+	if (left && right) {
+		if (n->info.parent && !is_bpn_gt_min(n))
+			return false;
+
+		bpn_set_va_end(root, n, pos - 1, n->LEAF_VA_END[pos]);
+		tmp = bpn_remove_from_leaf(root, n, pos, n->LEAF_VA_START[pos]);
+		vmap_area_free(tmp);
+	} else if (left) {
+		bpn_set_va_end(root, n, pos - 1, va->va_end);
+		leaf_fixup_upper_bound(root, n, va->va_end);
+	} else if (right) {
+		bpn_set_va_start(root, n, pos, va->va_start);
+	} else {
+		if (is_bpn_full(n) || bpn_insert_to_leaf(root, n, pos, va))
+			return false;
+
+		/* Coalesced areas can cross a split key. */
+		leaf_fixup_upper_bound(root, n, va->va_end);
+		return true;
+	}
+
+	vmap_area_free(va);
+	return true;
+}
+
+/*
+ * Inserts an array of VAs which is sorted by va_start and does
+ * not have adjacent entries. Instead of a descent per VA it goes
+ * from left to right over leaves reusing a recorded route. Only
+ * when a VA requires a structural change a regular insert is used.
+ */
+void
+bpt_bulk_insert(struct bpt_root *root, struct vmap_area **va, ulong nr)
+{
+	struct bpn *n = NULL;
+	bool dirty = false;
+	ulong i, ub = 0;
+
+	for (i = 0; i < nr; i++) {
+		if (n && va[i]->va_start >= ub) {
+			if (dirty)
+				fixup_metadata(n);
+
+			/* Try a neighbour, otherwise find it again. */
+			n = leaf_next_by_route(n);
+			if (n)
+				ub = leaf_upper_bound(n);
+
+			if (n && va[i]->va_start >= ub)
+				n = NULL;
+
+			dirty = false;
+		}
+
+		if (!n) {
+			n = bpt_lookup_leaf(root, va[i]->va_start);
+			ub = leaf_upper_bound(n);
+		}
+
+		if (bpn_try_place_va(root, n, va[i])) {
+			/* A split key above can be raised. */
+			ub = leaf_upper_bound(n);
+			dirty = true;
+			continue;
+		}
+
+		if (dirty)
+			fixup_metadata(n);
+
+		(void) bpt_po_insert(root, va[i]);
+		dirty = false;
+		n = NULL;
+	}
+
+	if (n && dirty)
+		fixup_metadata(n);
+}
+
+/* The lowest key of a sub-tree, i.e. its split key on the left. */
+static ulong
+bpn_lowest_key(struct bpn *n)
+{
+	while (is_bpn_internal(n))
+		n = n->SUB_LINKS[0];
+
+	return n->LEAF_VA_START[0];
+}
+
+/*
+ * Builds a tree bottom-up from "nr" VAs sorted by va_start. Leafs are
+ * filled up one after another and every upper level is built over the
+ * one below, so it is O(nr) without searches, splits and merges. Nodes
+ * of a level are spread evenly, thus none is below a minimum.
+ *
+ * The tree has to be empty. Unsorted or overlapping VAs are rejected
+ * and nothing is changed. Adjacent ones are merged unless the tree is
+ * BPT_NO_MERGE, the array is compacted then.
+ */
+int bpt_bulk_load(struct bpt_root *root, struct vmap_area **va, ulong nr)
+{
+	ulong i, j, k, nr_nodes, nr_parents, per_node, extra;
+	struct bpn **level, *n;
+
+	if (is_bpn_internal(root->node) || root->node->entries)
+		return -1;
+
+	for (i = 0; i < nr; i++) {
+		if (va[i]->va_start >= va[i]->va_end)
+			return -1;
+
+		if (i && va[i]->va_start < va[i - 1]->va_end)
+			return -1;
+	}
+
+	if (!nr)
+		return 0;
+
+	/* Nodes of a current level, leafs are the most of them. */
+	nr_nodes = (nr + MAX_ENTRIES - 1) / MAX_ENTRIES;
+	level = malloc(sizeof(*level) * nr_nodes);
+	if (unlikely(!level))
+		return -1;
+
+	if (!(root->flags & BPT_NO_MERGE)) {
+		for (i = 1, j = 0; i < nr; i++) {
+			if (va[j]->va_end == va[i]->va_start) {
+				va[j]->va_end = va[i]->va_end;
+				vmap_area_free(va[i]);
+			} else {
+				va[++j] = va[i];
+			}
+		}
+
+		nr = j + 1;
+		nr_nodes = (nr + MAX_ENTRIES - 1) / MAX_ENTRIES;
+	}
+
+	per_node = nr / nr_nodes;
+	extra = nr % nr_nodes;
+
+	/* The empty root leaf becomes the first one. */
+	for (i = 0, k = 0; i < nr_nodes; i++) {
+		n = i ? bpn_calloc_init(BPN_TYPE_EXTER):root->node;
+		if (i)
+			list_add_tail(&n->page.external.list, &root->head);
+
+		n->entries = per_node + (i < extra);
+		for (j = 0; j < n->entries; j++, k++) {
+			n->slot[j] = (ulong) va[k];
+			n->LEAF_VA_START[j] = va[k]->va_start;
+			n->LEAF_VA_END[j] = va[k]->va_end;
+			vm_frag_add(root, va_size(va[k]));
+		}
+
+		bpn_leaf_meta_scan(n);
+		level[i] = n;
+	}
+
+	while (nr_nodes > 1) {
+		nr_parents = (nr_nodes + MAX_CHILDREN - 1) / MAX_CHILDREN;
+		per_node = nr_nodes / nr_parents;
+		extra = nr_nodes % nr_parents;
+
+		/* A parent "i" is stored over its children, k > i. */
+		for (i = 0, k = 0; i < nr_parents; i++) {
+			n = bpn_calloc_init(BPN_TYPE_INTER);
+			n->entries = per_node + (i < extra) - 1;
+
+			for (j = 0; j < n->entries + 1; j++, k++) {
+				n->SUB_LINKS[j] = level[k];
+				level[k]->info.parent = n;
+
+				if (j)
+					n->slot[j - 1] = bpn_lowest_key(level[k]);
+
+				(void) bpn_set_sub_meta(n, j);
+			}
+
+			level[i] = n;
+		}
+
+		nr_nodes = nr_parents;
+	}
+
+	root->node = level[0];
+	free(level);
+	return 0;
+}
+
 /* Preemptive overflow delete operation. */
 struct vmap_area *
 bpt_po_delete(struct bpt_root *root, ulong val)
@@ -482,19 +863,19 @@ bpt_po_delete(struct bpt_root *root, ulong val)
 				balanced = bpn_try_shift_right(l, r, parent, pos);
 
 			if (balanced) {
-				parent->SUB_AVAIL[lpos] = bpn_max_avail(l);
-				parent->SUB_AVAIL[rpos] = bpn_max_avail(r);
+				bpn_set_sub_meta(parent, lpos);
+				bpn_set_sub_meta(parent, rpos);
 			} else {
 				/* Need merging. */
 				n = bpn_merge_siblings(parent, pos);
-				parent->SUB_AVAIL[lpos] = bpn_max_avail(n);
+				bpn_set_sub_meta(parent, lpos);
 				parent->info.ppos = lpos;
 
 				/* Set a new parent. Can be a leaf node only. */
 				if (!parent->entries && parent == root->node) {
 					n->info.parent = NULL;
 					root->node = n;
-					free(parent);
+					bpn_free(parent);
 				}
 			}
 		}
@@ -502,7 +883,7 @@ bpt_po_delete(struct bpt_root *root, ulong val)
 
 	/* Success. */
 	va = (pos_cc == POS_CC_EQ) ?
-		bpn_remove_from_leaf(n, pos, val) : NULL;
+		bpn_remove_from_leaf(root, n, pos, val) : NULL;
 
 	if (va)
 		fixup_metadata(n);
@@ -518,14 +899,55 @@ int bpt_root_init(struct bpt_root *root)
 
 	list_init(&root->head);
 	list_add(&root->node->page.external.list, &root->head);
+	root->flags = 0;
+	root->busy = NULL;
+	root->frag = NULL;
+
+	root->lazy.va = NULL;
+	root->lazy.nr = 0;
+
+	root->fit.policy = VMAP_FIRST_FIT;
+	root->fit.cursor = 0;
+
+	{
+		pthread_rwlockattr_t attr;
+
+		/* Do not starve the slow path by a stream of readers. */
+		pthread_rwlockattr_init(&attr);
+		pthread_rwlockattr_setkind_np(&attr,
+			PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+		pthread_rwlock_init(&root->smo_lock, &attr);
+		pthread_rwlockattr_destroy(&attr);
+	}
 
 	return 0;
 }
 
 void bpt_root_destroy(struct bpt_root *root)
 {
+	ulong i;
+
 	/* list_del(&root->node->page.external.list); */
 	list_init(&root->head);
-	free(root->node);
+	bpn_free(root->node);
 	root->node = NULL;
+
+	/* Queued ones are not in the tree, nobody else releases them. */
+	for (i = 0; i < root->lazy.nr; i++)
+		vmap_area_free(root->lazy.va[i]);
+
+	free(root->lazy.va);
+	root->lazy.va = NULL;
+	root->lazy.nr = 0;
+
+	free(root->frag);
+	root->frag = NULL;
+
+	pthread_rwlock_destroy(&root->smo_lock);
+
+	if (root->busy) {
+		bpt_root_destroy(root->busy);
+		free(root->busy);
+		root->busy = NULL;
+	}
 }
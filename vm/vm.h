@@ -4,12 +4,19 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <pthread.h>
+
+#include "slab.h"
 
 #include "list.h"
+#include "vm_names.h"
 
 typedef unsigned char u8;
+typedef unsigned int u32;
 #define ULONG_MAX (~0UL)
-#define PAGE_SIZE (4096UL)
+#define U32_MAX (~0U)
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1UL << PAGE_SHIFT)
 
 #define __must_check __attribute__((warn_unused_result))
 #define likely(x)   __builtin_expect((ulong) (x), 1)
@@ -18,6 +25,7 @@ typedef unsigned char u8;
 #define BUG() *((char *) 0) = 0xff
 #define BUG_ON(cond) do { if (unlikely(cond)) BUG(); } while (0)
 #define ALIGN(x, a)	(((x) + (a) - 1) & ~((a) - 1))
+#define ALIGN_DOWN(x, a)	((x) & ~((a) - 1))
 
 #define VMALLOC_START 0xffffb30940000000UL
 #define VMALLOC_END 0xffffd3093fffffffUL
@@ -34,8 +42,19 @@ typedef unsigned char u8;
  * maximum keys:     m - 1 = 7
  * minimum keys:     (m - 1) / 2 = 3
  */
+#ifndef BPT_ORDER
+#define BPT_ORDER 24
+#endif
+
+/*
+ * It is set at build time by -DBPT_ORDER=<m>. An upper bound is how
+ * big a node can be to fit into a slab, see BPN_INTER_SIZE.
+ */
+#if BPT_ORDER < 4
+#error "BPT_ORDER has to be at least 4"
+#endif
+
 enum tree_properties {
-	BPT_ORDER = 24,			/* MAX 256. */
 	MAX_ENTRIES = (BPT_ORDER - 1),
 	MAX_CHILDREN = (BPT_ORDER),
 	MIN_CHILDREN = (BPT_ORDER >> 1),
@@ -51,8 +70,21 @@ enum {
 /* Aliases. */
 #define SUB_LINKS page.internal.subl
 #define SUB_AVAIL page.internal.suba
+#define SUB_CLASS page.internal.subc
+#define LEAF_VA_START page.external.va_start
+#define LEAF_VA_END page.external.va_end
+#define LEAF_MAX_AVAIL page.external.max_avail
+#define LEAF_CLASS page.external.class_mask
 
-/* A common node structure. */
+/*
+ * A common node structure. It starts at a cache line and so does
+ * its page, thus a scan of SUB_AVAIL or of a leaf range touches as
+ * few lines as possible, see sweep.c for node sizes.
+ *
+ * Only a header and a page of its own type are allocated for a node,
+ * see BPN_INTER_SIZE and BPN_LEAF_SIZE, so a whole struct bpn must
+ * never be copied or zeroed.
+ */
 struct bpn {
 	struct {
 		void *parent;
@@ -60,34 +92,157 @@ struct bpn {
 		u8 type;
 	} info;
 
+	/* Lock bit and a counter, see vm_olc.c. */
+	ulong version;
+
 	/* indexes or records. */
 	ulong entries;
+#ifdef DEBUG_BP_TREE
+	unsigned long num;			/* for debug */
+#endif
 	ulong slot[MAX_ENTRIES];
 
 	/*
 	 * This union is used for differentiating between leaf
 	 * and internal nodes. A page keeps either references
 	 * to sub-nodes or leaf-nodes where data is stored.
+	 *
+	 * SUB_AVAIL is in pages, see va_avail_pages(). It is next to
+	 * SUB_CLASS, both are scanned by a descent, links are not.
 	 */
 	union {
 		struct {				/* internal/index nodes. */
-			ulong suba[MAX_CHILDREN];
+			u32 suba[MAX_CHILDREN];
+			u32 subc[MAX_CHILDREN];
 			void *subl[MAX_CHILDREN];
 		} internal;
 
+		/*
+		 * A leaf keeps a copy of ranges of its VAs, so a search,
+		 * size filtering and max-avail do not touch the VAs. Its
+		 * max size and class mask are cached, a metadata update
+		 * does not scan a leaf unless they can go down.
+		 */
 		struct {				/* leaf nodes. */
 			struct list_head list;
+			ulong max_avail;
+			u32 class_mask;
+			ulong va_start[MAX_ENTRIES];
+			ulong va_end[MAX_ENTRIES];
 		} external;
-	} page;
+	} page __attribute__((aligned(64)));
+} __attribute__((aligned(64)));
 
-#ifdef DEBUG_BP_TREE
-	unsigned long num;			/* for debug */
-#endif
+#define BPN_SIZE(part) ALIGN(__builtin_offsetof(struct bpn, page) +	\
+	sizeof(((struct bpn *) 0)->page.part), 64UL)
+
+#define BPN_INTER_SIZE BPN_SIZE(internal)
+#define BPN_LEAF_SIZE BPN_SIZE(external)
+
+/* Nodes come from 4K slabs with a header, see kmem_cache_init(). */
+_Static_assert(BPN_INTER_SIZE + sizeof(struct kmem_slab) <= KMEM_PAGE_SIZE,
+	"BPT_ORDER is too big, an internal node does not fit into a slab");
+_Static_assert(BPN_LEAF_SIZE + sizeof(struct kmem_slab) <= KMEM_PAGE_SIZE,
+	"BPT_ORDER is too big, a leaf does not fit into a slab");
+
+/* Freed areas are queued and merged in batches, see vm_ops.c. */
+enum {
+	VMAP_LAZY_MAX_AREAS = 512,
+};
+
+/* How a free block is picked for an allocation. */
+enum vmap_fit_policy {
+	VMAP_FIRST_FIT,	/* the lowest address */
+	VMAP_BEST_FIT,	/* the smallest size class, see va_size_class() */
+	VMAP_NEXT_FIT,	/* the lowest address after a previous one */
+	VMAP_TOP_DOWN,	/* the highest address below vend */
+};
+
+/*
+ * Free areas are grouped by power of two size classes in pages. A
+ * mask of classes present in a sub-tree is kept next to SUB_AVAIL,
+ * the last class also takes everything bigger.
+ */
+enum {
+	VA_NR_CLASSES = 32,
+};
+
+static __always_inline int
+va_size_class(ulong size)
+{
+	ulong pages = size / PAGE_SIZE;
+	int class;
+
+	if (unlikely(!pages))
+		return 0;
+
+	class = (sizeof(ulong) * 8 - 1) - __builtin_clzl(pages);
+	return (class < VA_NR_CLASSES) ? class:VA_NR_CLASSES - 1;
+}
+
+/*
+ * A size as SUB_AVAIL keeps it, in pages. It is rounded up and is
+ * saturated at 32 bits, so it is never less than the size and one
+ * of a bigger size is never less. A descent does not miss a block
+ * which fits, but it can go to a sub-tree where nothing does, e.g.
+ * if areas are not page multiples or are 16TB and more. A leaf has
+ * exact sizes, so such a miss is retried like one of an alignment.
+ */
+static __always_inline u32
+va_avail_pages(ulong size)
+{
+	ulong pages = (size >> PAGE_SHIFT) + !!(size & (PAGE_SIZE - 1));
+
+	return (pages < U32_MAX) ? pages:U32_MAX;
+}
+
+/*
+ * Free space of a tree: a number of free blocks, their total size,
+ * the biggest one and how many there are per size class. It is built
+ * by vm_frag_scan() or, if a tree keeps it, updated on every change
+ * of a free block, see vm_init_frag_stat().
+ */
+struct vm_frag {
+	ulong nr_free;
+	ulong free_bytes;
+	ulong largest;		/* not kept, taken from the root */
+	ulong nr_class[VA_NR_CLASSES];
+};
+
+enum bpt_root_flags {
+	BPT_NO_MERGE = 0x1,		/* areas are kept as they are */
+	BPT_LAZY_FREE = 0x2,		/* vfree_addr() queues areas */
 };
 
 struct bpt_root {
 	struct bpn *node;
 	struct list_head head;
+	unsigned int flags;
+
+	/* Busy areas by va_start, NULL if they are not indexed. */
+	struct bpt_root *busy;
+
+	/* Free space counters, NULL if they are not kept. */
+	struct vm_frag *frag;
+
+	/* Lazily freed areas. */
+	struct {
+		struct vmap_area **va;
+		ulong nr;
+	} lazy;
+
+	/* A next fit resumes from a cursor. */
+	struct {
+		enum vmap_fit_policy policy;
+		ulong cursor;
+	} fit;
+
+	/*
+	 * Structure modification lock. Concurrent operations take it
+	 * shared, a split, merge or any change of split keys takes it
+	 * exclusive. See vm_olc.c.
+	 */
+	pthread_rwlock_t smo_lock;
 };
 
 /* Payload data. */
@@ -96,6 +251,25 @@ typedef struct vmap_area {
 	unsigned long va_end;
 } vmap_area;
 
+/*
+ * Nodes and areas come from their own caches, see vm.c.
+ */
+extern struct kmem_cache bpn_inter_cachep;
+extern struct kmem_cache bpn_leaf_cachep;
+extern struct kmem_cache vmap_area_cachep;
+
+static __always_inline struct vmap_area *
+vmap_area_alloc(void)
+{
+	return kmem_cache_alloc(&vmap_area_cachep);
+}
+
+static __always_inline void
+vmap_area_free(struct vmap_area *va)
+{
+	kmem_cache_free(&vmap_area_cachep, va);
+}
+
 /*
  * Halve an index with adjustment for odd numbers.
  */
@@ -146,7 +320,7 @@ static __always_inline ulong
 bpn_get_key(struct bpn *n, int pos)
 {
 	if (is_bpn_external(n))
-		return ((vmap_area *) n->slot[pos])->va_start;
+		return n->LEAF_VA_START[pos];
 
 	/* It is internal. */
 	return n->slot[pos];
@@ -161,6 +335,114 @@ bpn_get_val(struct bpn *n, int pos)
 	return NULL;
 }
 
+/*
+ * A free block of "size" appears, "nr" is 1, or goes away, it is -1.
+ * Leafs are changed concurrently by the OLC paths, so it is atomic.
+ */
+static __always_inline void
+vm_frag_account(struct vm_frag *f, ulong size, long nr)
+{
+	__atomic_fetch_add(&f->nr_free, nr, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&f->free_bytes, size * nr, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&f->nr_class[va_size_class(size)], nr,
+		__ATOMIC_RELAXED);
+}
+
+static __always_inline void
+vm_frag_add(struct bpt_root *root, ulong size)
+{
+	if (unlikely(root->frag))
+		vm_frag_account(root->frag, size, 1);
+}
+
+static __always_inline void
+vm_frag_del(struct bpt_root *root, ulong size)
+{
+	if (unlikely(root->frag))
+		vm_frag_account(root->frag, size, -1);
+}
+
+static __always_inline void
+vm_frag_resize(struct bpt_root *root, ulong old, ulong new)
+{
+	if (likely(!root->frag))
+		return;
+
+	if (va_size_class(old) == va_size_class(new)) {
+		__atomic_fetch_add(&root->frag->free_bytes, new - old,
+			__ATOMIC_RELAXED);
+	} else {
+		vm_frag_account(root->frag, old, -1);
+		vm_frag_account(root->frag, new, 1);
+	}
+}
+
+extern void bpn_leaf_meta_scan(struct bpn *);
+
+/* A range of "size" is added to a leaf, the cache can only go up. */
+static __always_inline void
+bpn_leaf_meta_add(struct bpn *n, ulong size)
+{
+	if (size > n->LEAF_MAX_AVAIL)
+		n->LEAF_MAX_AVAIL = size;
+
+	n->LEAF_CLASS |= 1U << va_size_class(size);
+}
+
+/*
+ * A range of a leaf is resized. A leaf is rescanned only if the
+ * range was the biggest one and has shrunk, or its class changed,
+ * so the old class bit may have to go.
+ */
+static __always_inline void
+bpn_leaf_meta_resize(struct bpn *n, ulong old, ulong new)
+{
+	if (va_size_class(old) != va_size_class(new) ||
+			(old == n->LEAF_MAX_AVAIL && new < old))
+		bpn_leaf_meta_scan(n);
+	else if (new > n->LEAF_MAX_AVAIL)
+		n->LEAF_MAX_AVAIL = new;
+}
+
+/*
+ * A VA which is in a leaf is changed over these helpers only,
+ * so an inline copy of its range, a cached max size of the leaf
+ * and free space counters stay in sync with the VA.
+ */
+static __always_inline void
+bpn_set_va_start(struct bpt_root *root, struct bpn *n, int pos,
+	ulong va_start)
+{
+	ulong old = n->LEAF_VA_END[pos] - n->LEAF_VA_START[pos];
+	ulong new = n->LEAF_VA_END[pos] - va_start;
+
+	vm_frag_resize(root, old, new);
+
+	((vmap_area *) n->slot[pos])->va_start = va_start;
+	n->LEAF_VA_START[pos] = va_start;
+	bpn_leaf_meta_resize(n, old, new);
+}
+
+static __always_inline void
+bpn_set_va_end(struct bpt_root *root, struct bpn *n, int pos,
+	ulong va_end)
+{
+	ulong old = n->LEAF_VA_END[pos] - n->LEAF_VA_START[pos];
+	ulong new = va_end - n->LEAF_VA_START[pos];
+
+	vm_frag_resize(root, old, new);
+
+	((vmap_area *) n->slot[pos])->va_end = va_end;
+	n->LEAF_VA_END[pos] = va_end;
+	bpn_leaf_meta_resize(n, old, new);
+}
+
+static __always_inline ulong
+bpn_va_size(struct bpn *n, int pos)
+{
+	return n->LEAF_VA_END[pos] - n->LEAF_VA_START[pos];
+}
+
 /*
  * Removing or adding does not unbalance a node.
  */
@@ -223,13 +505,13 @@ va_size(struct vmap_area *va)
 }
 
 static __always_inline bool
-is_within_this_va(struct vmap_area *va, ulong size,
+is_within_this_range(ulong va_start, ulong va_end, ulong size,
 	ulong align, ulong vstart)
 {
 	ulong nva_start_addr;
 
-	if (va->va_start > vstart)
-		nva_start_addr = ALIGN(va->va_start, align);
+	if (va_start > vstart)
+		nva_start_addr = ALIGN(va_start, align);
 	else
 		nva_start_addr = ALIGN(vstart, align);
 
@@ -238,7 +520,37 @@ is_within_this_va(struct vmap_area *va, ulong size,
 			nva_start_addr < vstart)
 		return false;
 
-	return (nva_start_addr + size <= va->va_end);
+	return (nva_start_addr + size <= va_end);
+}
+
+static __always_inline bool
+is_within_this_va(struct vmap_area *va, ulong size,
+	ulong align, ulong vstart)
+{
+	return is_within_this_range(va->va_start, va->va_end,
+		size, align, vstart);
+}
+
+/*
+ * A mirror of is_within_this_range(), an area is placed as high as
+ * possible below "vend". Returns the address or zero if it does not
+ * fit.
+ */
+static __always_inline ulong
+top_down_addr(ulong va_start, ulong va_end, ulong size,
+	ulong align, ulong vstart, ulong vend)
+{
+	ulong end = (va_end < vend) ? va_end:vend;
+	ulong nva_start_addr;
+
+	if (end < size)
+		return 0;
+
+	nva_start_addr = ALIGN_DOWN(end - size, align);
+	if (nva_start_addr < va_start || nva_start_addr < vstart)
+		return 0;
+
+	return nva_start_addr;
 }
 
 static __always_inline int
@@ -302,6 +614,28 @@ leaf_prev_last_entry(struct bpt_root *root, struct bpn *n)
 	return NULL;
 }
 
+/*
+ * A VA must not cross an upper split key of its leaf, otherwise
+ * clipping its left edge moves the key over that split key. If it
+ * does, the split key is raised up to the first VA of a next leaf.
+ *
+ * A route to the leaf has to be recorded.
+ */
+static inline void
+leaf_fixup_upper_bound(struct bpt_root *root, struct bpn *n, ulong va_end)
+{
+	struct bpn *p;
+
+	for (p = n->info.parent; p; p = p->info.parent) {
+		if (p->info.ppos < p->entries) {
+			if (p->slot[p->info.ppos] < va_end)
+				p->slot[p->info.ppos] =
+					bpn_get_key(leaf_next_or_null(root, n), 0);
+			break;
+		}
+	}
+}
+
 /* Position condition codes. */
 typedef enum {
 	POS_CC_EQ = 0,					/* key = mkey */
@@ -348,6 +682,9 @@ extern void bpt_root_destroy(struct bpt_root *);
 extern int bpt_po_insert(struct bpt_root *, vmap_area *);
 extern struct vmap_area *bpt_po_delete(struct bpt_root *, ulong);
 extern void *bpt_lookup(struct bpt_root *, ulong, int *);
+extern struct bpn *bpt_lookup_leaf(struct bpt_root *, ulong);
+extern void bpt_bulk_insert(struct bpt_root *, struct vmap_area **, ulong);
+extern int bpt_bulk_load(struct bpt_root *, struct vmap_area **, ulong);
 
 extern bool bpn_try_shift_right(struct bpn *, struct bpn *,
 		struct bpn *, int);
@@ -0,0 +1,324 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+#include "vm_ops.h"
+#include "vm_class.h"
+#include "vm_stat.h"
+#include "vm_trace.h"
+
+/* A list of "size", NULL if it is not a size class. */
+static __always_inline struct vmap_class_list *
+size_to_list(struct vmap_class_cache *cc, ulong size)
+{
+	ulong pages = size / PAGE_SIZE;
+
+	if (!pages || pages > VMAP_CLASS_MAX_PAGES ||
+			pages * PAGE_SIZE != size)
+		return NULL;
+
+	return &cc->list[pages - 1];
+}
+
+/*
+ * Gives "nr" areas of the batch back to the tree, neighbours are
+ * merged before root_lock is taken. A caller holds the lock.
+ */
+static void
+class_give_back(struct vmap_class_cache *cc, ulong nr)
+{
+	if (!nr)
+		return;
+
+	vm_stat_inc(VM_STAT_CLASS_FLUSHES);
+	nr = coalesce_vmap_areas(cc->batch, nr);
+
+	pthread_spin_lock(cc->root_lock);
+	bpt_bulk_insert(cc->root, cc->batch, nr);
+	pthread_spin_unlock(cc->root_lock);
+}
+
+/* The oldest half of an overflowed list. A caller holds the lock. */
+static void
+class_flush_half(struct vmap_class_cache *cc, struct vmap_class_list *l)
+{
+	int nr = l->nr >> 1;
+
+	memcpy(cc->batch, l->va, nr * sizeof(*l->va));
+	memmove(l->va, l->va + nr, (l->nr - nr) * sizeof(*l->va));
+	l->nr -= nr;
+
+	class_give_back(cc, nr);
+}
+
+/* Returns false if nothing has been listed. A caller holds the lock. */
+static bool
+class_flush_all(struct vmap_class_cache *cc)
+{
+	ulong nr = 0;
+	int i;
+
+	for (i = 0; i < VMAP_CLASS_MAX_PAGES; i++) {
+		memcpy(cc->batch + nr, cc->list[i].va,
+			cc->list[i].nr * sizeof(*cc->batch));
+		nr += cc->list[i].nr;
+		cc->list[i].nr = 0;
+	}
+
+	class_give_back(cc, nr);
+	return nr > 0;
+}
+
+/*
+ * One block of up to VMAP_CLASS_REFILL areas is carved from the
+ * tree, fewer if the space is short. A caller holds the lock.
+ *
+ * If descriptors run out midway, the last listed one takes the rest
+ * of the block back to the tree. The first one is allocated before
+ * the block, so there is always one.
+ */
+static void
+class_refill(struct vmap_class_cache *cc, struct vmap_class_list *l,
+		ulong size)
+{
+	ulong addr = cc->vend;
+	struct vmap_area *va;
+	int i, nr;
+
+	va = vmap_area_alloc();
+	if (unlikely(!va))
+		return;
+
+	pthread_spin_lock(cc->root_lock);
+	for (nr = VMAP_CLASS_REFILL; nr; nr >>= 1) {
+		addr = va_alloc(cc->root, size * nr, PAGE_SIZE,
+			cc->vstart, cc->vend);
+		if (addr != cc->vend)
+			break;
+	}
+	pthread_spin_unlock(cc->root_lock);
+
+	if (!nr) {
+		vmap_area_free(va);
+		return;
+	}
+
+	vm_stat_inc(VM_STAT_CLASS_REFILLS);
+
+	/* Pushed from the top, so they are popped in address order. */
+	for (i = nr - 1; i >= 0; i--) {
+		if (!va)
+			va = vmap_area_alloc();
+
+		if (unlikely(!va))
+			break;
+
+		va->va_start = addr + size * i;
+		va->va_end = va->va_start + size;
+		l->va[l->nr++] = va;
+		va = NULL;
+	}
+
+	if (unlikely(i >= 0)) {
+		/* [addr, addr + size * (i + 2)), it is adjacent. */
+		va = l->va[--l->nr];
+		va->va_start = addr;
+
+		cc->batch[0] = va;
+		class_give_back(cc, 1);
+	}
+}
+
+/* A caller holds the lock. */
+static void
+class_push(struct vmap_class_cache *cc, struct vmap_class_list *l,
+		struct vmap_area *va)
+{
+	if (l->nr == VMAP_CLASS_DEPTH)
+		class_flush_half(cc, l);
+
+	l->va[l->nr++] = va;
+}
+
+static struct vmap_area *
+class_pop(struct vmap_class_cache *cc, struct vmap_class_list *l,
+		ulong size)
+{
+	struct vmap_area *va = NULL;
+
+	pthread_spin_lock(&cc->lock);
+	if (!l->nr)
+		class_refill(cc, l, size);
+
+	if (l->nr)
+		va = l->va[--l->nr];
+	pthread_spin_unlock(&cc->lock);
+
+	return va;
+}
+
+/*
+ * A small page aligned request is a pop from its list, others and
+ * the ones which can not be refilled go to the tree. If the tree
+ * can not serve a request, all lists are given back to it and it
+ * is retried.
+ */
+struct vmap_area *
+vmap_class_alloc(struct vmap_class_cache *cc, ulong size, ulong align)
+{
+	ulong start = vm_stat_time();
+	struct vmap_class_list *l;
+	struct vmap_area *va;
+	bool flushed;
+	int rv;
+
+	l = size_to_list(cc, size);
+	if (l && align <= PAGE_SIZE) {
+		va = class_pop(cc, l, size);
+		if (va) {
+			vm_stat_inc(VM_STAT_CLASS_HITS);
+
+			if (cc->root->busy) {
+				pthread_spin_lock(cc->root_lock);
+				rv = bpt_po_insert(cc->root->busy, va);
+				pthread_spin_unlock(cc->root_lock);
+
+				/* It is not handed out, back to its list. */
+				if (unlikely(rv)) {
+					pthread_spin_lock(&cc->lock);
+					class_push(cc, l, va);
+					pthread_spin_unlock(&cc->lock);
+					return NULL;
+				}
+			}
+
+			vm_stat_latency(VM_STAT_ALLOC, start);
+			vm_trace_alloc(va->va_start, size, align,
+				cc->vstart, cc->vend);
+			return va;
+		}
+	}
+
+	pthread_spin_lock(cc->root_lock);
+	va = alloc_vmap_area(cc->root, size, align, cc->vstart, cc->vend);
+	pthread_spin_unlock(cc->root_lock);
+
+	if (va)
+		return va;
+
+	pthread_spin_lock(&cc->lock);
+	flushed = class_flush_all(cc);
+	pthread_spin_unlock(&cc->lock);
+
+	if (!flushed)
+		return NULL;
+
+	pthread_spin_lock(cc->root_lock);
+	va = alloc_vmap_area(cc->root, size, align, cc->vstart, cc->vend);
+	pthread_spin_unlock(cc->root_lock);
+
+	return va;
+}
+
+/*
+ * A small area is pushed to its list, the oldest half of a full list
+ * goes back to the tree first. Others are freed to the tree.
+ */
+int vmap_class_free(struct vmap_class_cache *cc, struct vmap_area *va)
+{
+	ulong start = vm_stat_time();
+	struct vmap_class_list *l;
+	int rv;
+
+	if (unlikely(!va))
+		return -1;
+
+	l = size_to_list(cc, va_size(va));
+	if (!l) {
+		pthread_spin_lock(cc->root_lock);
+		rv = free_vmap_area(cc->root, va);
+		pthread_spin_unlock(cc->root_lock);
+		return rv;
+	}
+
+	if (cc->root->busy) {
+		pthread_spin_lock(cc->root_lock);
+		rv = unlink_busy_va(cc->root, va);
+		pthread_spin_unlock(cc->root_lock);
+
+		if (rv)
+			return -1;
+	}
+
+	vm_trace_free(va->va_start, va_size(va));
+
+	pthread_spin_lock(&cc->lock);
+	class_push(cc, l, va);
+	pthread_spin_unlock(&cc->lock);
+
+	vm_stat_latency(VM_STAT_FREE, start);
+	return 0;
+}
+
+/* Gives all listed areas back to the tree. */
+void vmap_class_flush(struct vmap_class_cache *cc)
+{
+	pthread_spin_lock(&cc->lock);
+	(void) class_flush_all(cc);
+	pthread_spin_unlock(&cc->lock);
+}
+
+int vmap_class_init(struct vmap_class_cache *cc, struct bpt_root *root,
+		pthread_spinlock_t *root_lock, ulong vstart, ulong vend)
+{
+	int i;
+
+	cc->root = root;
+	cc->root_lock = root_lock;
+	cc->vstart = vstart;
+	cc->vend = vend;
+
+	cc->batch = malloc(sizeof(*cc->batch) *
+		VMAP_CLASS_DEPTH * VMAP_CLASS_MAX_PAGES);
+	if (unlikely(!cc->batch))
+		return -1;
+
+	for (i = 0; i < VMAP_CLASS_MAX_PAGES; i++) {
+		cc->list[i].nr = 0;
+		cc->list[i].va = malloc(sizeof(*cc->list[i].va) *
+			VMAP_CLASS_DEPTH);
+		if (unlikely(!cc->list[i].va))
+			goto fail;
+	}
+
+	pthread_spin_init(&cc->lock, PTHREAD_PROCESS_PRIVATE);
+	return 0;
+
+fail:
+	while (i--)
+		free(cc->list[i].va);
+
+	free(cc->batch);
+	return -1;
+}
+
+/*
+ * All listed areas are given back, so the tree owns all free space
+ * when it returns.
+ */
+void vmap_class_destroy(struct vmap_class_cache *cc)
+{
+	int i;
+
+	vmap_class_flush(cc);
+	pthread_spin_destroy(&cc->lock);
+
+	for (i = 0; i < VMAP_CLASS_MAX_PAGES; i++) {
+		free(cc->list[i].va);
+		cc->list[i].va = NULL;
+	}
+
+	free(cc->batch);
+	cc->batch = NULL;
+}
@@ -0,0 +1,49 @@
+#ifndef __VM_CLASS_H__
+#define __VM_CLASS_H__
+
+#include <pthread.h>
+
+/*
+ * Segregated free lists in front of the tree. There is a list per a
+ * number of pages up to VMAP_CLASS_MAX_PAGES, a small page aligned
+ * request is a pop from its list. An empty list is refilled by one
+ * block carved from the tree and cut into areas of its class, a freed
+ * small area is pushed back to its list.
+ *
+ * Listed areas are not visible to the tree. They are sorted, merged
+ * and given back in bulk when a list overflows, when the tree can
+ * not serve a request or by vmap_class_flush(). Other requests go
+ * to the tree as they are.
+ */
+enum vmap_class_properties {
+	VMAP_CLASS_MAX_PAGES = 16,
+	VMAP_CLASS_DEPTH = 512,		/* areas a list keeps at most */
+	VMAP_CLASS_REFILL = 32,		/* areas carved per refill */
+};
+
+struct vmap_class_list {
+	struct vmap_area **va;		/* a stack, the oldest are first */
+	int nr;
+};
+
+struct vmap_class_cache {
+	struct bpt_root *root;
+	pthread_spinlock_t *root_lock;
+	ulong vstart;
+	ulong vend;
+
+	/* It is taken before root_lock. */
+	pthread_spinlock_t lock;
+	struct vmap_class_list list[VMAP_CLASS_MAX_PAGES];
+	struct vmap_area **batch;
+};
+
+extern int vmap_class_init(struct vmap_class_cache *, struct bpt_root *,
+	pthread_spinlock_t *, ulong, ulong);
+extern void vmap_class_destroy(struct vmap_class_cache *);
+extern struct vmap_area *vmap_class_alloc(struct vmap_class_cache *,
+	ulong, ulong);
+extern int vmap_class_free(struct vmap_class_cache *, struct vmap_area *);
+extern void vmap_class_flush(struct vmap_class_cache *);
+
+#endif
@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+#include "vm_ops.h"
+#include "vm_splay.h"
+#include "vm_engine.h"
+
+static void *
+bpt_create(ulong vstart, ulong vend)
+{
+	struct bpt_root *root = malloc(sizeof(*root));
+
+	if (root && vm_init_free_space(root, vstart, vend)) {
+		free(root);
+		root = NULL;
+	}
+
+	return root;
+}
+
+static void
+bpt_destroy(void *root)
+{
+	bpt_root_destroy(root);
+	free(root);
+}
+
+static struct vmap_area *
+bpt_alloc(void *root, ulong size, ulong align, ulong vstart, ulong vend)
+{
+	return alloc_vmap_area(root, size, align, vstart, vend);
+}
+
+static int
+bpt_free(void *root, struct vmap_area *va)
+{
+	return free_vmap_area(root, va);
+}
+
+static void
+bpt_frag_scan(void *root, struct vm_frag *f)
+{
+	vm_frag_scan(root, f);
+}
+
+static void
+bpt_set_policy(void *root, enum vmap_fit_policy policy)
+{
+	vm_set_fit_policy(root, policy);
+}
+
+static int
+bpt_free_lazy(void *root, struct vmap_area *va)
+{
+	return free_vmap_area_lazy(root, va);
+}
+
+static void
+bpt_purge(void *root)
+{
+	purge_vmap_area_lazy(root);
+}
+
+static void *
+splay_create(ulong vstart, ulong vend)
+{
+	struct splay_root *root = malloc(sizeof(*root));
+
+	if (root && splay_init_free_space(root, vstart, vend)) {
+		free(root);
+		root = NULL;
+	}
+
+	return root;
+}
+
+static void
+splay_destroy(void *root)
+{
+	splay_root_destroy(root);
+	free(root);
+}
+
+static struct vmap_area *
+splay_alloc(void *root, ulong size, ulong align, ulong vstart, ulong vend)
+{
+	return splay_alloc_vmap_area(root, size, align, vstart, vend);
+}
+
+static int
+splay_free(void *root, struct vmap_area *va)
+{
+	return splay_free_vmap_area(root, va);
+}
+
+static void
+splay_frag(void *root, struct vm_frag *f)
+{
+	splay_frag_scan(root, f);
+}
+
+const struct vmap_engine_ops vmap_engines[] = {
+	{
+		.name = "bpt",
+		.create = bpt_create,
+		.destroy = bpt_destroy,
+		.alloc = bpt_alloc,
+		.free = bpt_free,
+		.frag_scan = bpt_frag_scan,
+		.set_policy = bpt_set_policy,
+		.free_lazy = bpt_free_lazy,
+		.purge = bpt_purge,
+	},
+	{
+		.name = "splay",
+		.create = splay_create,
+		.destroy = splay_destroy,
+		.alloc = splay_alloc,
+		.free = splay_free,
+		.frag_scan = splay_frag,
+	},
+};
+
+const int nr_vmap_engines = sizeof(vmap_engines) / sizeof(vmap_engines[0]);
+
+/* NULL if there is no such engine. */
+const struct vmap_engine_ops *vmap_engine_lookup(const char *name)
+{
+	int i;
+
+	for (i = 0; i < nr_vmap_engines; i++)
+		if (!strcmp(vmap_engines[i].name, name))
+			return &vmap_engines[i];
+
+	return NULL;
+}
@@ -0,0 +1,33 @@
+#ifndef __VM_ENGINE_H__
+#define __VM_ENGINE_H__
+
+/*
+ * Free space engines behind one interface, so they can be compared
+ * on identical requests, e.g. by ./replay -E. An engine keeps its
+ * free space in an object made by create(), busy areas are plain
+ * vmap_area for all of them.
+ *
+ * "bpt": the B+tree, see vm_ops.c.
+ * "splay": an augmented splay tree, see vm_splay.h.
+ *
+ * set_policy, free_lazy and purge are NULL if an engine has only a
+ * first fit and frees at once.
+ */
+struct vmap_engine_ops {
+	const char *name;
+	void *(*create)(ulong, ulong);
+	void (*destroy)(void *);
+	struct vmap_area *(*alloc)(void *, ulong, ulong, ulong, ulong);
+	int (*free)(void *, struct vmap_area *);
+	void (*frag_scan)(void *, struct vm_frag *);
+	void (*set_policy)(void *, enum vmap_fit_policy);
+	int (*free_lazy)(void *, struct vmap_area *);
+	void (*purge)(void *);
+};
+
+extern const struct vmap_engine_ops vmap_engines[];
+extern const int nr_vmap_engines;
+
+extern const struct vmap_engine_ops *vmap_engine_lookup(const char *);
+
+#endif
@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "vm.h"
+#include "vm_ops.h"
+#include "vm_mmap.h"
+#include "vm_trace.h"
+
+static int
+vmap_mmap_commit(ulong addr, ulong size)
+{
+	return mprotect((void *) addr, size, PROT_READ | PROT_WRITE);
+}
+
+/*
+ * Pages are dropped first, a next touch gets zeroed ones. Then
+ * the range is made inaccessible, a use after free faults.
+ */
+static int
+vmap_mmap_decommit(ulong addr, ulong size)
+{
+	if (madvise((void *) addr, size, MADV_DONTNEED))
+		return -1;
+
+	return mprotect((void *) addr, size, PROT_NONE);
+}
+
+/*
+ * A returned memory is zeroed and is at least "size" bytes, it is
+ * rounded up to pages. "align" is a power of two, not less than
+ * PAGE_SIZE.
+ */
+void *vmap_mmap_alloc(struct vmap_mmap *vm, ulong size, ulong align)
+{
+	struct vmap_area *va;
+	ulong addr;
+
+	if (unlikely(!size))
+		return NULL;
+
+	size = ALIGN(size, PAGE_SIZE);
+
+	pthread_spin_lock(&vm->lock);
+	va = alloc_vmap_area(&vm->root, size + vm->guard,
+		align < PAGE_SIZE ? PAGE_SIZE:align,
+		vm->base, vm->base + vm->size);
+	addr = va ? va->va_start:0;
+	pthread_spin_unlock(&vm->lock);
+
+	if (!va)
+		return NULL;
+
+	/* It is ours, nobody else can get it meanwhile. */
+	if (unlikely(vmap_mmap_commit(addr, size))) {
+		pthread_spin_lock(&vm->lock);
+		(void) vfree_addr(&vm->root, addr);
+		pthread_spin_unlock(&vm->lock);
+		return NULL;
+	}
+
+	return (void *) addr;
+}
+
+/*
+ * "ptr" has to be exactly what vmap_mmap_alloc() has returned. An
+ * area is unlinked from the busy index first, so it is decommitted
+ * out of the lock and only then becomes free.
+ *
+ * Without guard pages neighbours share one kernel mapping, which is
+ * split by a decommit, so it can fail at vm.max_map_count. The area
+ * stays allocated then and -1 is returned, it can be freed later.
+ */
+int vmap_mmap_free(struct vmap_mmap *vm, void *ptr)
+{
+	ulong addr = (ulong) ptr;
+	struct vmap_area *va;
+	int rv;
+
+	pthread_spin_lock(&vm->lock);
+	va = find_vmap_area(&vm->root, addr);
+	if (unlikely(!va || va->va_start != addr ||
+			unlink_busy_va(&vm->root, va))) {
+		pthread_spin_unlock(&vm->lock);
+		return -1;
+	}
+	pthread_spin_unlock(&vm->lock);
+
+	/* Guard pages have never been committed. */
+	if (unlikely(vmap_mmap_decommit(addr, va_size(va) - vm->guard))) {
+		pthread_spin_lock(&vm->lock);
+		if (bpt_po_insert(vm->root.busy, va))
+			BUG();
+		pthread_spin_unlock(&vm->lock);
+		return -1;
+	}
+
+	vm_trace_free(addr, va_size(va));
+
+	pthread_spin_lock(&vm->lock);
+	rv = bpt_po_insert(&vm->root, va);
+	pthread_spin_unlock(&vm->lock);
+
+	return rv;
+}
+
+/*
+ * Reserves "size" bytes of an address space, nothing is committed.
+ * "guard" pages follow every area, zero disables them.
+ */
+int vmap_mmap_init(struct vmap_mmap *vm, ulong size, ulong guard)
+{
+	void *p;
+
+	/* The tree works with PAGE_SIZE, it has to be the real one. */
+	if (sysconf(_SC_PAGESIZE) != PAGE_SIZE)
+		return -1;
+
+	vm->guard = guard * PAGE_SIZE;
+	vm->size = ALIGN(size, PAGE_SIZE);
+	if (vm->size <= vm->guard)
+		return -1;
+
+	p = mmap(NULL, vm->size, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED)
+		return -1;
+
+	vm->base = (ulong) p;
+	pthread_spin_init(&vm->lock, PTHREAD_PROCESS_PRIVATE);
+
+	/* A leading guard, the first area has one in front as well. */
+	if (vm_init_free_space(&vm->root, vm->base + vm->guard,
+			vm->base + vm->size))
+		goto fail;
+
+	if (vm_init_busy_index(&vm->root)) {
+		vmap_area_free(bpn_get_val(vm->root.node, 0));
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	bpt_root_destroy(&vm->root);
+	pthread_spin_destroy(&vm->lock);
+	(void) munmap(p, vm->size);
+	return -1;
+}
+
+/*
+ * All areas have to be freed, so the region is one free area again.
+ * It is released with the tree and the whole region is unmapped.
+ */
+void vmap_mmap_destroy(struct vmap_mmap *vm)
+{
+	BUG_ON(!is_bpn_external(vm->root.node) ||
+		vm->root.node->entries != 1);
+
+	vmap_area_free(bpn_get_val(vm->root.node, 0));
+	bpt_root_destroy(&vm->root);
+	pthread_spin_destroy(&vm->lock);
+
+	(void) munmap((void *) vm->base, vm->size);
+	vm->base = 0;
+	vm->size = 0;
+}
@@ -0,0 +1,35 @@
+#ifndef __VM_MMAP_H__
+#define __VM_MMAP_H__
+
+#include <pthread.h>
+
+/*
+ * A user space memory manager over the allocator. A big PROT_NONE
+ * region is reserved once and the tree hands out its sub-ranges, an
+ * area is committed with mprotect() when it is allocated and is
+ * decommitted by MADV_DONTNEED when it is freed, so freed memory is
+ * given back to the system while the range stays reserved.
+ *
+ * Every area is followed by "guard" pages which are never committed,
+ * an overrun faults instead of corrupting a neighbour. The region
+ * starts with them as well. Areas are found by an address over the
+ * busy index, system calls are done out of the lock.
+ *
+ * A committed area is a separate mapping for the kernel, so a number
+ * of live areas is bounded by vm.max_map_count, an allocation fails
+ * above it.
+ */
+struct vmap_mmap {
+	struct bpt_root root;
+	pthread_spinlock_t lock;
+	ulong base;
+	ulong size;
+	ulong guard;			/* bytes after every area */
+};
+
+extern int vmap_mmap_init(struct vmap_mmap *, ulong, ulong);
+extern void vmap_mmap_destroy(struct vmap_mmap *);
+extern void *vmap_mmap_alloc(struct vmap_mmap *, ulong, ulong);
+extern int vmap_mmap_free(struct vmap_mmap *, void *);
+
+#endif
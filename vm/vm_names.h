@@ -0,0 +1,112 @@
+#ifndef __VM_NAMES_H__
+#define __VM_NAMES_H__
+
+/*
+ * The tree can be built for several orders which are linked into
+ * one binary, e.g. sweep. Then its objects are built per order with
+ * -DBPT_ORDER=<m> -DBPT_SUFFIX=_o<m>, so every external symbol of
+ * the tree gets the suffix. vm_stat and vm_trace do not depend on
+ * the order, they are shared and not renamed.
+ */
+#ifdef BPT_SUFFIX
+#define __BPT_NAME(name, suffix) name##suffix
+#define _BPT_NAME(name, suffix) __BPT_NAME(name, suffix)
+#define BPT_NAME(name) _BPT_NAME(name, BPT_SUFFIX)
+
+/* vm.c */
+#define bpn_inter_cachep BPT_NAME(bpn_inter_cachep)
+#define bpn_leaf_cachep BPT_NAME(bpn_leaf_cachep)
+#define bpn_leaf_meta_scan BPT_NAME(bpn_leaf_meta_scan)
+#define vmap_area_cachep BPT_NAME(vmap_area_cachep)
+#define bpn_try_shift_left BPT_NAME(bpn_try_shift_left)
+#define bpn_try_shift_right BPT_NAME(bpn_try_shift_right)
+#define bpt_bulk_insert BPT_NAME(bpt_bulk_insert)
+#define bpt_bulk_load BPT_NAME(bpt_bulk_load)
+#define bpt_lookup BPT_NAME(bpt_lookup)
+#define bpt_lookup_leaf BPT_NAME(bpt_lookup_leaf)
+#define bpt_po_delete BPT_NAME(bpt_po_delete)
+#define bpt_po_insert BPT_NAME(bpt_po_insert)
+#define bpt_root_destroy BPT_NAME(bpt_root_destroy)
+#define bpt_root_init BPT_NAME(bpt_root_init)
+
+/* vm_ops.c */
+#define alloc_vmap_area BPT_NAME(alloc_vmap_area)
+#define alloc_vmap_areas BPT_NAME(alloc_vmap_areas)
+#define bpn_class_mask BPT_NAME(bpn_class_mask)
+#define bpn_max_avail BPT_NAME(bpn_max_avail)
+#define bpn_set_sub_meta BPT_NAME(bpn_set_sub_meta)
+#define bpt_lookup_highest_leaf BPT_NAME(bpt_lookup_highest_leaf)
+#define bpt_lookup_lowest_leaf BPT_NAME(bpt_lookup_lowest_leaf)
+#define coalesce_vmap_areas BPT_NAME(coalesce_vmap_areas)
+#define extend_vmap_area BPT_NAME(extend_vmap_area)
+#define find_vmap_area BPT_NAME(find_vmap_area)
+#define fixup_metadata BPT_NAME(fixup_metadata)
+#define fixup_subavail BPT_NAME(fixup_subavail)
+#define free_vmap_area BPT_NAME(free_vmap_area)
+#define free_vmap_area_lazy BPT_NAME(free_vmap_area_lazy)
+#define lin_lookup_smallest_va BPT_NAME(lin_lookup_smallest_va)
+#define lookup_best_va BPT_NAME(lookup_best_va)
+#define lookup_highest_va BPT_NAME(lookup_highest_va)
+#define lookup_smallest_va BPT_NAME(lookup_smallest_va)
+#define purge_vmap_area_lazy BPT_NAME(purge_vmap_area_lazy)
+#define shrink_vmap_area BPT_NAME(shrink_vmap_area)
+#define try_merge_va BPT_NAME(try_merge_va)
+#define unlink_busy_va BPT_NAME(unlink_busy_va)
+#define va_alloc BPT_NAME(va_alloc)
+#define vfree_addr BPT_NAME(vfree_addr)
+#define vm_frag_index BPT_NAME(vm_frag_index)
+#define vm_frag_sample BPT_NAME(vm_frag_sample)
+#define vm_frag_scan BPT_NAME(vm_frag_scan)
+#define vm_init_busy_index BPT_NAME(vm_init_busy_index)
+#define vm_init_frag_stat BPT_NAME(vm_init_frag_stat)
+#define vm_init_free_space BPT_NAME(vm_init_free_space)
+#define vm_load_free_space BPT_NAME(vm_load_free_space)
+#define vm_set_fit_policy BPT_NAME(vm_set_fit_policy)
+
+/* vm_olc.c */
+#define alloc_vmap_area_olc BPT_NAME(alloc_vmap_area_olc)
+#define free_vmap_area_olc BPT_NAME(free_vmap_area_olc)
+
+/* vm_simd.c */
+#define bpn_search BPT_NAME(bpn_search)
+#define bpn_search_select BPT_NAME(bpn_search_select)
+#define bpn_search_supported BPT_NAME(bpn_search_supported)
+
+/* debug.c */
+#define dump_tree BPT_NAME(dump_tree)
+
+/* vm_pcpu.c */
+#define vmap_pcpu_alloc BPT_NAME(vmap_pcpu_alloc)
+#define vmap_pcpu_destroy BPT_NAME(vmap_pcpu_destroy)
+#define vmap_pcpu_free BPT_NAME(vmap_pcpu_free)
+#define vmap_pcpu_init BPT_NAME(vmap_pcpu_init)
+
+/* vm_class.c */
+#define vmap_class_alloc BPT_NAME(vmap_class_alloc)
+#define vmap_class_destroy BPT_NAME(vmap_class_destroy)
+#define vmap_class_flush BPT_NAME(vmap_class_flush)
+#define vmap_class_free BPT_NAME(vmap_class_free)
+#define vmap_class_init BPT_NAME(vmap_class_init)
+
+/* vm_mmap.c */
+#define vmap_mmap_alloc BPT_NAME(vmap_mmap_alloc)
+#define vmap_mmap_destroy BPT_NAME(vmap_mmap_destroy)
+#define vmap_mmap_free BPT_NAME(vmap_mmap_free)
+#define vmap_mmap_init BPT_NAME(vmap_mmap_init)
+
+/* vm_reclaim.c */
+#define vmap_reclaim_alloc BPT_NAME(vmap_reclaim_alloc)
+#define vmap_reclaim_destroy BPT_NAME(vmap_reclaim_destroy)
+#define vmap_reclaim_drain BPT_NAME(vmap_reclaim_drain)
+#define vmap_reclaim_free BPT_NAME(vmap_reclaim_free)
+#define vmap_reclaim_init BPT_NAME(vmap_reclaim_init)
+
+/* vm_zone.c */
+#define vmap_zones_alloc BPT_NAME(vmap_zones_alloc)
+#define vmap_zones_destroy BPT_NAME(vmap_zones_destroy)
+#define vmap_zones_free BPT_NAME(vmap_zones_free)
+#define vmap_zones_init BPT_NAME(vmap_zones_init)
+#define vmap_zones_stat BPT_NAME(vmap_zones_stat)
+#endif
+
+#endif
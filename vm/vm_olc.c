@@ -0,0 +1,645 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "vm.h"
+#include "vm_ops.h"
+#include "vm_simd.h"
+#include "vm_olc.h"
+#include "vm_stat.h"
+#include "vm_trace.h"
+#include "array.h"
+
+/*
+ * Optimistic lock coupling.
+ *
+ * Every node has a version word, bit 0 is a lock bit and the rest
+ * is a counter which is bumped by each unlock of a modified node.
+ * A reader takes a snapshot of the version, reads a node and then
+ * validates the snapshot, if it has changed the reader restarts.
+ * A writer locks a node by moving the snapshot it has validated to
+ * a locked state, so a node is not changed behind its back.
+ *
+ * Concurrent operations only clip, extend, add or remove an area
+ * within one leaf and update SUB_AVAIL of nodes above it. They do
+ * that holding root->smo_lock shared, therefore split keys, links
+ * and parents are stable and a route can be kept in a local path
+ * instead of "ppos", which is shared. Everything else, splits,
+ * merges, a merge over a leaf boundary or a change of a split key,
+ * is done by the generic code holding root->smo_lock exclusive.
+ * There are no optimistic readers at that time, so the generic
+ * code does not touch versions.
+ */
+/*
+ * Every internal node but the root has at least BPT_ORDER / 2 >= 2
+ * children, so 64 internal levels cover any number of areas. A
+ * deeper path falls back to the generic code anyway.
+ */
+#if (BPT_ORDER >> 1) < 2
+#error "OLC_MAX_HIGH does not cover BPT_ORDER"
+#endif
+
+enum {
+	OLC_LOCKED = 1,
+	OLC_MAX_HIGH = 64,
+	OLC_MAX_RESTARTS = 64,
+};
+
+/* Outcomes of an attempt to change a leaf. */
+enum olc_rv {
+	OLC_DONE,
+	OLC_RESTART,
+	OLC_FALLBACK,
+};
+
+struct olc_path {
+	struct bpn *node[OLC_MAX_HIGH];
+	int pos[OLC_MAX_HIGH];
+	int high;
+};
+
+static __always_inline void
+cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#else
+	__asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+/* Waits until a node is unlocked and returns its version. */
+static __always_inline ulong
+olc_read_begin(struct bpn *n)
+{
+	ulong v;
+
+	while ((v = __atomic_load_n(&n->version, __ATOMIC_ACQUIRE)) & OLC_LOCKED)
+		cpu_relax();
+
+	return v;
+}
+
+/* Same as above, but does not wait. */
+static __always_inline bool
+olc_try_read_begin(struct bpn *n, ulong *v)
+{
+	*v = __atomic_load_n(&n->version, __ATOMIC_ACQUIRE);
+	return !(*v & OLC_LOCKED);
+}
+
+static __always_inline bool
+olc_read_validate(struct bpn *n, ulong v)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&n->version, __ATOMIC_RELAXED) == v;
+}
+
+/* Locks a node if it is still of "v" version. */
+static __always_inline bool
+olc_upgrade(struct bpn *n, ulong v)
+{
+	return __atomic_compare_exchange_n(&n->version, &v, v | OLC_LOCKED,
+		false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static __always_inline void
+olc_write_lock(struct bpn *n)
+{
+	while (!olc_upgrade(n, olc_read_begin(n)))
+		cpu_relax();
+}
+
+static __always_inline void
+olc_write_unlock(struct bpn *n)
+{
+	__atomic_fetch_add(&n->version, OLC_LOCKED, __ATOMIC_RELEASE);
+}
+
+/* Readers which have seen it locked are still valid. */
+static __always_inline void
+olc_write_unlock_unchanged(struct bpn *n)
+{
+	__atomic_fetch_sub(&n->version, OLC_LOCKED, __ATOMIC_RELEASE);
+}
+
+/*
+ * Propagates a max size of a locked node up to the root. A parent
+ * is locked before its child is released, thus updates of one
+ * SUB_AVAIL entry are ordered. It stops as soon as a parent already
+ * has the same value. All nodes on the way are unlocked.
+ */
+static void
+olc_fixup_metadata(struct bpn *n, struct olc_path *path)
+{
+	struct bpn *p;
+	int level;
+
+	for (level = path->high - 1; level >= 0; level--) {
+		p = path->node[level];
+
+		/* The child is locked, so it is stable. */
+		olc_write_lock(p);
+		if (!bpn_set_sub_meta(p, path->pos[level])) {
+			olc_write_unlock_unchanged(p);
+			break;
+		}
+
+		olc_write_unlock(n);
+		n = p;
+	}
+
+	olc_write_unlock(n);
+	vm_stat_fixup(path->high - 1 - level);
+}
+
+/*
+ * An upper split key of a leaf a path ends with, an area must not
+ * go over it. Split keys are stable while smo_lock is held shared.
+ */
+static __always_inline ulong
+olc_leaf_upper_bound(struct olc_path *path)
+{
+	struct bpn *p;
+	int level;
+
+	for (level = path->high - 1; level >= 0; level--) {
+		p = path->node[level];
+		if (path->pos[level] < p->entries)
+			return p->slot[path->pos[level]];
+	}
+
+	return ULONG_MAX;
+}
+
+/*
+ * Finds a leaf which "key" belongs to. Split keys and links are not
+ * changed by concurrent operations, so only a leaf version matters.
+ * Returns NULL if the path is too deep.
+ */
+static struct bpn *
+olc_lookup_leaf(struct bpt_root *root, ulong key,
+	struct olc_path *path, ulong *version)
+{
+	struct bpn *n = root->node;
+	pos_cc_t pos_cc;
+	int pos;
+
+	path->high = 0;
+
+	while (is_bpn_internal(n)) {
+		pos_cc = bpn_bin_search(n, key, &pos);
+		if (pos_cc == POS_CC_EQ)
+			pos++;
+
+		if (unlikely(path->high == OLC_MAX_HIGH))
+			return NULL;
+
+		path->node[path->high] = n;
+		path->pos[path->high++] = pos;
+		n = n->SUB_LINKS[pos];
+	}
+
+	*version = olc_read_begin(n);
+	return n;
+}
+
+/*
+ * Index based version of leaf_get_va_cond(). A leaf can be changed
+ * in the middle, a caller validates it afterwards.
+ */
+static __always_inline int
+olc_leaf_get_va_cond(struct bpn *n, ulong size, ulong align, ulong vstart)
+{
+	int i, entries = n->entries;
+
+	if (entries > MAX_ENTRIES)
+		entries = MAX_ENTRIES;
+
+	for (i = 0; i < entries; i++) {
+		ulong va_start = n->LEAF_VA_START[i];
+		ulong va_end = n->LEAF_VA_END[i];
+
+		if (va_end - va_start < size)
+			continue;
+
+		if (is_within_this_range(va_start, va_end, size, align, vstart))
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * Concurrent version of lookup_smallest_va(). It returns a leaf, a
+ * position of a VA within it and a validated version of the leaf,
+ * or NULL if nothing has been found or it has restarted too many
+ * times. In both cases a caller falls back to the generic path.
+ */
+static struct bpn *
+olc_lookup_smallest_va(struct bpt_root *root, ulong size, ulong align,
+	ulong vstart, struct olc_path *path, ulong *version, int *va_pos)
+{
+	int i, j, pos, level, restarts = 0;
+	ulong next_vstart, v;
+	struct bpn *n, *child;
+	bool is_sub_avail;
+	u32 pages;
+
+	pages = va_avail_pages((align > PAGE_SIZE) ? size + align - 1:size);
+
+	/* We can repeat only once! */
+	for (i = 0; i < 2; i++) {
+restart:
+		if (unlikely(restarts++ == OLC_MAX_RESTARTS))
+			return NULL;
+
+		vm_stat_inc(VM_STAT_DESCENTS);
+
+		n = root->node;
+		v = olc_read_begin(n);
+		path->high = 0;
+
+		while (is_bpn_internal(n)) {
+			pos = bpn_search->first_fit(n, pages, vstart);
+			child = n->SUB_LINKS[pos];
+			if (!olc_read_validate(n, v)) {
+				vm_stat_inc(VM_STAT_OLC_RESTARTS);
+				goto restart;
+			}
+
+			if (unlikely(path->high == OLC_MAX_HIGH))
+				return NULL;
+
+			path->node[path->high] = n;
+			path->pos[path->high++] = pos;
+			n = child;
+			v = olc_read_begin(n);
+		}
+
+		pos = olc_leaf_get_va_cond(n, size, align, vstart);
+		if (!olc_read_validate(n, v)) {
+			vm_stat_inc(VM_STAT_OLC_RESTARTS);
+			goto restart;
+		}
+
+		if (pos >= 0) {
+			*version = v;
+			*va_pos = pos;
+			return n;
+		}
+
+		/* Same as first_next_sub_avail(), but over the path. */
+		is_sub_avail = false;
+
+		for (level = path->high - 1; level >= 0; level--) {
+			n = path->node[level];
+			v = olc_read_begin(n);
+
+			for (j = path->pos[level] + 1; j < n->entries + 1; j++) {
+				if (n->SUB_AVAIL[j] >= pages) {
+					next_vstart = n->slot[j - 1];
+					is_sub_avail = true;
+					break;
+				}
+			}
+
+			if (!olc_read_validate(n, v)) {
+				vm_stat_inc(VM_STAT_OLC_RESTARTS);
+				goto restart;
+			}
+
+			if (is_sub_avail)
+				break;
+		}
+
+		if (unlikely(!is_sub_avail))
+			break;
+
+		/* Update "vstart" to a new sub-tree start address. */
+		vstart = next_vstart;
+		vm_stat_inc(VM_STAT_RETRIES);
+	}
+
+	return NULL;
+}
+
+/*
+ * Clips a VA at "pos" of a locked leaf. Returns false if it needs
+ * a split or a merge of the leaf, the leaf is kept locked then.
+ */
+static bool
+olc_va_clip(struct bpt_root *root, struct bpn *n, int pos,
+	ulong nva_start_addr, ulong size, struct vmap_area **unused)
+{
+	ulong va_start = n->LEAF_VA_START[pos];
+	ulong va_end = n->LEAF_VA_END[pos];
+	struct vmap_area *lva;
+
+	*unused = NULL;
+
+	if (va_start == nva_start_addr) {
+		if (va_end == nva_start_addr + size) {
+			/* FL, the leaf shrinks. */
+			if (n->info.parent && !is_bpn_gt_min(n))
+				return false;
+
+			*unused = bpn_get_val(n, pos);
+			slot_remove(n, pos);
+			n->entries--;
+			bpn_leaf_meta_scan(n);
+			vm_frag_del(root, size);
+		} else {
+			/* LE */
+			bpn_set_va_start(root, n, pos, nva_start_addr + size);
+		}
+	} else if (va_end == nva_start_addr + size) {
+		/* RE */
+		bpn_set_va_end(root, n, pos, nva_start_addr);
+	} else {
+		/* NE, the leaf grows. */
+		if (is_bpn_full(n))
+			return false;
+
+		lva = vmap_area_alloc();
+		if (unlikely(!lva))
+			return false;
+
+		lva->va_start = va_start;
+		lva->va_end = nva_start_addr;
+
+		bpn_set_va_start(root, n, pos, nva_start_addr + size);
+		slot_insert(n, pos, (ulong) lva);
+		n->entries++;
+		bpn_leaf_meta_add(n, va_size(lva));
+		vm_frag_add(root, va_size(lva));
+	}
+
+	return true;
+}
+
+static ulong
+va_alloc_olc(struct bpt_root *root, ulong size,
+		ulong align, ulong vstart, ulong vend)
+{
+	struct vmap_area *unused;
+	ulong nva_start_addr, va_start, version;
+	struct olc_path path;
+	int pos, restarts;
+	struct bpn *n;
+
+	for (restarts = 0; restarts < OLC_MAX_RESTARTS; restarts++) {
+		n = olc_lookup_smallest_va(root, size, align, vstart,
+			&path, &version, &pos);
+		if (!n)
+			break;
+
+		/* Changed since it has been seen. */
+		if (!olc_upgrade(n, version)) {
+			vm_stat_inc(VM_STAT_OLC_RESTARTS);
+			continue;
+		}
+
+		va_start = n->LEAF_VA_START[pos];
+		if (va_start > vstart)
+			nva_start_addr = ALIGN(va_start, align);
+		else
+			nva_start_addr = ALIGN(vstart, align);
+
+		/*
+		 * The lookup is not exact for a big alignment, a lower
+		 * block can still fit, so the slow path decides.
+		 */
+		if (nva_start_addr + size > vend) {
+			olc_write_unlock_unchanged(n);
+			return 0;
+		}
+
+		if (!olc_va_clip(root, n, pos, nva_start_addr, size, &unused)) {
+			olc_write_unlock_unchanged(n);
+			break;
+		}
+
+		olc_fixup_metadata(n, &path);
+		vmap_area_free(unused);
+		return nva_start_addr;
+	}
+
+	/* Zero is never allocated, so it means "go slow path". */
+	return 0;
+}
+
+struct vmap_area *
+alloc_vmap_area_olc(struct bpt_root *root, ulong size,
+		ulong align, ulong vstart, ulong vend)
+{
+	ulong start = vm_stat_time();
+	struct vmap_area *va;
+	ulong addr;
+
+	va = vmap_area_alloc();
+	if (unlikely(!va))
+		return NULL;
+
+	/* Other policies are served by the slow path. */
+	addr = 0;
+	if (likely(root->fit.policy == VMAP_FIRST_FIT)) {
+		pthread_rwlock_rdlock(&root->smo_lock);
+		addr = va_alloc_olc(root, size, align, vstart, vend);
+		pthread_rwlock_unlock(&root->smo_lock);
+	}
+
+	if (unlikely(!addr)) {
+		pthread_rwlock_wrlock(&root->smo_lock);
+		addr = va_alloc(root, size, align, vstart, vend);
+		if (addr == vend && root->lazy.nr) {
+			/* Lazily freed areas can make it fit. */
+			purge_vmap_area_lazy(root);
+			addr = va_alloc(root, size, align, vstart, vend);
+		}
+		pthread_rwlock_unlock(&root->smo_lock);
+	}
+
+	if (addr == vend) {
+		vmap_area_free(va);
+		vm_stat_latency(VM_STAT_ALLOC, start);
+		vm_trace_alloc(0, size, align, vstart, vend);
+		return NULL;
+	}
+
+	va->va_start = addr;
+	va->va_end = addr + size;
+
+	/* The busy index is not concurrent, its own lock serializes it. */
+	if (root->busy) {
+		pthread_rwlock_wrlock(&root->busy->smo_lock);
+		if (bpt_po_insert(root->busy, va))
+			BUG();
+		pthread_rwlock_unlock(&root->busy->smo_lock);
+	}
+
+	vm_stat_latency(VM_STAT_ALLOC, start);
+	vm_trace_alloc(addr, size, align, vstart, vend);
+	return va;
+}
+
+/*
+ * Places a freed VA into a locked leaf, merging it with neighbours
+ * within the leaf. Unless it is done, the leaf is kept locked and
+ * unchanged. "va" is set to a VA which is not needed anymore.
+ */
+static enum olc_rv
+olc_place_va(struct bpt_root *root, struct bpn *n,
+	struct olc_path *path, struct vmap_area **va)
+{
+	ulong va_start = (*va)->va_start;
+	ulong va_end = (*va)->va_end;
+	bool merge_left, merge_right;
+	struct bpn *sibling;
+	struct vmap_area *right;
+	pos_cc_t pos_cc;
+	ulong v;
+	int pos;
+
+	pos_cc = bpn_bin_search(n, va_start, &pos);
+	if (pos_cc == POS_CC_EQ)
+		return OLC_FALLBACK;
+
+	/* Overlaps, let generic code complain. */
+	if (pos < n->entries && n->LEAF_VA_START[pos] < va_end)
+		return OLC_FALLBACK;
+
+	if (pos > 0 && n->LEAF_VA_END[pos - 1] > va_start)
+		return OLC_FALLBACK;
+
+	/*
+	 * A VA on a leaf boundary can be adjacent to an edge VA of a
+	 * sibling. Such VA can only grow toward this leaf by a free on
+	 * the same boundary, which checks this locked leaf in its turn,
+	 * so a consistent snapshot of the sibling is enough.
+	 */
+	sibling = NULL;
+	if (pos == 0)
+		sibling = leaf_prev_or_null(root, n);
+	else if (pos == n->entries)
+		sibling = leaf_next_or_null(root, n);
+
+	if (sibling) {
+		bool adjacent;
+
+		/* Do not wait, its owner can be waiting for this leaf. */
+		if (!olc_try_read_begin(sibling, &v))
+			return OLC_RESTART;
+
+		if (pos == 0)
+			adjacent = sibling->LEAF_VA_END[sibling->entries - 1] >= va_start;
+		else
+			adjacent = sibling->LEAF_VA_START[0] <= va_end;
+
+		if (!olc_read_validate(sibling, v))
+			return OLC_RESTART;
+
+		/* A merge over a leaf boundary. */
+		if (adjacent)
+			return OLC_FALLBACK;
+	}
+
+	merge_left = (pos > 0 && n->LEAF_VA_END[pos - 1] == va_start);
+	merge_right = (pos < n->entries && n->LEAF_VA_START[pos] == va_end);
+
+	if (merge_left && merge_right) {
+		if (n->info.parent && !is_bpn_gt_min(n))
+			return OLC_FALLBACK;
+
+		right = bpn_get_val(n, pos);
+		bpn_set_va_end(root, n, pos - 1, n->LEAF_VA_END[pos]);
+		slot_remove(n, pos);
+		n->entries--;
+		bpn_leaf_meta_scan(n);
+		vm_frag_del(root, va_size(right));
+
+		vmap_area_free(right);
+	} else if (merge_left) {
+		if (va_end > olc_leaf_upper_bound(path))
+			return OLC_FALLBACK;
+
+		bpn_set_va_end(root, n, pos - 1, va_end);
+	} else if (merge_right) {
+		bpn_set_va_start(root, n, pos, va_start);
+	} else {
+		if (is_bpn_full(n) || va_end > olc_leaf_upper_bound(path))
+			return OLC_FALLBACK;
+
+		slot_insert(n, pos, (ulong) *va);
+		n->entries++;
+		bpn_leaf_meta_add(n, va_end - va_start);
+		vm_frag_add(root, va_end - va_start);
+		*va = NULL;
+	}
+
+	return OLC_DONE;
+}
+
+int free_vmap_area_olc(struct bpt_root *root, struct vmap_area *va)
+{
+	ulong start = vm_stat_time();
+	struct vmap_area *unused;
+	struct olc_path path;
+	enum olc_rv olc_rv;
+	ulong version;
+	int restarts, rv;
+	struct bpn *n;
+
+	if (unlikely(!va))
+		return -1;
+
+	if (root->busy) {
+		pthread_rwlock_wrlock(&root->busy->smo_lock);
+		rv = unlink_busy_va(root, va);
+		pthread_rwlock_unlock(&root->busy->smo_lock);
+
+		if (rv)
+			return -1;
+	}
+
+	vm_trace_free(va->va_start, va_size(va));
+
+	pthread_rwlock_rdlock(&root->smo_lock);
+	for (restarts = 0; restarts < OLC_MAX_RESTARTS; restarts++) {
+		n = olc_lookup_leaf(root, va->va_start, &path, &version);
+		if (unlikely(!n))
+			break;
+
+		if (!olc_upgrade(n, version)) {
+			vm_stat_inc(VM_STAT_OLC_RESTARTS);
+			continue;
+		}
+
+		unused = va;
+		olc_rv = olc_place_va(root, n, &path, &unused);
+		if (olc_rv != OLC_DONE) {
+			olc_write_unlock_unchanged(n);
+			if (olc_rv == OLC_RESTART) {
+				vm_stat_inc(VM_STAT_OLC_RESTARTS);
+				continue;
+			}
+
+			break;
+		}
+
+		olc_fixup_metadata(n, &path);
+		pthread_rwlock_unlock(&root->smo_lock);
+
+		vmap_area_free(unused);
+		vm_stat_latency(VM_STAT_FREE, start);
+		return 0;
+	}
+	pthread_rwlock_unlock(&root->smo_lock);
+
+	pthread_rwlock_wrlock(&root->smo_lock);
+	rv = bpt_po_insert(root, va);
+	pthread_rwlock_unlock(&root->smo_lock);
+
+	vm_stat_latency(VM_STAT_FREE, start);
+	return rv;
+}
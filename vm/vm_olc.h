@@ -0,0 +1,14 @@
+#ifndef __VM_OLC_H__
+#define __VM_OLC_H__
+
+/*
+ * Allocator entry points which are safe to be called concurrently
+ * without an external lock, see vm_olc.c. They must not be mixed
+ * with callers of the generic ones unless those hold smo_lock
+ * exclusive.
+ */
+extern struct vmap_area *alloc_vmap_area_olc(struct bpt_root *,
+	ulong, ulong, ulong, ulong);
+extern int free_vmap_area_olc(struct bpt_root *, struct vmap_area *);
+
+#endif
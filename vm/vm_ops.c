@@ -4,70 +4,169 @@
 
 #include "vm.h"
 #include "vm_ops.h"
+#include "vm_simd.h"
+#include "vm_stat.h"
+#include "vm_trace.h"
 
+/*
+ * It is exact for a leaf. SUB_AVAIL of an internal node is in pages,
+ * so it is exact for page multiples below 16TB, an upper bound else.
+ */
 ulong bpn_max_avail(struct bpn *n)
 {
-	ulong avail = 0;
+	if (is_bpn_internal(n))
+		return (ulong) bpn_search->max_avail(n) << PAGE_SHIFT;
+
+	/* Cached, see bpn_leaf_meta_scan(). */
+	return n->LEAF_MAX_AVAIL;
+}
+
+/* Same as bpn_max_avail(), in units of SUB_AVAIL. */
+static __always_inline u32
+bpn_max_avail_pages(struct bpn *n)
+{
+	if (is_bpn_internal(n))
+		return bpn_search->max_avail(n);
+
+	return va_avail_pages(n->LEAF_MAX_AVAIL);
+}
+
+/* A mask of size classes of free areas within a sub-tree. */
+u32 bpn_class_mask(struct bpn *n)
+{
+	u32 mask = 0;
 	int i;
 
-	if (is_bpn_internal(n)) {
-		for (i = 0; i < n->entries + 1; i++) {
-			if (n->SUB_AVAIL[i] > avail)
-				avail = n->SUB_AVAIL[i];
-		}
-	} else {
-		/* Open up all VAs in a node(cache misses). */
-		for (i = 0; i < n->entries; i++) {
-			struct vmap_area *va = bpn_get_val(n, i);
+	if (!is_bpn_internal(n))
+		return n->LEAF_CLASS;
 
-			if (va_size(va) > avail)
-				avail = va_size(va);
-		}
+	for (i = 0; i < n->entries + 1; i++)
+		mask |= n->SUB_CLASS[i];
+
+	return mask;
+}
+
+/*
+ * Recalculates metadata of a child "i" of a parent "p". Returns
+ * false if nothing has changed.
+ */
+bool bpn_set_sub_meta(struct bpn *p, int i)
+{
+	struct bpn *child = p->SUB_LINKS[i];
+	u32 max_avail = bpn_max_avail_pages(child);
+	u32 mask = bpn_class_mask(child);
+
+	if (is_bpn_internal(child))
+		vm_stat_inc(VM_STAT_META_SCANS);
+
+	if (p->SUB_AVAIL[i] == max_avail && p->SUB_CLASS[i] == mask)
+		return false;
+
+	p->SUB_AVAIL[i] = max_avail;
+	p->SUB_CLASS[i] = mask;
+	return true;
+}
+
+/*
+ * Sets metadata of a child "i" of "p" to "avail" and "mask" and
+ * turns them into ones of "p" itself. They are derived from the
+ * previous ones of "p", which its parent keeps at "gpos". "p" is
+ * scanned only if the child was the biggest one and has shrunk or
+ * it has lost a class. Returns false if the child has not changed,
+ * so nothing above has to be updated.
+ */
+static __always_inline bool
+bpn_propagate_meta(struct bpn *p, int i, int gpos, u32 *avail, u32 *mask)
+{
+	u32 old_avail = p->SUB_AVAIL[i];
+	u32 old_mask = p->SUB_CLASS[i];
+	struct bpn *gp = p->info.parent;
+
+	if (old_avail == *avail && old_mask == *mask)
+		return false;
+
+	p->SUB_AVAIL[i] = *avail;
+	p->SUB_CLASS[i] = *mask;
+
+	/* The root, nothing to propagate. */
+	if (!gp)
+		return true;
+
+	if (*avail < old_avail && old_avail == gp->SUB_AVAIL[gpos]) {
+		*avail = bpn_search->max_avail(p);
+		vm_stat_inc(VM_STAT_META_SCANS);
+	} else if (*avail < gp->SUB_AVAIL[gpos]) {
+		*avail = gp->SUB_AVAIL[gpos];
+	}
+
+	if (old_mask & ~*mask) {
+		*mask = bpn_class_mask(p);
+		vm_stat_inc(VM_STAT_META_SCANS);
+	} else {
+		*mask |= gp->SUB_CLASS[gpos];
 	}
 
-	return avail;
+	return true;
 }
 
+/*
+ * Propagates metadata of a changed leaf up over a route which
+ * is recorded in "ppos" of the nodes on the way.
+ */
 void fixup_metadata(struct bpn *node)
 {
-	struct bpn *parent;
-	ulong max_avail;
-	u8 child_index;
+	u32 avail = bpn_max_avail_pages(node);
+	u32 mask = bpn_class_mask(node);
+	struct bpn *p, *gp;
+	ulong depth = 0;
 
-	while (node->info.parent) {
-		parent = node->info.parent;
-		child_index = parent->info.ppos;
+	for (p = node->info.parent; p; p = gp) {
+		gp = p->info.parent;
 
-		max_avail = bpn_max_avail(node);
-		if (parent->SUB_AVAIL[child_index] == max_avail)
+		if (!bpn_propagate_meta(p, p->info.ppos,
+				gp ? gp->info.ppos:0, &avail, &mask))
 			break;
 
-		parent->SUB_AVAIL[child_index] = max_avail;
-		node = parent;
+		depth++;
 	}
+
+	vm_stat_fixup(depth);
 }
 
-void fixup_subavail(struct bpn *n, ulong va_start)
+static __always_inline int
+bpn_sub_pos(struct bpn *p, ulong va_start)
 {
-	struct bpn *parent;
-	ulong max_avail;
-	pos_cc_t pos_cc;
 	int pos;
 
-	while (n->info.parent) {
-		parent = n->info.parent;
-		pos_cc = bpn_bin_search(parent, va_start, &pos);
+	if (bpn_bin_search(p, va_start, &pos) == POS_CC_EQ)
+		pos++;
 
-		if (pos_cc == POS_CC_EQ)
-			pos++;
+	return pos;
+}
 
-		max_avail = bpn_max_avail(n);
-		if (parent->SUB_AVAIL[pos] == max_avail)
+/* Same as fixup_metadata(), a route is searched by "va_start". */
+void fixup_subavail(struct bpn *n, ulong va_start)
+{
+	u32 avail = bpn_max_avail_pages(n);
+	u32 mask = bpn_class_mask(n);
+	struct bpn *p, *gp;
+	ulong depth = 0;
+	int pos, gpos;
+
+	p = n->info.parent;
+	pos = p ? bpn_sub_pos(p, va_start):0;
+
+	for (; p; p = gp, pos = gpos) {
+		gp = p->info.parent;
+		gpos = gp ? bpn_sub_pos(gp, va_start):0;
+
+		if (!bpn_propagate_meta(p, pos, gpos, &avail, &mask))
 			break;
 
-		parent->SUB_AVAIL[pos] = max_avail;
-		n = parent;
+		depth++;
 	}
+
+	vm_stat_fixup(depth);
 }
 
 #define BIT(pos) (1 << (pos))
@@ -87,12 +186,9 @@ can_merge_to_left(struct bpn *n, struct vmap_area *va,
 		int pos, merge_state *ms)
 {
 	int sibling_pos = pos - 1;
-	struct vmap_area *sibling;
 
 	if (sibling_pos >= 0 && sibling_pos < n->entries) {
-		sibling = bpn_get_val(n, sibling_pos);
-
-		if (sibling->va_end == va->va_start)
+		if (n->LEAF_VA_END[sibling_pos] == va->va_start)
 			SET_BIT(*ms, MERGE_WITH_LEFT);
 	}
 }
@@ -102,12 +198,9 @@ can_merge_to_right(struct bpn *n, struct vmap_area *va,
 		int pos, merge_state *ms)
 {
 	int sibling_pos = pos;
-	struct vmap_area *sibling;
 
 	if (sibling_pos >= 0 && sibling_pos < n->entries) {
-		sibling = bpn_get_val(n, sibling_pos);
-
-		if (sibling->va_start == va->va_end)
+		if (n->LEAF_VA_START[sibling_pos] == va->va_end)
 			SET_BIT(*ms, MERGE_WITH_RIGHT);
 	}
 }
@@ -179,10 +272,9 @@ do_merge_va(struct bpt_root *root, struct bpn *n,
 	 *    N1 |----|  N2
 	 */
 	if (TEST_BIT(ms, MERGE_WITH_LEFT) && TEST_BIT(ms, MERGE_WITH_RIGHT)) {
-		left = bpn_get_val(n, pos - 1);
 		right = bpn_get_val(n, pos);
 
-		left->va_end = right->va_end;
+		bpn_set_va_end(root, n, pos - 1, right->va_end);
 		fixup_metadata(n);
 		*out = right;
 	} else {
@@ -195,7 +287,8 @@ do_merge_va(struct bpt_root *root, struct bpn *n,
 				*out = left;
 				return true;
 			} else {
-				left->va_end = va->va_end;
+				bpn_set_va_end(root, n, pos - 1, va->va_end);
+				leaf_fixup_upper_bound(root, n, left->va_end);
 				fixup_metadata(n);
 			}
 		} else if (TEST_BIT(ms, MERGE_WITH_RIGHT)) {
@@ -210,7 +303,7 @@ do_merge_va(struct bpt_root *root, struct bpn *n,
 				*out = right;
 				return true;
 			} else {
-				right->va_start = va->va_start;
+				bpn_set_va_start(root, n, pos, va->va_start);
 				fixup_metadata(n);
 			}
 		} else {
@@ -241,7 +334,8 @@ do_merge_va(struct bpt_root *root, struct bpn *n,
 						continue;
 
 					/* Merge and break. */
-					left->va_end = va->va_end;
+					bpn_set_va_end(root, ll, ll->entries - 1,
+						va->va_end);
 					p->slot[pos] = right->va_start;
 					fixup_subavail(ll, left->va_start);
 					break;
@@ -253,15 +347,17 @@ do_merge_va(struct bpt_root *root, struct bpn *n,
 				for (p = n->info.parent; p; p = p->info.parent) {
 					pos = p->info.ppos;
 
+					/*
+					 * Find a common parent. A split key is not
+					 * compared with right->va_start, it can be
+					 * less than that if the first VA of the right
+					 * leaf has been clipped or removed.
+					 */
 					if (p->info.ppos == p->entries)
-						pos = p->info.ppos - 1;
-
-					/* Find a common parent. */
-					if (p->slot[pos] < right->va_start)
 						continue;
 
 					/* Merge and break. */
-					right->va_start = va->va_start;
+					bpn_set_va_start(root, rl, 0, va->va_start);
 					p->slot[pos] = right->va_start;
 					fixup_subavail(rl, right->va_start);
 					break;
@@ -270,7 +366,7 @@ do_merge_va(struct bpt_root *root, struct bpn *n,
 		}
 	}
 
-	free(va);
+	vmap_area_free(va);
 	return false;
 }
 
@@ -278,7 +374,6 @@ bool try_merge_va(struct bpt_root *root, struct bpn *n,
 		struct vmap_area *va, int pos)
 {
 	struct vmap_area *out;
-	pos_cc_t pos_cc;
 	merge_state ms;
 	bool repeat;
 	int rv;
@@ -290,32 +385,18 @@ bool try_merge_va(struct bpt_root *root, struct bpn *n,
 
 	ms = get_va_merge_state(root, n, va, pos);
 	if (ms) {
+		vm_stat_inc(VM_STAT_VA_MERGES);
 		repeat = do_merge_va(root, n, va, pos, ms, &out);
 
 		if (out) {
 			out = bpt_po_delete(root, out->va_start);
 			BUG_ON(!out);
-			free(out);
+			vmap_area_free(out);
 		}
 
 		/* We need to find a node again after bpt_po_delete(). */
 		if (repeat) {
-			n = root->node;
-
-			while (is_bpn_internal(n)) {
-				pos_cc = bpn_bin_search(n, va->va_start, &pos);
-
-				if (pos_cc == POS_CC_EQ) {
-					/* Follow right. */
-					n->info.ppos = pos + 1;
-					n = n->SUB_LINKS[pos + 1];
-				} else {
-					/* Follow left. */
-					n->info.ppos = pos;
-					n = n->SUB_LINKS[pos];
-				}
-			}
-
+			n = bpt_lookup_leaf(root, va->va_start);
 			(void) bpn_bin_search(n, va->va_start, &pos);
 			ms = get_va_merge_state(root, n, va, pos);
 			repeat = do_merge_va(root, n, va, pos, ms, &out);
@@ -340,21 +421,20 @@ struct bpn *
 bpt_lookup_lowest_leaf(struct bpt_root *root,
 		ulong length, ulong vstart)
 {
+	u32 pages = va_avail_pages(length);
 	struct bpn *n = root->node;
 	int i;
 
+	vm_stat_inc(VM_STAT_DESCENTS);
+
 	/* Find a leaf. */
 	while (is_bpn_internal(n)) {
-		for (i = 0; i < n->entries; i++) {
-			if (vstart < n->slot[i] && n->SUB_AVAIL[i] >= length)
-				break;
-		}
-
+		i = bpn_search->first_fit(n, pages, vstart);
 		n->info.ppos = i;
 #if 0
-		ulong max_avail = bpn_max_avail(n->SUB_LINKS[i]);
+		u32 max_avail = bpn_max_avail_pages(n->SUB_LINKS[i]);
 		if (max_avail != n->SUB_AVAIL[i]) {
-			printf("!!!!! TREE IS CORRUPTED !!!!! %lu != %lu\n",
+			printf("!!!!! TREE IS CORRUPTED !!!!! %u != %u\n",
 				max_avail, n->SUB_AVAIL[i]);
 			/* dump_tree(r); */
 			/* exit(-1); */
@@ -369,40 +449,42 @@ bpt_lookup_lowest_leaf(struct bpt_root *root,
 static inline struct vmap_area *
 leaf_get_va_cond(struct bpn *n, ulong size, ulong align, ulong vstart)
 {
-	struct vmap_area *va;
 	int i;
 
 	if (likely(is_bpn_external(n))) {
 		for (i = 0; i < n->entries; i++) {
-			va = bpn_get_val(n, i);
+			if (bpn_va_size(n, i) < size)
+				continue;
 
-			if (is_within_this_va(va, size, align, vstart))
-				return va;
+			if (is_within_this_range(n->LEAF_VA_START[i],
+					n->LEAF_VA_END[i], size, align, vstart))
+				return bpn_get_val(n, i);
 		}
 	}
 
 	return NULL;
 }
 
-static struct vmap_area *
+/*
+ * A reference for lookup_smallest_va(), every free area is checked
+ * in address order. It is used by debug checks and fuzz.c.
+ */
+struct vmap_area *
 lin_lookup_smallest_va(struct bpt_root *root, ulong size,
 		ulong align, ulong vstart, struct bpn **out)
 {
 	struct vmap_area *va;
 	struct list_head *pos;
 	struct bpn *n;
-	ulong length;
 	int i;
 
-	length = (align > PAGE_SIZE) ? size + align - 1:size;
-
 	/* Now start verification. */
 	list_for_each(pos, &root->head) {
 		n = list_entry(pos, struct bpn, page.external.list);
 
 		for (i = 0; i < n->entries; i++) {
 			va = bpn_get_val(n, i);
-			if (va_size(va) < length)
+			if (va_size(va) < size)
 				continue;
 
 			/* Lowest possible VA. */
@@ -420,11 +502,12 @@ lin_lookup_smallest_va(struct bpt_root *root, ulong size,
 static __always_inline bool
 first_next_sub_avail(struct bpn *n, ulong length, ulong *vstart)
 {
+	u32 pages = va_avail_pages(length);
 	int i;
 
 	while ((n = n->info.parent)) {
 		for (i = n->info.ppos + 1; i < n->entries + 1; i++) {
-			if (n->SUB_AVAIL[i] >= length) {
+			if (n->SUB_AVAIL[i] >= pages) {
 				/* Update "vstart" to a new sub-tree start address. */
 				*vstart = n->slot[i - 1];
 				return true;
@@ -436,25 +519,62 @@ first_next_sub_avail(struct bpn *n, ulong length, ulong *vstart)
 	return false;
 }
 
+/* Where a first fit places an area within "va". */
+static __always_inline ulong
+fit_va_start(struct vmap_area *va, ulong align, ulong vstart)
+{
+	if (va->va_start > vstart)
+		return ALIGN(va->va_start, align);
+
+	return ALIGN(vstart, align);
+}
+
+/*
+ * Number of sub-trees an aligned lookup checks exactly before it
+ * takes the first one which fits for sure.
+ */
+enum {
+	VMAP_EXACT_RETRIES = 4,
+};
+
+/*
+ * A descent only knows a size of the biggest block of a sub-tree,
+ * so "size" is a lower bound and a leaf checks how much is really
+ * left after an alignment. If nothing, the next sub-tree that may
+ * fit is tried. An aligned request does not skip blocks which are
+ * smaller than "size + align - 1" but still can hold it, a page
+ * aligned one needs one retry at most.
+ *
+ * Lots of blocks can be too small once aligned, so after a few
+ * retries "size + align - 1" is looked for, such a block fits for
+ * sure. Only if there is none, or it is placed above "vend", the
+ * rest is checked one by one, so a request never fails if there is
+ * a place for it.
+ */
 struct vmap_area *
 lookup_smallest_va(struct bpt_root *root, ulong size,
-	ulong align, ulong vstart, struct bpn **out)
+	ulong align, ulong vstart, ulong vend, struct bpn **out)
 {
+	ulong length = size, saved_vstart = vstart;
 	struct bpn *n = root->node;
 	struct vmap_area *va;
 	bool is_sub_avail;
-	ulong length;
-	int i;
-
-	length = (align > PAGE_SIZE) ? size + align - 1:size;
+	int retries = 0;
 
-	/* We can repeat only once! */
-	for (i = 0; i < 2; i++) {
+	while (1) {
 		/* Find a leaf. */
 		n = bpt_lookup_lowest_leaf(root, length, vstart);
 
 		/* Check, if there is an appropriate VA. */
 		va = leaf_get_va_cond(n, size, align, vstart);
+		if (va && length != size &&
+				fit_va_start(va, align, vstart) + size > vend) {
+			/* Lower blocks skipped by "length" can still fit. */
+			length = size;
+			vstart = saved_vstart;
+			continue;
+		}
+
 		if (va) {
 			*out = n;
 			return va;
@@ -463,16 +583,295 @@ lookup_smallest_va(struct bpt_root *root, ulong size,
 		/*
 		 * No. Reasons:
 		 * - "vstart" restriction;
-		 * - no VA available for a given length.
+		 * - an alignment;
+		 * - no VA available for a given size.
 		 */
 		is_sub_avail = first_next_sub_avail(n, length, &vstart);
-		if (unlikely(!is_sub_avail))
-			break;
+		if (unlikely(!is_sub_avail)) {
+			if (length == size)
+				break;
+
+			/* Nothing fits for sure, back to where it was. */
+			length = size;
+			vstart = saved_vstart;
+			continue;
+		}
+
+		vm_stat_inc(VM_STAT_RETRIES);
+
+		if (align > PAGE_SIZE && ++retries == VMAP_EXACT_RETRIES) {
+			length = size + align - 1;
+			saved_vstart = vstart;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * A mirror of bpt_lookup_lowest_leaf(). It returns the most right
+ * leaf which may have a VA that starts below "vend" and is equal or
+ * greater of given "length". Otherwise the most left one.
+ */
+struct bpn *
+bpt_lookup_highest_leaf(struct bpt_root *root,
+		ulong length, ulong vend)
+{
+	u32 pages = va_avail_pages(length);
+	struct bpn *n = root->node;
+	int i;
+
+	vm_stat_inc(VM_STAT_DESCENTS);
+
+	while (is_bpn_internal(n)) {
+		for (i = n->entries; i > 0; i--)
+			if (n->slot[i - 1] < vend && n->SUB_AVAIL[i] >= pages)
+				break;
+
+		n->info.ppos = i;
+		n = n->SUB_LINKS[i];
+	}
+
+	return n;
+}
+
+/*
+ * Free blocks of a sub-tree "i" end at or below slot[i], so once it
+ * is below "vstart" + "size" neither it nor anything on the left can
+ * take an area and the ascent stops.
+ */
+static __always_inline bool
+last_prev_sub_avail(struct bpn *n, ulong length, ulong size,
+	ulong vstart, ulong *vend)
+{
+	u32 pages = va_avail_pages(length);
+	int i;
+
+	while ((n = n->info.parent)) {
+		for (i = n->info.ppos - 1; i >= 0; i--) {
+			if (n->slot[i] <= vstart || n->slot[i] - vstart < size)
+				return false;
+
+			if (n->SUB_AVAIL[i] >= pages) {
+				/*
+				 * Update "vend" to a sub-tree end address, free
+				 * blocks do not cross it.
+				 */
+				*vend = n->slot[i];
+				return true;
+			}
+		}
+	}
+
+	/* No any space avail. */
+	return false;
+}
+
+/*
+ * Top-down version of lookup_smallest_va(), it finds a VA where an
+ * area can be placed at the highest address below "vend".
+ */
+struct vmap_area *
+lookup_highest_va(struct bpt_root *root, ulong size, ulong align,
+	ulong vstart, ulong vend, struct bpn **out)
+{
+	ulong length = size, limit = vend, saved_limit = vend;
+	struct bpn *n;
+	int j, retries = 0;
+
+	/* See lookup_smallest_va() for how an alignment is dealt with. */
+	while (1) {
+		n = bpt_lookup_highest_leaf(root, length, limit);
+
+		for (j = n->entries - 1; j >= 0; j--) {
+			if (bpn_va_size(n, j) < size)
+				continue;
+
+			if (top_down_addr(n->LEAF_VA_START[j], n->LEAF_VA_END[j],
+					size, align, vstart, limit)) {
+				*out = n;
+				return bpn_get_val(n, j);
+			}
+		}
+
+		if (!last_prev_sub_avail(n, length, size, vstart, &limit)) {
+			if (length == size)
+				break;
+
+			length = size;
+			limit = saved_limit;
+			continue;
+		}
+
+		vm_stat_inc(VM_STAT_RETRIES);
+
+		if (align > PAGE_SIZE && ++retries == VMAP_EXACT_RETRIES) {
+			length = size + align - 1;
+			saved_limit = limit;
+		}
 	}
 
 	return NULL;
 }
 
+/*
+ * Descends to the leftmost leaf which has a free block of a "class"
+ * and at least "length" bytes in it.
+ */
+static struct bpn *
+bpt_lookup_class_leaf(struct bpt_root *root, int class, ulong length)
+{
+	u32 pages = va_avail_pages(length);
+	struct bpn *n = root->node;
+	u32 bit = 1U << class;
+	int i;
+
+	vm_stat_inc(VM_STAT_DESCENTS);
+
+	while (is_bpn_internal(n)) {
+		for (i = 0; i < n->entries + 1; i++)
+			if ((n->SUB_CLASS[i] & bit) && n->SUB_AVAIL[i] >= pages)
+				break;
+
+		if (i == n->entries + 1)
+			return NULL;
+
+		n->info.ppos = i;
+		n = n->SUB_LINKS[i];
+	}
+
+	return n;
+}
+
+static struct vmap_area *
+leaf_get_class_va(struct bpn *n, int class, ulong size,
+	ulong length, ulong align, ulong vstart, ulong vend)
+{
+	struct vmap_area *va = NULL;
+	int i;
+
+	for (i = 0; i < n->entries; i++) {
+		if (va_size_class(bpn_va_size(n, i)) != class ||
+				bpn_va_size(n, i) < length)
+			continue;
+
+		if (va && bpn_va_size(n, i) >= va_size(va))
+			continue;
+
+		if (!is_within_this_range(n->LEAF_VA_START[i],
+				n->LEAF_VA_END[i], size, align, vstart))
+			continue;
+
+		if (fit_va_start(bpn_get_val(n, i), align, vstart) + size <= vend)
+			va = bpn_get_val(n, i);
+	}
+
+	return va;
+}
+
+/*
+ * A good fit, not an exact best one. SUB_CLASS says which power of
+ * two classes are in a sub-tree, so a block of the smallest class
+ * that can hold "length" is found by one descent. The leaf gives
+ * the smallest block of that class. A block of the same class as
+ * "length" can still be too small, if so a next class is used. If
+ * "vstart", "vend" or an alignment does not let a picked block be
+ * used, it falls back to a first fit.
+ */
+struct vmap_area *
+lookup_best_va(struct bpt_root *root, ulong size,
+	ulong align, ulong vstart, ulong vend, struct bpn **out)
+{
+	struct vmap_area *va;
+	struct bpn *n;
+	ulong length;
+	int class;
+	u32 mask;
+
+	length = (align > PAGE_SIZE) ? size + align - 1:size;
+	mask = bpn_class_mask(root->node);
+
+	for (class = va_size_class(length); class < VA_NR_CLASSES; class++) {
+		if (!(mask & (1U << class)))
+			continue;
+
+		n = bpt_lookup_class_leaf(root, class, length);
+		if (!n)
+			continue;
+
+		va = leaf_get_class_va(n, class, size, length, align,
+			vstart, vend);
+		if (va) {
+			*out = n;
+			return va;
+		}
+
+		/* It is a range or an alignment, let a first fit do it. */
+		if (class > va_size_class(length))
+			break;
+	}
+
+	return lookup_smallest_va(root, size, align, vstart, vend, out);
+}
+
+/*
+ * "lo" is a lower bound of a search, it is raised to the cursor if
+ * a next fit has found an area above it. An area has to be placed
+ * at or above "lo", so a caller passes it on to fit_va_addr().
+ */
+static __always_inline struct vmap_area *
+lookup_fit_va(struct bpt_root *root, ulong size,
+	ulong align, ulong *lo, ulong vend, struct bpn **out)
+{
+	struct vmap_area *va;
+
+	if (root->fit.policy == VMAP_TOP_DOWN)
+		return lookup_highest_va(root, size, align, *lo, vend, out);
+
+	if (root->fit.policy == VMAP_BEST_FIT)
+		return lookup_best_va(root, size, align, *lo, vend, out);
+
+	if (root->fit.policy == VMAP_NEXT_FIT && root->fit.cursor > *lo &&
+			root->fit.cursor < vend) {
+		va = lookup_smallest_va(root, size, align,
+			root->fit.cursor, vend, out);
+		if (va && fit_va_start(va, align, root->fit.cursor) +
+				size <= vend) {
+			*lo = root->fit.cursor;
+			return va;
+		}
+
+		/* Wrap around. */
+	}
+
+	return lookup_smallest_va(root, size, align, *lo, vend, out);
+}
+
+/*
+ * Where in a found "va" an area is placed. A top-down one has been
+ * checked against "vend" by a lookup.
+ */
+static __always_inline ulong
+fit_va_addr(struct bpt_root *root, struct vmap_area *va,
+	ulong size, ulong align, ulong vstart, ulong vend)
+{
+	if (root->fit.policy == VMAP_TOP_DOWN)
+		return top_down_addr(va->va_start, va->va_end,
+			size, align, vstart, vend);
+
+	return fit_va_start(va, align, vstart);
+}
+
+/*
+ * A policy can be changed at any time. Only a first fit goes the
+ * OLC fast path, see alloc_vmap_area_olc().
+ */
+void vm_set_fit_policy(struct bpt_root *root, enum vmap_fit_policy policy)
+{
+	root->fit.policy = policy;
+	root->fit.cursor = 0;
+}
+
 enum fit_type {
 	NOTHING_FIT = 0,
 	FL_FIT_TYPE = 1,	/* full fit */
@@ -513,6 +912,10 @@ va_clip(struct bpt_root *root, struct vmap_area *va,
 {
 	enum fit_type type = classify_va_fit_type(va, nva_start_addr, size);
 	struct vmap_area *lva = NULL;
+	int pos;
+
+	/* Position of the VA, the leaf keeps a copy of its range. */
+	(void) bpn_bin_search(node, va->va_start, &pos);
 
 	if (type == FL_FIT_TYPE) {
 		/*
@@ -524,7 +927,7 @@ va_clip(struct bpt_root *root, struct vmap_area *va,
 		 */
 		va = bpt_po_delete(root, va->va_start);
 		BUG_ON(va == NULL);
-		free(va);
+		vmap_area_free(va);
 	} else if (type == LE_FIT_TYPE) {
 		/*
 		 * Split left edge of fit VA.
@@ -533,7 +936,7 @@ va_clip(struct bpt_root *root, struct vmap_area *va,
 		 * V  NVA  V   R
 		 * |-------|-------|
 		 */
-		va->va_start += size;
+		bpn_set_va_start(root, node, pos, va->va_start + size);
 	} else if (type == RE_FIT_TYPE) {
 		/*
 		 * Split right edge of fit VA.
@@ -542,7 +945,7 @@ va_clip(struct bpt_root *root, struct vmap_area *va,
 		 *     L   V  NVA  V
 		 * |-------|-------|
 		 */
-		va->va_end = nva_start_addr;
+		bpn_set_va_end(root, node, pos, nva_start_addr);
 	} else if (type == NE_FIT_TYPE) {
 		/*
 		 * Split no edge of fit VA.
@@ -551,7 +954,7 @@ va_clip(struct bpt_root *root, struct vmap_area *va,
 		 *   L V  NVA  V R
 		 * |---|-------|---|
 		 */
-		lva = malloc(sizeof(*lva));
+		lva = vmap_area_alloc();
 
 		/*
 		 * Build the remainder.
@@ -562,7 +965,7 @@ va_clip(struct bpt_root *root, struct vmap_area *va,
 		/*
 		 * Shrink this VA to remaining size.
 		 */
-		va->va_start = nva_start_addr + size;
+		bpn_set_va_start(root, node, pos, nva_start_addr + size);
 	} else {
 		return -1;
 	}
@@ -577,7 +980,7 @@ va_clip(struct bpt_root *root, struct vmap_area *va,
 	return 0;
 }
 
-static ulong
+ulong
 va_alloc(struct bpt_root *root, ulong size,
 		ulong align, ulong vstart, ulong vend)
 {
@@ -587,25 +990,23 @@ va_alloc(struct bpt_root *root, ulong size,
 	int ret;
 
 	/* va = lin_lookup_smallest_va(root, size, align, vstart, &node); */
-	va = lookup_smallest_va(root, size, align, vstart, &node);
+	va = lookup_fit_va(root, size, align, &vstart, vend, &node);
 	if (!va)
 		return vend;
 #if DEBUG
-	if (align <= PAGE_SIZE) {
+	/* An aligned one is not always the lowest, see lookup_smallest_va(). */
+	if (align <= PAGE_SIZE && root->fit.policy == VMAP_FIRST_FIT) {
 		tmp = lin_lookup_smallest_va(root, size, align, vstart, NULL);
 		if (va != tmp) {
 			printf("-> Not the same: %lu-%lu, %lu-%lu, size: %lu, "
 				"align: %lu, vstart: %lu\n",
 				va->va_start, va->va_end,
-				tmp->va_start, tmp->va_end,
+				tmp ? tmp->va_start:0, tmp ? tmp->va_end:0,
 				size, align, vstart);
 		}
 	}
 #endif
-	if (va->va_start > vstart)
-		nva_start_addr = ALIGN(va->va_start, align);
-	else
-		nva_start_addr = ALIGN(vstart, align);
+	nva_start_addr = fit_va_addr(root, va, size, align, vstart, vend);
 
 	/* Check the "vend" restriction. */
 	if (nva_start_addr + size > vend)
@@ -616,6 +1017,7 @@ va_alloc(struct bpt_root *root, ulong size,
 	if (ret)
 		return vend;
 
+	root->fit.cursor = nva_start_addr + size;
 	return nva_start_addr;
 }
 
@@ -628,7 +1030,7 @@ int vm_init_free_space(struct bpt_root *root, ulong vstart, ulong vend)
 	if (rv < 0)
 		assert(0);
 
-	va = malloc(sizeof(*va));
+	va = vmap_area_alloc();
 	if (!va)
 		assert(0);
 
@@ -637,32 +1039,583 @@ int vm_init_free_space(struct bpt_root *root, ulong vstart, ulong vend)
 	return bpt_po_insert(root, va);
 }
 
+/*
+ * Restores a free space from "nr" VAs sorted by va_start, e.g. a saved
+ * free map. The tree is built bottom-up, see bpt_bulk_load(). VAs are
+ * owned by the tree if it succeeds.
+ */
+int vm_load_free_space(struct bpt_root *root, struct vmap_area **va,
+	ulong nr)
+{
+	int rv;
+
+	rv = bpt_root_init(root);
+	if (rv < 0)
+		assert(0);
+
+	return bpt_bulk_load(root, va, nr);
+}
+
 struct vmap_area *
 alloc_vmap_area(struct bpt_root *root, ulong size,
 		ulong align, ulong vstart, ulong vend)
 {
+	ulong start = vm_stat_time();
 	struct vmap_area *va;
 	ulong addr;
 
-	va = malloc(sizeof(*va));
+	va = vmap_area_alloc();
 	if (unlikely(!va))
 		return NULL;
 
 	addr = va_alloc(root, size, align, vstart, vend);
+	if (addr == vend && root->lazy.nr) {
+		/* Lazily freed areas can make it fit. */
+		purge_vmap_area_lazy(root);
+		addr = va_alloc(root, size, align, vstart, vend);
+	}
+
 	if (addr == vend) {
-		free(va);
+		vmap_area_free(va);
+		vm_stat_latency(VM_STAT_ALLOC, start);
+		vm_trace_alloc(0, size, align, vstart, vend);
 		return NULL;
 	}
 
 	va->va_start = addr;
 	va->va_end = addr + size;
+
+	if (root->busy && bpt_po_insert(root->busy, va))
+		BUG();
+
+	vm_stat_latency(VM_STAT_ALLOC, start);
+	vm_trace_alloc(addr, size, align, vstart, vend);
 	return va;
 }
 
+/*
+ * Carves areas i, i + 1, ... one after another from the left edge
+ * of a free VA at "pos" of a leaf "n". The VA itself is never used
+ * up, a full fit is left to va_clip(). Returns how many have been
+ * carved, the leaf metadata is not updated.
+ */
+static int
+carve_left_edge(struct bpt_root *root, struct bpn *n, int pos, int i,
+	int nr, ulong *sizes, ulong align, ulong vstart, ulong vend,
+	struct vmap_area **out)
+{
+	ulong addr = n->LEAF_VA_START[pos];
+	ulong va_end = n->LEAF_VA_END[pos];
+	int j;
+
+	for (j = i; j < nr; j++) {
+		/* No holes, otherwise they are lost. */
+		if (ALIGN(addr, align) != addr || addr < vstart)
+			break;
+
+		if (addr + sizes[j] >= va_end || addr + sizes[j] > vend)
+			break;
+
+		out[j]->va_start = addr;
+		out[j]->va_end = addr + sizes[j];
+		addr += sizes[j];
+	}
+
+	if (j > i)
+		bpn_set_va_start(root, n, pos, addr);
+
+	return j - i;
+}
+
+/*
+ * Allocates "nr" areas at once, it is all or nothing. Consecutive
+ * areas are carved from the same free block while they fit, so one
+ * lookup and one metadata update are done per a block instead of
+ * per an area. A caller takes its lock once for the whole batch.
+ */
+int alloc_vmap_areas(struct bpt_root *root, int nr, ulong *sizes,
+		ulong align, ulong vstart, ulong vend, struct vmap_area **out)
+{
+	struct vmap_area *va;
+	bool purged = false;
+	ulong addr, lo;
+	struct bpn *n;
+	int i, pos, carved;
+
+	for (i = 0; i < nr; i++) {
+		out[i] = vmap_area_alloc();
+		if (unlikely(!out[i]))
+			goto free_out;
+	}
+
+	for (i = 0; i < nr; i += carved) {
+		lo = vstart;
+		va = lookup_fit_va(root, sizes[i], align, &lo, vend, &n);
+		if (!va) {
+			/* Lazily freed areas can make it fit. */
+			if (root->lazy.nr && !purged) {
+				purge_vmap_area_lazy(root);
+				purged = true;
+				carved = 0;
+				continue;
+			}
+
+			goto rollback;
+		}
+
+		/* Areas are carved from a left edge only. */
+		if (root->fit.policy != VMAP_TOP_DOWN) {
+			(void) bpn_bin_search(n, va->va_start, &pos);
+			carved = carve_left_edge(root, n, pos, i, nr, sizes,
+				align, lo, vend, out);
+		} else {
+			carved = 0;
+		}
+
+		if (carved) {
+			fixup_metadata(n);
+			root->fit.cursor = out[i + carved - 1]->va_end;
+			continue;
+		}
+
+		/* Not from the left edge, or it fits fully. */
+		addr = fit_va_addr(root, va, sizes[i], align, lo, vend);
+
+		if (addr + sizes[i] > vend ||
+				va_clip(root, va, addr, sizes[i], n))
+			goto rollback;
+
+		out[i]->va_start = addr;
+		out[i]->va_end = addr + sizes[i];
+		root->fit.cursor = out[i]->va_end;
+		carved = 1;
+	}
+
+	if (root->busy)
+		for (i = 0; i < nr; i++)
+			if (bpt_po_insert(root->busy, out[i]))
+				BUG();
+
+	for (i = 0; i < nr; i++)
+		vm_trace_alloc(out[i]->va_start, sizes[i], align, vstart, vend);
+
+	return 0;
+
+rollback:
+	/* Everything below "i" is allocated. */
+	while (i--) {
+		(void) bpt_po_insert(root, out[i]);
+		out[i] = NULL;
+	}
+
+	i = nr;
+
+free_out:
+	while (i--) {
+		if (out[i])
+			vmap_area_free(out[i]);
+		out[i] = NULL;
+	}
+
+	return -1;
+}
+
+/*
+ * Removes an area from the busy index. It has to be exactly the
+ * one which has been handed out.
+ */
+int unlink_busy_va(struct bpt_root *root, struct vmap_area *va)
+{
+	struct vmap_area *busy;
+
+	busy = bpt_po_delete(root->busy, va->va_start);
+	if (unlikely(busy != va)) {
+		/* Not ours, put it back. */
+		if (busy && bpt_po_insert(root->busy, busy))
+			BUG();
+
+		return -1;
+	}
+
+	return 0;
+}
+
 int free_vmap_area(struct bpt_root *root, struct vmap_area *va)
 {
+	ulong start = vm_stat_time();
+	int rv;
+
 	if (unlikely(!va))
 		return -1;
 
+	if (root->busy && unlink_busy_va(root, va))
+		return -1;
+
+	/* It can be merged and released by an insert. */
+	vm_trace_free(va->va_start, va_size(va));
+	rv = bpt_po_insert(root, va);
+	vm_stat_latency(VM_STAT_FREE, start);
+
+	return rv;
+}
+
+/*
+ * A new end of a busy area. It is changed over the busy index if
+ * there is one, the leaf keeps a copy of its range.
+ */
+static void
+busy_set_va_end(struct bpt_root *root, struct vmap_area *va, ulong va_end)
+{
+	struct bpn *n;
+	int pos;
+
+	if (!root->busy) {
+		va->va_end = va_end;
+		return;
+	}
+
+	n = bpt_lookup_leaf(root->busy, va->va_start);
+	if (bpn_bin_search(n, va->va_start, &pos) != POS_CC_EQ ||
+			bpn_get_val(n, pos) != va)
+		BUG();
+
+	bpn_set_va_end(root->busy, n, pos, va_end);
+	fixup_metadata(n);
+}
+
+/*
+ * Clips [addr, end) from the left edge of a free block which starts
+ * right at "addr". Returns -1 if there is no such block or it ends
+ * before "end".
+ */
+static int
+va_clip_right_of(struct bpt_root *root, ulong addr, ulong end)
+{
+	struct vmap_area *va;
+	struct bpn *n;
+	int pos;
+
+	n = bpt_lookup_leaf(root, addr);
+	if (bpn_bin_search(n, addr, &pos) != POS_CC_EQ)
+		return -1;
+
+	va = bpn_get_val(n, pos);
+	if (va->va_end < end)
+		return -1;
+
+	return va_clip(root, va, addr, end - addr, n);
+}
+
+/*
+ * Grows a busy area in place to "size", it takes the free block which
+ * is right after its end. It is one lookup, no copy of a content and
+ * no new area, unlike alloc + free. Fails if that block is busy, too
+ * small or the new end is above "vend". Resizes are not traced.
+ */
+int extend_vmap_area(struct bpt_root *root, struct vmap_area *va,
+		ulong size, ulong vend)
+{
+	ulong start = vm_stat_time();
+	ulong end = va->va_start + size;
+	int rv;
+
+	if (unlikely(size < va_size(va) || end > vend))
+		return -1;
+
+	if (size == va_size(va))
+		return 0;
+
+	rv = va_clip_right_of(root, va->va_end, end);
+	if (rv && root->lazy.nr) {
+		/* A lazily freed neighbour can make it fit. */
+		purge_vmap_area_lazy(root);
+		rv = va_clip_right_of(root, va->va_end, end);
+	}
+
+	if (!rv)
+		busy_set_va_end(root, va, end);
+
+	vm_stat_latency(VM_STAT_ALLOC, start);
+	return rv;
+}
+
+/*
+ * Shrinks a busy area in place to "size", the tail is given back and
+ * is merged with a free block after it, if any.
+ */
+int shrink_vmap_area(struct bpt_root *root, struct vmap_area *va,
+		ulong size)
+{
+	ulong start = vm_stat_time();
+	struct vmap_area *tail;
+	int rv;
+
+	if (unlikely(!size || size > va_size(va)))
+		return -1;
+
+	if (size == va_size(va))
+		return 0;
+
+	tail = vmap_area_alloc();
+	if (unlikely(!tail))
+		return -1;
+
+	tail->va_start = va->va_start + size;
+	tail->va_end = va->va_end;
+
+	busy_set_va_end(root, va, tail->va_start);
+	rv = bpt_po_insert(root, tail);
+	vm_stat_latency(VM_STAT_FREE, start);
+
+	return rv;
+}
+
+/*
+ * Keeps allocated areas in a second tree keyed by va_start, where
+ * merging is disabled. Both trees share the node cache.
+ */
+int vm_init_busy_index(struct bpt_root *root)
+{
+	struct bpt_root *busy;
+
+	busy = malloc(sizeof(*busy));
+	if (unlikely(!busy))
+		return -1;
+
+	if (bpt_root_init(busy)) {
+		free(busy);
+		return -1;
+	}
+
+	busy->flags |= BPT_NO_MERGE;
+	root->busy = busy;
+	return 0;
+}
+
+/*
+ * Walks all leafs, it is O(number of leafs). A caller keeps the tree
+ * from being changed meanwhile.
+ */
+void vm_frag_scan(struct bpt_root *root, struct vm_frag *f)
+{
+	struct list_head *pos;
+	struct bpn *n;
+	ulong size;
+	int i;
+
+	memset(f, 0, sizeof(*f));
+
+	list_for_each(pos, &root->head) {
+		n = list_entry(pos, struct bpn, page.external.list);
+
+		for (i = 0; i < n->entries; i++) {
+			size = bpn_va_size(n, i);
+
+			f->nr_free++;
+			f->free_bytes += size;
+			f->nr_class[va_size_class(size)]++;
+			if (size > f->largest)
+				f->largest = size;
+		}
+	}
+}
+
+/*
+ * From now on counters are updated on every change of a free block,
+ * so vm_frag_sample() is cheap. They start from a scan, the tree is
+ * not changed meanwhile.
+ */
+int vm_init_frag_stat(struct bpt_root *root)
+{
+	struct vm_frag *f;
+
+	if (root->frag)
+		return 0;
+
+	f = malloc(sizeof(*f));
+	if (unlikely(!f))
+		return -1;
+
+	vm_frag_scan(root, f);
+	root->frag = f;
+	return 0;
+}
+
+/*
+ * Reads kept counters, the biggest block is taken from the root node.
+ * Under concurrent changes they are not read as one snapshot. Returns
+ * -1 if they are not kept.
+ */
+int vm_frag_sample(struct bpt_root *root, struct vm_frag *f)
+{
+	int i;
+
+	if (!root->frag)
+		return -1;
+
+	f->nr_free = __atomic_load_n(&root->frag->nr_free, __ATOMIC_RELAXED);
+	f->free_bytes = __atomic_load_n(&root->frag->free_bytes,
+		__ATOMIC_RELAXED);
+
+	for (i = 0; i < VA_NR_CLASSES; i++)
+		f->nr_class[i] = __atomic_load_n(&root->frag->nr_class[i],
+			__ATOMIC_RELAXED);
+
+	f->largest = bpn_max_avail(root->node);
+	return 0;
+}
+
+/*
+ * External fragmentation, 1 - largest / free. It is 0 when free space
+ * is one block and goes to 1 when the biggest block is a small part
+ * of it, i.e. a big request fails while there is enough free space.
+ */
+double vm_frag_index(struct vm_frag *f)
+{
+	if (!f->free_bytes)
+		return 0.0;
+
+	return 1.0 - (double) f->largest / f->free_bytes;
+}
+
+/* Returns a busy area which "addr" belongs to, or NULL. */
+struct vmap_area *
+find_vmap_area(struct bpt_root *root, ulong addr)
+{
+	struct bpn *n;
+	int pos;
+
+	if (unlikely(!root->busy))
+		return NULL;
+
+	n = bpt_lookup_leaf(root->busy, addr);
+	if (bpn_bin_search(n, addr, &pos) == POS_CC_EQ)
+		return bpn_get_val(n, pos);
+
+	/* A closest one on the left. */
+	if (!pos) {
+		n = leaf_prev_or_null(root->busy, n);
+		if (!n)
+			return NULL;
+
+		pos = n->entries;
+	}
+
+	if (n->entries && addr < n->LEAF_VA_END[pos - 1])
+		return bpn_get_val(n, pos - 1);
+
+	return NULL;
+}
+
+static int
+va_start_order(const void *a, const void *b)
+{
+	const struct vmap_area *l = *(const struct vmap_area **) a;
+	const struct vmap_area *r = *(const struct vmap_area **) b;
+
+	if (l->va_start < r->va_start)
+		return -1;
+
+	return l->va_start > r->va_start;
+}
+
+/*
+ * Sorts freed areas by va_start and coalesces adjacent ones, so
+ * a tree sees fewer and bigger areas which can be placed by one
+ * pass from left to right, see bpt_bulk_insert(). It does not
+ * touch a tree, so it can be done out of a lock. Returns a new
+ * number of areas.
+ */
+ulong coalesce_vmap_areas(struct vmap_area **va, ulong nr)
+{
+	ulong i, j = 0;
+
+	if (!nr)
+		return 0;
+
+	qsort(va, nr, sizeof(*va), va_start_order);
+
+	for (i = 1; i < nr; i++) {
+		if (va[j]->va_end == va[i]->va_start) {
+			va[j]->va_end = va[i]->va_end;
+			vmap_area_free(va[i]);
+		} else {
+			va[++j] = va[i];
+		}
+	}
+
+	return j + 1;
+}
+
+/*
+ * Merges all lazily freed areas into the tree.
+ */
+void purge_vmap_area_lazy(struct bpt_root *root)
+{
+	ulong nr;
+
+	if (!root->lazy.nr)
+		return;
+
+	nr = coalesce_vmap_areas(root->lazy.va, root->lazy.nr);
+	bpt_bulk_insert(root, root->lazy.va, nr);
+	root->lazy.nr = 0;
+}
+
+/* A caller has unlinked "va" from the busy index. */
+static int
+va_queue_lazy(struct bpt_root *root, struct vmap_area *va)
+{
+	vm_trace_free(va->va_start, va_size(va));
+
+	if (unlikely(!root->lazy.va)) {
+		root->lazy.va = malloc(sizeof(va) * VMAP_LAZY_MAX_AREAS);
+		if (!root->lazy.va)
+			return bpt_po_insert(root, va);
+	}
+
+	root->lazy.va[root->lazy.nr++] = va;
+
+	if (root->lazy.nr == VMAP_LAZY_MAX_AREAS)
+		purge_vmap_area_lazy(root);
+
+	return 0;
+}
+
+/*
+ * Queues a VA instead of merging it into the tree right away.
+ * Once VMAP_LAZY_MAX_AREAS are accumulated the queue is purged.
+ */
+int free_vmap_area_lazy(struct bpt_root *root, struct vmap_area *va)
+{
+	if (unlikely(!va))
+		return -1;
+
+	/* It is not busy anymore, even though it is not merged yet. */
+	if (root->busy && unlink_busy_va(root, va))
+		return -1;
+
+	return va_queue_lazy(root, va);
+}
+
+/*
+ * Frees an area by its start address. It is queued if the root is
+ * marked by BPT_LAZY_FREE, see free_vmap_area_lazy().
+ */
+int vfree_addr(struct bpt_root *root, ulong addr)
+{
+	struct vmap_area *va;
+
+	if (unlikely(!root->busy))
+		return -1;
+
+	va = bpt_po_delete(root->busy, addr);
+	if (unlikely(!va))
+		return -1;
+
+	if (root->flags & BPT_LAZY_FREE)
+		return va_queue_lazy(root, va);
+
+	vm_trace_free(va->va_start, va_size(va));
 	return bpt_po_insert(root, va);
 }
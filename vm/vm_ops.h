@@ -3,6 +3,8 @@
 
 void fixup_metadata(struct bpn *);
 ulong bpn_max_avail(struct bpn *);
+u32 bpn_class_mask(struct bpn *);
+bool bpn_set_sub_meta(struct bpn *, int);
 
 bool try_merge_va(struct bpt_root *, struct bpn *,
 	struct vmap_area *, int);
@@ -11,13 +13,39 @@ void try_merge_with_adjacent_leaf(struct bpt_root *,
 	struct bpn *, int, struct vmap_area **);
 
 int vm_init_free_space(struct bpt_root *, ulong, ulong);
+int vm_load_free_space(struct bpt_root *, struct vmap_area **, ulong);
 
+ulong va_alloc(struct bpt_root *, ulong, ulong, ulong, ulong);
 int free_vmap_area(struct bpt_root *, struct vmap_area *);
+int free_vmap_area_lazy(struct bpt_root *, struct vmap_area *);
+int extend_vmap_area(struct bpt_root *, struct vmap_area *, ulong, ulong);
+int shrink_vmap_area(struct bpt_root *, struct vmap_area *, ulong);
+int unlink_busy_va(struct bpt_root *, struct vmap_area *);
+int vm_init_busy_index(struct bpt_root *);
+int vm_init_frag_stat(struct bpt_root *);
+void vm_frag_scan(struct bpt_root *, struct vm_frag *);
+int vm_frag_sample(struct bpt_root *, struct vm_frag *);
+double vm_frag_index(struct vm_frag *);
+struct vmap_area *find_vmap_area(struct bpt_root *, ulong);
+int vfree_addr(struct bpt_root *, ulong);
+ulong coalesce_vmap_areas(struct vmap_area **, ulong);
+void purge_vmap_area_lazy(struct bpt_root *);
 struct vmap_area *alloc_vmap_area(struct bpt_root *,
 	ulong, ulong, ulong, ulong);
+int alloc_vmap_areas(struct bpt_root *, int, ulong *,
+	ulong, ulong, ulong, struct vmap_area **);
 struct vmap_area *lookup_smallest_va(struct bpt_root *,
+	ulong, ulong, ulong, ulong, struct bpn **);
+struct vmap_area *lin_lookup_smallest_va(struct bpt_root *,
 	ulong, ulong, ulong, struct bpn **);
+struct vmap_area *lookup_best_va(struct bpt_root *,
+	ulong, ulong, ulong, ulong, struct bpn **);
+void vm_set_fit_policy(struct bpt_root *, enum vmap_fit_policy);
+struct vmap_area *lookup_highest_va(struct bpt_root *,
+	ulong, ulong, ulong, ulong, struct bpn **);
 struct bpn *
 bpt_lookup_lowest_leaf(struct bpt_root *, ulong, ulong);
+struct bpn *
+bpt_lookup_highest_leaf(struct bpt_root *, ulong, ulong);
 
 #endif
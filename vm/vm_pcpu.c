@@ -0,0 +1,293 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <assert.h>
+
+#include "vm.h"
+#include "vm_ops.h"
+#include "vm_pcpu.h"
+
+static struct kmem_cache vba_cachep;
+
+__attribute__((constructor)) static void
+vmap_pcpu_kmem_init(void)
+{
+	if (kmem_cache_init(&vba_cachep, "vmap_block_area",
+			sizeof(struct vmap_block_area), 0))
+		BUG();
+}
+
+static __always_inline int
+this_cpu(struct vmap_pcpu *vp)
+{
+	int cpu = sched_getcpu();
+
+	return (cpu < 0) ? 0 : cpu % vp->nr_cpus;
+}
+
+static struct vmap_block *
+new_vmap_block(struct vmap_pcpu *vp)
+{
+	struct vmap_block *vb;
+	struct vmap_area *va;
+
+	vb = malloc(sizeof(*vb));
+	if (unlikely(!vb))
+		return NULL;
+
+	pthread_spin_lock(vp->root_lock);
+	va = alloc_vmap_area(vp->root, VMAP_BLOCK_SIZE,
+		VMAP_BLOCK_SIZE, vp->vstart, vp->vend);
+	pthread_spin_unlock(vp->root_lock);
+
+	if (unlikely(!va)) {
+		free(vb);
+		return NULL;
+	}
+
+	pthread_spin_init(&vb->lock, PTHREAD_PROCESS_PRIVATE);
+	vb->va = va;
+	vb->free = va->va_start;
+	vb->nr_live = 0;
+	vb->retired = false;
+	return vb;
+}
+
+/*
+ * Gives a whole block back to the global tree. It is called
+ * when a block is retired and its last area has been freed.
+ */
+static void
+release_vmap_block(struct vmap_pcpu *vp, struct vmap_block *vb)
+{
+	pthread_spin_lock(vp->root_lock);
+	(void) free_vmap_area(vp->root, vb->va);
+	pthread_spin_unlock(vp->root_lock);
+
+	pthread_spin_destroy(&vb->lock);
+	free(vb);
+}
+
+/*
+ * Detach a block from its CPU. If nothing is live anymore it is
+ * released right away, otherwise the last vmap_pcpu_free() does.
+ */
+static void
+retire_vmap_block(struct vmap_pcpu *vp, struct vmap_block *vb)
+{
+	bool release;
+
+	pthread_spin_lock(&vb->lock);
+	vb->retired = true;
+	release = !vb->nr_live;
+	pthread_spin_unlock(&vb->lock);
+
+	if (release)
+		release_vmap_block(vp, vb);
+}
+
+static __always_inline bool
+vb_alloc(struct vmap_block *vb, ulong size, ulong align, ulong *addr)
+{
+	ulong nva_start_addr;
+	bool fit = false;
+
+	pthread_spin_lock(&vb->lock);
+	nva_start_addr = ALIGN(vb->free, align);
+
+	if (nva_start_addr + size <= vb->va->va_end) {
+		vb->free = nva_start_addr + size;
+		vb->nr_live++;
+		*addr = nva_start_addr;
+		fit = true;
+	}
+	pthread_spin_unlock(&vb->lock);
+
+	return fit;
+}
+
+/*
+ * Falls back to the global tree. It is used for requests which
+ * can not be served from a block, the container keeps vb NULL and
+ * the VA of the tree, so the busy index, stats and the trace see it
+ * as any other one.
+ */
+static struct vmap_area *
+vmap_pcpu_alloc_global(struct vmap_pcpu *vp, ulong size, ulong align)
+{
+	struct vmap_block_area *vba;
+	struct vmap_area *va;
+
+	vba = kmem_cache_alloc(&vba_cachep);
+	if (unlikely(!vba))
+		return NULL;
+
+	pthread_spin_lock(vp->root_lock);
+	va = alloc_vmap_area(vp->root, size, align, vp->vstart, vp->vend);
+	pthread_spin_unlock(vp->root_lock);
+
+	if (!va) {
+		kmem_cache_free(&vba_cachep, vba);
+		return NULL;
+	}
+
+	vba->va = *va;
+	vba->vb = NULL;
+	vba->tree_va = va;
+	return &vba->va;
+}
+
+struct vmap_area *
+vmap_pcpu_alloc(struct vmap_pcpu *vp, ulong size, ulong align)
+{
+	struct vmap_block_queue *vbq;
+	struct vmap_block_area *vba;
+	struct vmap_block *vb;
+	ulong addr;
+
+	if (unlikely(!size))
+		return NULL;
+
+	if (size > VMAP_MAX_ALLOC_SIZE) {
+		struct vmap_area *va;
+
+		pthread_spin_lock(vp->root_lock);
+		va = alloc_vmap_area(vp->root, size, align, vp->vstart, vp->vend);
+		pthread_spin_unlock(vp->root_lock);
+		return va;
+	}
+
+	/* A block is aligned to its size, so bigger ones are not served. */
+	if (align > VMAP_MAX_ALLOC_SIZE)
+		return vmap_pcpu_alloc_global(vp, size, align);
+
+	vba = kmem_cache_alloc(&vba_cachep);
+	if (unlikely(!vba))
+		return NULL;
+
+	vbq = &vp->vbq[this_cpu(vp)];
+	pthread_spin_lock(&vbq->lock);
+
+	vb = vbq->vb;
+	if (!vb || !vb_alloc(vb, size, align, &addr)) {
+		/* Exhausted, replace it by a new one. */
+		if (vb)
+			retire_vmap_block(vp, vb);
+
+		vb = vbq->vb = new_vmap_block(vp);
+		if (unlikely(!vb)) {
+			pthread_spin_unlock(&vbq->lock);
+			kmem_cache_free(&vba_cachep, vba);
+
+			/* The tree still may have a smaller fit. */
+			return vmap_pcpu_alloc_global(vp, size, align);
+		}
+
+		/* A new block always has room for VMAP_MAX_ALLOC_SIZE. */
+		if (!vb_alloc(vb, size, align, &addr))
+			BUG();
+	}
+	pthread_spin_unlock(&vbq->lock);
+
+	vba->va.va_start = addr;
+	vba->va.va_end = addr + size;
+	vba->vb = vb;
+	return &vba->va;
+}
+
+int vmap_pcpu_free(struct vmap_pcpu *vp, struct vmap_area *va)
+{
+	struct vmap_block_area *vba;
+	struct vmap_block *vb;
+	bool release = false;
+	int rv;
+
+	if (unlikely(!va))
+		return -1;
+
+	/* Not a container, goes directly to the tree. */
+	if (va_size(va) > VMAP_MAX_ALLOC_SIZE) {
+		pthread_spin_lock(vp->root_lock);
+		rv = free_vmap_area(vp->root, va);
+		pthread_spin_unlock(vp->root_lock);
+		return rv;
+	}
+
+	vba = (struct vmap_block_area *) va;
+	vb = vba->vb;
+
+	if (!vb) {
+		/* The tree takes back its own VA, it can be indexed. */
+		va = vba->tree_va;
+		kmem_cache_free(&vba_cachep, vba);
+
+		pthread_spin_lock(vp->root_lock);
+		rv = free_vmap_area(vp->root, va);
+		pthread_spin_unlock(vp->root_lock);
+		return rv;
+	}
+
+	pthread_spin_lock(&vb->lock);
+	BUG_ON(!vb->nr_live);
+
+	if (!--vb->nr_live) {
+		if (vb->retired)
+			release = true;
+		else
+			vb->free = vb->va->va_start;	/* reuse from scratch */
+	}
+	pthread_spin_unlock(&vb->lock);
+
+	kmem_cache_free(&vba_cachep, vba);
+
+	if (release)
+		release_vmap_block(vp, vb);
+
+	return 0;
+}
+
+int vmap_pcpu_init(struct vmap_pcpu *vp, struct bpt_root *root,
+		pthread_spinlock_t *root_lock, ulong vstart, ulong vend)
+{
+	size_t size;
+	int i;
+
+	vp->root = root;
+	vp->root_lock = root_lock;
+	vp->vstart = vstart;
+	vp->vend = vend;
+
+	vp->nr_cpus = sysconf(_SC_NPROCESSORS_CONF);
+	if (vp->nr_cpus <= 0)
+		vp->nr_cpus = 1;
+
+	/* Queues are cache line aligned, calloc() does not guarantee it. */
+	size = ALIGN(vp->nr_cpus * sizeof(*vp->vbq), 64);
+	vp->vbq = aligned_alloc(64, size);
+	if (unlikely(!vp->vbq))
+		return -1;
+
+	memset(vp->vbq, 0, size);
+
+	for (i = 0; i < vp->nr_cpus; i++)
+		pthread_spin_init(&vp->vbq[i].lock, PTHREAD_PROCESS_PRIVATE);
+
+	return 0;
+}
+
+void vmap_pcpu_destroy(struct vmap_pcpu *vp)
+{
+	int i;
+
+	for (i = 0; i < vp->nr_cpus; i++) {
+		if (vp->vbq[i].vb)
+			retire_vmap_block(vp, vp->vbq[i].vb);
+
+		pthread_spin_destroy(&vp->vbq[i].lock);
+	}
+
+	free(vp->vbq);
+	vp->vbq = NULL;
+}
@@ -0,0 +1,60 @@
+#ifndef __VM_PCPU_H__
+#define __VM_PCPU_H__
+
+#include <pthread.h>
+
+/*
+ * Per-CPU vmap blocks. A block is a contiguous range carved from
+ * the global free-space tree. Small requests are served from the
+ * block of a current CPU by bumping a free pointer, so the global
+ * lock is taken only when a block is exhausted or fully released.
+ */
+enum vmap_block_properties {
+	VMAP_BLOCK_PAGES = 1024,
+	VMAP_MAX_ALLOC_PAGES = 64,
+};
+
+#define VMAP_BLOCK_SIZE (VMAP_BLOCK_PAGES * PAGE_SIZE)
+#define VMAP_MAX_ALLOC_SIZE (VMAP_MAX_ALLOC_PAGES * PAGE_SIZE)
+
+struct vmap_block {
+	pthread_spinlock_t lock;
+	struct vmap_area *va;		/* the whole block range */
+	ulong free;			/* first free address */
+	ulong nr_live;			/* handed out, not freed yet */
+	bool retired;			/* detached from its CPU */
+};
+
+/*
+ * A small area is returned in this container. The "va" has to be
+ * the first member, so a caller sees a plain vmap_area. When the
+ * area came from the tree its VA of the tree is freed back.
+ */
+struct vmap_block_area {
+	struct vmap_area va;
+	struct vmap_block *vb;		/* NULL if allocated from the tree */
+	struct vmap_area *tree_va;	/* if vb is NULL */
+};
+
+struct vmap_block_queue {
+	pthread_spinlock_t lock;
+	struct vmap_block *vb;
+} __attribute__((aligned(64)));
+
+struct vmap_pcpu {
+	struct bpt_root *root;
+	pthread_spinlock_t *root_lock;
+	ulong vstart;
+	ulong vend;
+
+	int nr_cpus;
+	struct vmap_block_queue *vbq;
+};
+
+extern int vmap_pcpu_init(struct vmap_pcpu *, struct bpt_root *,
+	pthread_spinlock_t *, ulong, ulong);
+extern void vmap_pcpu_destroy(struct vmap_pcpu *);
+extern struct vmap_area *vmap_pcpu_alloc(struct vmap_pcpu *, ulong, ulong);
+extern int vmap_pcpu_free(struct vmap_pcpu *, struct vmap_area *);
+
+#endif
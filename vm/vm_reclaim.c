@@ -0,0 +1,292 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "vm.h"
+#include "vm_ops.h"
+#include "vm_reclaim.h"
+#include "vm_stat.h"
+#include "vm_trace.h"
+
+#define RECLAIM_MASK (VMAP_RECLAIM_SLOTS - 1)
+
+/*
+ * A slot is free for a producer at position "pos" when its sequence
+ * is "pos", it is ready for a consumer when it is "pos + 1". Returns
+ * false if the ring is full.
+ */
+static bool
+reclaim_push(struct vmap_reclaim *rc, struct vmap_area *va)
+{
+	struct vmap_reclaim_slot *s;
+	ulong pos, seq;
+	long diff;
+
+	pos = __atomic_load_n(&rc->tail, __ATOMIC_RELAXED);
+
+	for (;;) {
+		s = &rc->ring[pos & RECLAIM_MASK];
+		seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		diff = (long) (seq - pos);
+
+		if (!diff) {
+			if (__atomic_compare_exchange_n(&rc->tail, &pos, pos + 1,
+					true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return false;
+		} else {
+			pos = __atomic_load_n(&rc->tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	s->va = va;
+	__atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/*
+ * Takes up to "max" published areas in order. It stops at a slot
+ * which is claimed but not written yet, the rest is left for the
+ * next time. A caller holds drain_lock.
+ */
+static ulong
+reclaim_pop(struct vmap_reclaim *rc, struct vmap_area **va, ulong max)
+{
+	struct vmap_reclaim_slot *s;
+	ulong nr;
+
+	for (nr = 0; nr < max; nr++) {
+		s = &rc->ring[rc->head & RECLAIM_MASK];
+		if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != rc->head + 1)
+			break;
+
+		va[nr] = s->va;
+		__atomic_store_n(&s->seq, rc->head + VMAP_RECLAIM_SLOTS,
+			__ATOMIC_RELEASE);
+		rc->head++;
+	}
+
+	if (nr)
+		__atomic_sub_fetch(&rc->nr_pending, nr, __ATOMIC_RELAXED);
+
+	return nr;
+}
+
+static __always_inline long
+reclaim_pending(struct vmap_reclaim *rc)
+{
+	return __atomic_load_n(&rc->nr_pending, __ATOMIC_RELAXED);
+}
+
+/*
+ * Merges whatever is queued into the tree. A batch is sorted and
+ * coalesced before root_lock is taken, so the lock is held only for
+ * one left to right pass over the leaves. A caller holds drain_lock.
+ */
+static void
+__reclaim_drain(struct vmap_reclaim *rc)
+{
+	ulong nr;
+
+	nr = reclaim_pop(rc, rc->batch, VMAP_RECLAIM_SLOTS);
+	if (!nr)
+		return;
+
+	vm_stat_add(VM_STAT_RECLAIMED, nr);
+	nr = coalesce_vmap_areas(rc->batch, nr);
+
+	pthread_spin_lock(rc->root_lock);
+	bpt_bulk_insert(rc->root, rc->batch, nr);
+	pthread_spin_unlock(rc->root_lock);
+}
+
+void vmap_reclaim_drain(struct vmap_reclaim *rc)
+{
+	pthread_mutex_lock(&rc->drain_lock);
+	__reclaim_drain(rc);
+	pthread_mutex_unlock(&rc->drain_lock);
+}
+
+static void *
+reclaim_thread(void *arg)
+{
+	struct vmap_reclaim *rc = arg;
+	struct timespec ts;
+
+	pthread_mutex_lock(&rc->lock);
+	while (!rc->stop) {
+		if (reclaim_pending(rc) < VMAP_RECLAIM_BATCH) {
+			(void) clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += VMAP_RECLAIM_INTERVAL * 1000;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_nsec -= 1000000000;
+				ts.tv_sec++;
+			}
+
+			(void) pthread_cond_timedwait(&rc->wait, &rc->lock, &ts);
+		}
+		pthread_mutex_unlock(&rc->lock);
+
+		if (reclaim_pending(rc) > 0)
+			vmap_reclaim_drain(rc);
+
+		pthread_mutex_lock(&rc->lock);
+	}
+	pthread_mutex_unlock(&rc->lock);
+
+	return NULL;
+}
+
+static void
+reclaim_wake(struct vmap_reclaim *rc)
+{
+	pthread_mutex_lock(&rc->lock);
+	pthread_cond_signal(&rc->wait);
+	pthread_mutex_unlock(&rc->lock);
+}
+
+/*
+ * Queues an area, the tree lock is not taken unless a busy index
+ * is on or the queue is full. In the last case the reclaimer lags
+ * behind and a caller drains the queue itself, it sleeps on
+ * drain_lock if somebody else is already doing it.
+ */
+int vmap_reclaim_free(struct vmap_reclaim *rc, struct vmap_area *va)
+{
+	ulong start = vm_stat_time();
+	struct bpt_root *root = rc->root;
+	int rv;
+
+	if (unlikely(!va))
+		return -1;
+
+	if (root->busy) {
+		pthread_spin_lock(rc->root_lock);
+		rv = unlink_busy_va(root, va);
+		pthread_spin_unlock(rc->root_lock);
+
+		if (rv)
+			return -1;
+	}
+
+	vm_trace_free(va->va_start, va_size(va));
+
+	if (unlikely(!reclaim_push(rc, va))) {
+		vm_stat_inc(VM_STAT_RECLAIM_FULL);
+		vmap_reclaim_drain(rc);
+
+		/* Refilled by others meanwhile, merge it in place. */
+		if (!reclaim_push(rc, va)) {
+			pthread_spin_lock(rc->root_lock);
+			rv = bpt_po_insert(root, va);
+			pthread_spin_unlock(rc->root_lock);
+
+			vm_stat_latency(VM_STAT_FREE, start);
+			return rv;
+		}
+	}
+
+	if (__atomic_add_fetch(&rc->nr_pending, 1,
+			__ATOMIC_RELAXED) == VMAP_RECLAIM_BATCH)
+		reclaim_wake(rc);
+
+	vm_stat_latency(VM_STAT_FREE, start);
+	return 0;
+}
+
+/*
+ * Queued areas are not visible to the tree, so when its largest
+ * free block is below the watermark or a request does not fit, the
+ * queue is drained in place and the request is retried.
+ */
+struct vmap_area *
+vmap_reclaim_alloc(struct vmap_reclaim *rc, ulong size, ulong align)
+{
+	struct vmap_area *va = NULL;
+	bool low;
+
+	pthread_spin_lock(rc->root_lock);
+	low = bpn_max_avail(rc->root->node) < rc->watermark;
+	if (!low || reclaim_pending(rc) <= 0)
+		va = alloc_vmap_area(rc->root, size, align, rc->vstart, rc->vend);
+	pthread_spin_unlock(rc->root_lock);
+
+	if (va || reclaim_pending(rc) <= 0)
+		return va;
+
+	vm_stat_inc(VM_STAT_RECLAIM_SYNC);
+	vmap_reclaim_drain(rc);
+
+	pthread_spin_lock(rc->root_lock);
+	va = alloc_vmap_area(rc->root, size, align, rc->vstart, rc->vend);
+	pthread_spin_unlock(rc->root_lock);
+
+	return va;
+}
+
+int vmap_reclaim_init(struct vmap_reclaim *rc, struct bpt_root *root,
+		pthread_spinlock_t *root_lock, ulong vstart, ulong vend)
+{
+	ulong i;
+
+	rc->root = root;
+	rc->root_lock = root_lock;
+	rc->vstart = vstart;
+	rc->vend = vend;
+	rc->watermark = VMAP_RECLAIM_WATERMARK;
+
+	rc->ring = malloc(sizeof(*rc->ring) * VMAP_RECLAIM_SLOTS);
+	rc->batch = malloc(sizeof(*rc->batch) * VMAP_RECLAIM_SLOTS);
+	if (unlikely(!rc->ring || !rc->batch))
+		goto fail;
+
+	for (i = 0; i < VMAP_RECLAIM_SLOTS; i++)
+		rc->ring[i].seq = i;
+
+	rc->tail = rc->head = 0;
+	rc->nr_pending = 0;
+	rc->stop = false;
+
+	pthread_mutex_init(&rc->drain_lock, NULL);
+	pthread_mutex_init(&rc->lock, NULL);
+	pthread_cond_init(&rc->wait, NULL);
+
+	if (pthread_create(&rc->thread, NULL, reclaim_thread, rc)) {
+		pthread_cond_destroy(&rc->wait);
+		pthread_mutex_destroy(&rc->lock);
+		pthread_mutex_destroy(&rc->drain_lock);
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	free(rc->ring);
+	free(rc->batch);
+	return -1;
+}
+
+/*
+ * Stops the reclaimer and merges what is left, so all freed areas
+ * are in the tree when it returns. No frees may run concurrently.
+ */
+void vmap_reclaim_destroy(struct vmap_reclaim *rc)
+{
+	pthread_mutex_lock(&rc->lock);
+	rc->stop = true;
+	pthread_cond_signal(&rc->wait);
+	pthread_mutex_unlock(&rc->lock);
+
+	(void) pthread_join(rc->thread, NULL);
+	vmap_reclaim_drain(rc);
+
+	pthread_cond_destroy(&rc->wait);
+	pthread_mutex_destroy(&rc->lock);
+	pthread_mutex_destroy(&rc->drain_lock);
+
+	free(rc->ring);
+	free(rc->batch);
+	rc->ring = NULL;
+	rc->batch = NULL;
+}
@@ -0,0 +1,63 @@
+#ifndef __VM_RECLAIM_H__
+#define __VM_RECLAIM_H__
+
+#include <pthread.h>
+
+/*
+ * Asynchronous reclaim of freed areas. A free does not take the
+ * tree lock, an area is put to a lock-free MPSC queue and a caller
+ * returns. A background reclaimer drains the queue in batches, they
+ * are sorted and coalesced out of the lock and only then merged into
+ * the tree. When the largest free block of the tree drops below a
+ * watermark, or an allocation fails, an allocator drains the queue
+ * itself.
+ */
+enum vmap_reclaim_properties {
+	VMAP_RECLAIM_SLOTS = 4096,	/* a power of two */
+	VMAP_RECLAIM_BATCH = 512,	/* wakes the reclaimer up */
+	VMAP_RECLAIM_INTERVAL = 1000,	/* usec, drains at least so often */
+};
+
+#define VMAP_RECLAIM_WATERMARK (4096 * PAGE_SIZE)
+
+struct vmap_reclaim_slot {
+	ulong seq;
+	struct vmap_area *va;
+};
+
+struct vmap_reclaim {
+	struct bpt_root *root;
+	pthread_spinlock_t *root_lock;
+	ulong vstart;
+	ulong vend;
+	ulong watermark;
+
+	/*
+	 * A bounded ring, a slot is published by its sequence number.
+	 * Producers claim slots by the tail. A consumer owns the head
+	 * and the batch, it holds drain_lock until the batch is merged,
+	 * so an allocator which drains waits for an in-flight one. It
+	 * is always taken before root_lock.
+	 */
+	struct vmap_reclaim_slot *ring;
+	ulong tail __attribute__((aligned(64)));
+	long nr_pending;
+	ulong head __attribute__((aligned(64)));
+	struct vmap_area **batch;
+	pthread_mutex_t drain_lock;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wait;
+	bool stop;
+};
+
+extern int vmap_reclaim_init(struct vmap_reclaim *, struct bpt_root *,
+	pthread_spinlock_t *, ulong, ulong);
+extern void vmap_reclaim_destroy(struct vmap_reclaim *);
+extern struct vmap_area *vmap_reclaim_alloc(struct vmap_reclaim *,
+	ulong, ulong);
+extern int vmap_reclaim_free(struct vmap_reclaim *, struct vmap_area *);
+extern void vmap_reclaim_drain(struct vmap_reclaim *);
+
+#endif
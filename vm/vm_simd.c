@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+
+#include "vm.h"
+#include "vm_simd.h"
+
+static int
+first_fit_scalar(struct bpn *n, u32 pages, ulong vstart)
+{
+	int i;
+
+	for (i = 0; i < n->entries; i++) {
+		if (vstart < n->slot[i] && n->SUB_AVAIL[i] >= pages)
+			break;
+	}
+
+	return i;
+}
+
+static u32
+max_avail_scalar(struct bpn *n)
+{
+	u32 avail = 0;
+	int i;
+
+	for (i = 0; i < n->entries + 1; i++) {
+		if (n->SUB_AVAIL[i] > avail)
+			avail = n->SUB_AVAIL[i];
+	}
+
+	return avail;
+}
+
+/*
+ * AVX2 does not have an unsigned 64-bit compare, so keys are biased
+ * by the sign bit and compared as signed ones. SUB_AVAIL is 32-bit,
+ * four entries are compared as unsigned by a max and widened to the
+ * lanes of keys. Masked loads are slow, whole lanes are loaded and
+ * a tail is scalar.
+ */
+__attribute__((target("avx2"))) static int
+first_fit_avx2(struct bpn *n, u32 pages, ulong vstart)
+{
+	const __m256i sign = _mm256_set1_epi64x(1UL << 63);
+	__m256i vs = _mm256_xor_si256(_mm256_set1_epi64x(vstart), sign);
+	__m128i len = _mm_set1_epi32(pages);
+	__m128i suba, ge;
+	__m256i keys, m;
+	int i, bits;
+
+	for (i = 0; i + 4 <= n->entries; i += 4) {
+		keys = _mm256_loadu_si256((const __m256i *) (n->slot + i));
+		suba = _mm_loadu_si128((const __m128i *) (n->SUB_AVAIL + i));
+
+		/* vstart < key && suba >= pages */
+		m = _mm256_cmpgt_epi64(_mm256_xor_si256(keys, sign), vs);
+		ge = _mm_cmpeq_epi32(_mm_max_epu32(suba, len), suba);
+		m = _mm256_and_si256(_mm256_cvtepi32_epi64(ge), m);
+
+		bits = _mm256_movemask_pd(_mm256_castsi256_pd(m));
+		if (bits)
+			return i + __builtin_ctz(bits);
+	}
+
+	for (; i < n->entries; i++)
+		if (vstart < n->slot[i] && n->SUB_AVAIL[i] >= pages)
+			break;
+
+	return i;
+}
+
+__attribute__((target("avx2"))) static u32
+max_avail_avx2(struct bpn *n)
+{
+	__m256i acc = _mm256_setzero_si256();
+	int i, nr = n->entries + 1;
+	u32 lane[8], avail = 0;
+
+	for (i = 0; i + 8 <= nr; i += 8)
+		acc = _mm256_max_epu32(acc, _mm256_loadu_si256(
+			(const __m256i *) (n->SUB_AVAIL + i)));
+
+	_mm256_storeu_si256((__m256i *) lane, acc);
+
+	for (; i < nr; i++)
+		if (n->SUB_AVAIL[i] > avail)
+			avail = n->SUB_AVAIL[i];
+
+	for (i = 0; i < 8; i++)
+		if (lane[i] > avail)
+			avail = lane[i];
+
+	return avail;
+}
+
+__attribute__((target("avx512f"))) static __always_inline __mmask16
+lanes_valid_avx512(int i, int nr, int width)
+{
+	return (nr - i >= width) ? (1 << width) - 1 : (1 << (nr - i)) - 1;
+}
+
+/*
+ * Eight keys and eight 32-bit SUB_AVAIL entries per step, the
+ * latter are compared in a half of a register.
+ */
+__attribute__((target("avx512f"))) static int
+first_fit_avx512(struct bpn *n, u32 pages, ulong vstart)
+{
+	__m512i vs = _mm512_set1_epi64(vstart);
+	__m512i len = _mm512_set1_epi32(pages);
+	__mmask16 valid, m;
+	__m512i keys, suba;
+	int i;
+
+	for (i = 0; i < n->entries; i += 8) {
+		valid = lanes_valid_avx512(i, n->entries, 8);
+		keys = _mm512_maskz_loadu_epi64(valid, n->slot + i);
+		suba = _mm512_maskz_loadu_epi32(valid, n->SUB_AVAIL + i);
+
+		m = _mm512_mask_cmpgt_epu64_mask(valid, keys, vs);
+		m = _mm512_mask_cmpge_epu32_mask(m, suba, len);
+
+		if (m)
+			return i + __builtin_ctz(m);
+	}
+
+	return n->entries;
+}
+
+__attribute__((target("avx512f"))) static u32
+max_avail_avx512(struct bpn *n)
+{
+	__m512i acc = _mm512_setzero_si512();
+	int i, nr = n->entries + 1;
+	__mmask16 valid;
+
+	for (i = 0; i < nr; i += 16) {
+		valid = lanes_valid_avx512(i, nr, 16);
+		acc = _mm512_max_epu32(acc,
+			_mm512_maskz_loadu_epi32(valid, n->SUB_AVAIL + i));
+	}
+
+	return _mm512_reduce_max_epu32(acc);
+}
+
+static bool
+scalar_supported(void)
+{
+	return true;
+}
+
+static bool
+avx2_supported(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+static bool
+avx512_supported(void)
+{
+	return __builtin_cpu_supports("avx512f");
+}
+
+/* In order of preference. */
+static const struct {
+	struct bpn_search_ops ops;
+	bool (*supported)(void);
+} search_table[] = {
+	{ { "avx512", first_fit_avx512, max_avail_avx512 }, avx512_supported },
+	{ { "avx2", first_fit_avx2, max_avail_avx2 }, avx2_supported },
+	{ { "scalar", first_fit_scalar, max_avail_scalar }, scalar_supported },
+};
+
+#define NR_SEARCH_OPS (sizeof(search_table) / sizeof(search_table[0]))
+
+const struct bpn_search_ops *bpn_search =
+	&search_table[NR_SEARCH_OPS - 1].ops;
+
+bool bpn_search_supported(const char *name)
+{
+	int i;
+
+	for (i = 0; i < NR_SEARCH_OPS; i++)
+		if (!strcmp(search_table[i].ops.name, name))
+			return search_table[i].supported();
+
+	return false;
+}
+
+/*
+ * Forces a kernel by its name, a NULL picks the best supported
+ * one. Returns -1 if it is unknown or not supported by a CPU.
+ */
+int bpn_search_select(const char *name)
+{
+	int i;
+
+	__builtin_cpu_init();
+
+	for (i = 0; i < NR_SEARCH_OPS; i++) {
+		if (name && strcmp(search_table[i].ops.name, name))
+			continue;
+
+		if (search_table[i].supported()) {
+			bpn_search = &search_table[i].ops;
+			return 0;
+		}
+
+		if (name)
+			break;
+	}
+
+	return -1;
+}
+
+/* VM_BPN_SEARCH=scalar|avx2|avx512 can force a kernel. */
+__attribute__((constructor)) static void
+bpn_search_init(void)
+{
+	if (bpn_search_select(getenv("VM_BPN_SEARCH")))
+		(void) bpn_search_select(NULL);
+}
@@ -0,0 +1,26 @@
+#ifndef __VM_SIMD_H__
+#define __VM_SIMD_H__
+
+/*
+ * Kernels which scan an internal node. A proper one is selected
+ * at startup depending on what a CPU supports, the scalar one is
+ * a fallback.
+ *
+ * first_fit: returns the first child "i" such that vstart is below
+ * its upper split key and SUB_AVAIL[i] >= pages, otherwise the last
+ * child is returned. See va_avail_pages() for units.
+ *
+ * max_avail: returns the maximum of SUB_AVAIL[] of a node.
+ */
+struct bpn_search_ops {
+	const char *name;
+	int (*first_fit)(struct bpn *, u32, ulong);
+	u32 (*max_avail)(struct bpn *);
+};
+
+extern const struct bpn_search_ops *bpn_search;
+
+extern int bpn_search_select(const char *);
+extern bool bpn_search_supported(const char *);
+
+#endif
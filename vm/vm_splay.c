@@ -0,0 +1,496 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+#include "vm_splay.h"
+#include "vm_stat.h"
+#include "vm_trace.h"
+
+static struct kmem_cache splay_va_cachep;
+
+__attribute__((constructor)) static void
+splay_kmem_init(void)
+{
+	unsigned int flags = getenv("VM_KMEM_HUGEPAGE") ? KMEM_HUGEPAGE:0;
+
+	if (kmem_cache_init(&splay_va_cachep, "splay_va",
+			sizeof(struct splay_va), flags))
+		BUG();
+}
+
+static __always_inline ulong
+splay_va_size(struct splay_va *n)
+{
+	return n->va_end - n->va_start;
+}
+
+static __always_inline ulong
+get_subtree_max_size(struct splay_va *n)
+{
+	return n ? n->max_size:0;
+}
+
+static __always_inline ulong
+compute_subtree_max_size(struct splay_va *n)
+{
+	ulong size = splay_va_size(n);
+	ulong l = get_subtree_max_size(n->left);
+	ulong r = get_subtree_max_size(n->right);
+
+	if (l > size)
+		size = l;
+
+	return r > size ? r:size;
+}
+
+/*
+ * Stops as soon as a value is not changed, ancestors are correct
+ * then. Only one node below "n" can have been changed.
+ */
+static __always_inline void
+augment_propagate_from(struct splay_va *n)
+{
+	ulong max_size;
+
+	while (n) {
+		max_size = compute_subtree_max_size(n);
+		if (n->max_size == max_size)
+			break;
+
+		n->max_size = max_size;
+		n = n->parent;
+	}
+}
+
+static __always_inline void
+set_parent(struct splay_va *n, struct splay_va *p)
+{
+	if (n)
+		n->parent = p;
+}
+
+/*
+ * Splits the tree into nodes below and above "addr" while going
+ * down, then assembles it under the last visited node. Both spines
+ * have lost their lower parts, so they are recomputed bottom-up.
+ */
+static struct splay_va *
+splay(struct splay_va *t, ulong addr)
+{
+	struct splay_va head, *l, *r, *y;
+
+	head.left = head.right = NULL;
+	l = r = &head;
+
+	for (;;) {
+		if (addr < t->va_start) {
+			if (!t->left)
+				break;
+
+			if (addr < t->left->va_start) {
+				/* Rotate right. */
+				y = t->left;
+				t->left = y->right;
+				set_parent(t->left, t);
+				y->right = t;
+				t->parent = y;
+				t->max_size = compute_subtree_max_size(t);
+				t = y;
+
+				if (!t->left)
+					break;
+			}
+
+			/* Link right. */
+			r->left = t;
+			t->parent = (r == &head) ? NULL:r;
+			r = t;
+			t = t->left;
+		} else if (addr > t->va_start) {
+			if (!t->right)
+				break;
+
+			if (addr > t->right->va_start) {
+				/* Rotate left. */
+				y = t->right;
+				t->right = y->left;
+				set_parent(t->right, t);
+				y->left = t;
+				t->parent = y;
+				t->max_size = compute_subtree_max_size(t);
+				t = y;
+
+				if (!t->right)
+					break;
+			}
+
+			/* Link left. */
+			l->right = t;
+			t->parent = (l == &head) ? NULL:l;
+			l = t;
+			t = t->right;
+		} else {
+			break;
+		}
+	}
+
+	l->right = t->left;
+	set_parent(l->right, l);
+	r->left = t->right;
+	set_parent(r->left, r);
+
+	t->left = head.right;
+	set_parent(t->left, t);
+	t->right = head.left;
+	set_parent(t->right, t);
+	t->parent = NULL;
+
+	for (y = l; y != &head && y != t; y = y->parent)
+		y->max_size = compute_subtree_max_size(y);
+
+	for (y = r; y != &head && y != t; y = y->parent)
+		y->max_size = compute_subtree_max_size(y);
+
+	t->max_size = compute_subtree_max_size(t);
+	return t;
+}
+
+/* All of "l" are below all of "r". */
+static struct splay_va *
+splay_join(struct splay_va *l, struct splay_va *r)
+{
+	if (!l) {
+		set_parent(r, NULL);
+		return r;
+	}
+
+	/* The highest one of "l" becomes its root, it has no right child. */
+	l = splay(l, ULONG_MAX);
+	l->right = r;
+	set_parent(r, l);
+	l->max_size = compute_subtree_max_size(l);
+
+	return l;
+}
+
+static void
+splay_delete(struct splay_root *root, struct splay_va *n)
+{
+	struct splay_va *p = n->parent, *c;
+
+	if (n->left && n->right)
+		c = splay_join(n->left, n->right);
+	else
+		c = n->left ? n->left:n->right;
+
+	set_parent(c, p);
+
+	if (!p)
+		root->node = c;
+	else if (p->left == n)
+		p->left = c;
+	else
+		p->right = c;
+
+	augment_propagate_from(p);
+	kmem_cache_free(&splay_va_cachep, n);
+	root->nr--;
+}
+
+static struct splay_va *
+splay_first(struct splay_va *n)
+{
+	while (n && n->left)
+		n = n->left;
+
+	return n;
+}
+
+static struct splay_va *
+splay_last(struct splay_va *n)
+{
+	while (n && n->right)
+		n = n->right;
+
+	return n;
+}
+
+static struct splay_va *
+splay_next(struct splay_va *n)
+{
+	if (n->right)
+		return splay_first(n->right);
+
+	while (n->parent && n->parent->right == n)
+		n = n->parent;
+
+	return n->parent;
+}
+
+/*
+ * The lowest area where the request fits, same as the B+tree does.
+ * It is an in-order walk which skips subtrees without a big enough
+ * area and the ones below "vstart".
+ */
+static struct splay_va *
+lookup_lowest_fit(struct splay_va *n, ulong size,
+	ulong align, ulong vstart)
+{
+	bool left_done = false;
+
+	if (!n || n->max_size < size)
+		return NULL;
+
+	while (n) {
+		if (!left_done && n->left && vstart < n->va_start &&
+				n->left->max_size >= size) {
+			n = n->left;
+			continue;
+		}
+
+		if (splay_va_size(n) >= size && is_within_this_range(
+				n->va_start, n->va_end, size, align, vstart))
+			return n;
+
+		if (n->right && n->right->max_size >= size) {
+			n = n->right;
+			left_done = false;
+			continue;
+		}
+
+		/* Up to the first ancestor whose left subtree is done. */
+		while (n->parent && n->parent->right == n)
+			n = n->parent;
+
+		n = n->parent;
+		left_done = true;
+	}
+
+	return NULL;
+}
+
+/*
+ * Cuts [addr, addr + size) out of the root area. Returns -1 if a
+ * node for the right part can not be allocated.
+ */
+static int
+splay_clip_root(struct splay_root *root, ulong addr, ulong size)
+{
+	struct splay_va *t = root->node, *n;
+
+	if (addr == t->va_start && addr + size == t->va_end) {
+		splay_delete(root, t);
+		return 0;
+	}
+
+	if (addr == t->va_start) {
+		t->va_start += size;
+	} else if (addr + size == t->va_end) {
+		t->va_end = addr;
+	} else {
+		n = kmem_cache_alloc(&splay_va_cachep);
+		if (unlikely(!n))
+			return -1;
+
+		/* It goes between "t" and its successor. */
+		n->va_start = addr + size;
+		n->va_end = t->va_end;
+		n->left = NULL;
+		n->right = t->right;
+		set_parent(n->right, n);
+		n->parent = t;
+		n->max_size = compute_subtree_max_size(n);
+
+		t->right = n;
+		t->va_end = addr;
+		root->nr++;
+	}
+
+	t->max_size = compute_subtree_max_size(t);
+	return 0;
+}
+
+struct vmap_area *
+splay_alloc_vmap_area(struct splay_root *root, ulong size,
+		ulong align, ulong vstart, ulong vend)
+{
+	ulong start = vm_stat_time();
+	struct vmap_area *va;
+	struct splay_va *n;
+	ulong addr = vend;
+
+	va = vmap_area_alloc();
+	if (unlikely(!va))
+		return NULL;
+
+	n = lookup_lowest_fit(root->node, size, align, vstart);
+	if (n) {
+		root->node = splay(root->node, n->va_start);
+		addr = (n->va_start > vstart) ?
+			ALIGN(n->va_start, align):ALIGN(vstart, align);
+
+		/* Check the "vend" restriction. */
+		if (addr + size > vend || splay_clip_root(root, addr, size))
+			addr = vend;
+	}
+
+	if (addr == vend) {
+		vmap_area_free(va);
+		vm_stat_latency(VM_STAT_ALLOC, start);
+		vm_trace_alloc(0, size, align, vstart, vend);
+		return NULL;
+	}
+
+	va->va_start = addr;
+	va->va_end = addr + size;
+
+	vm_stat_latency(VM_STAT_ALLOC, start);
+	vm_trace_alloc(addr, size, align, vstart, vend);
+	return va;
+}
+
+/*
+ * An area is merged with its free neighbours, if there are none it
+ * becomes a new root. Returns -1 if it overlaps a free area, "va" is
+ * not released then.
+ */
+int splay_free_vmap_area(struct splay_root *root, struct vmap_area *va)
+{
+	ulong start = vm_stat_time();
+	struct splay_va *t, *prev, *next, *n;
+	bool merge_prev, merge_next;
+
+	if (unlikely(!va))
+		return -1;
+
+	t = root->node;
+	if (t) {
+		t = root->node = splay(t, va->va_start);
+
+		if (t->va_start < va->va_start) {
+			prev = t;
+			next = splay_first(t->right);
+		} else {
+			prev = splay_last(t->left);
+			next = t;
+		}
+
+		if (next && next->va_start < va->va_end)
+			return -1;
+
+		if (prev && prev->va_end > va->va_start)
+			return -1;
+	} else {
+		prev = next = NULL;
+	}
+
+	vm_trace_free(va->va_start, va_size(va));
+
+	merge_prev = prev && prev->va_end == va->va_start;
+	merge_next = next && next->va_start == va->va_end;
+
+	if (merge_prev && merge_next) {
+		prev->va_end = next->va_end;
+		splay_delete(root, next);
+		augment_propagate_from(prev);
+	} else if (merge_prev) {
+		prev->va_end = va->va_end;
+		augment_propagate_from(prev);
+	} else if (merge_next) {
+		next->va_start = va->va_start;
+		augment_propagate_from(next);
+	} else {
+		n = kmem_cache_alloc(&splay_va_cachep);
+		if (unlikely(!n))
+			return -1;
+
+		n->va_start = va->va_start;
+		n->va_end = va->va_end;
+		n->parent = NULL;
+
+		if (!t) {
+			n->left = n->right = NULL;
+		} else if (t->va_start < n->va_start) {
+			n->left = t;
+			n->right = t->right;
+			t->right = NULL;
+		} else {
+			n->left = t->left;
+			n->right = t;
+			t->left = NULL;
+		}
+
+		if (t) {
+			set_parent(n->left, n);
+			set_parent(n->right, n);
+			t->max_size = compute_subtree_max_size(t);
+		}
+
+		n->max_size = compute_subtree_max_size(n);
+		root->node = n;
+		root->nr++;
+	}
+
+	vmap_area_free(va);
+	vm_stat_latency(VM_STAT_FREE, start);
+	return 0;
+}
+
+void splay_frag_scan(struct splay_root *root, struct vm_frag *f)
+{
+	struct splay_va *n;
+	ulong size;
+
+	memset(f, 0, sizeof(*f));
+
+	for (n = splay_first(root->node); n; n = splay_next(n)) {
+		size = splay_va_size(n);
+
+		f->nr_free++;
+		f->free_bytes += size;
+		f->nr_class[va_size_class(size)]++;
+		if (size > f->largest)
+			f->largest = size;
+	}
+}
+
+int splay_init_free_space(struct splay_root *root, ulong vstart, ulong vend)
+{
+	struct splay_va *n;
+
+	n = kmem_cache_alloc(&splay_va_cachep);
+	if (unlikely(!n))
+		return -1;
+
+	n->left = n->right = n->parent = NULL;
+	n->va_start = vstart;
+	n->va_end = vend;
+	n->max_size = vend - vstart;
+
+	root->node = n;
+	root->nr = 1;
+	return 0;
+}
+
+/* Nodes are released by right rotations, no stack is needed. */
+void splay_root_destroy(struct splay_root *root)
+{
+	struct splay_va *n = root->node, *l;
+
+	while (n) {
+		if (n->left) {
+			l = n->left;
+			n->left = l->right;
+			l->right = n;
+			n = l;
+		} else {
+			l = n->right;
+			kmem_cache_free(&splay_va_cachep, n);
+			n = l;
+		}
+	}
+
+	root->node = NULL;
+	root->nr = 0;
+}
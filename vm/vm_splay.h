@@ -0,0 +1,36 @@
+#ifndef __VM_SPLAY_H__
+#define __VM_SPLAY_H__
+
+/*
+ * Free areas in a top-down splay tree keyed by va_start, taken from
+ * libtree/splaytree. A node is augmented by the largest free area of
+ * its subtree, so a lowest fit is found without visiting subtrees
+ * which are too small. It serves the same first fit as the B+tree,
+ * both engines can be compared on one trace, see vm_engine.h.
+ *
+ * A found and a freed area are splayed to the root, so a request
+ * which comes right after a free of the same size, i.e. LIFO, finds
+ * its area there. Busy areas are not indexed.
+ */
+struct splay_va {
+	struct splay_va *left;
+	struct splay_va *right;
+	struct splay_va *parent;
+	ulong va_start;
+	ulong va_end;
+	ulong max_size;		/* the largest area of the subtree */
+};
+
+struct splay_root {
+	struct splay_va *node;
+	ulong nr;		/* free areas */
+};
+
+extern int splay_init_free_space(struct splay_root *, ulong, ulong);
+extern void splay_root_destroy(struct splay_root *);
+extern struct vmap_area *splay_alloc_vmap_area(struct splay_root *,
+	ulong, ulong, ulong, ulong);
+extern int splay_free_vmap_area(struct splay_root *, struct vmap_area *);
+extern void splay_frag_scan(struct splay_root *, struct vm_frag *);
+
+#endif
@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "vm.h"
+#include "vm_stat.h"
+
+bool vm_stat_enabled;
+__thread struct vm_stat *vm_stat_this;
+
+/* Sets of all threads, they are kept when a thread exits. */
+static struct vm_stat *vm_stat_list;
+static pthread_mutex_t vm_stat_lock = PTHREAD_MUTEX_INITIALIZER;
+static const char *vm_stat_path;
+
+static const char *hist_name[VM_STAT_NR_HISTS] = {
+	[VM_STAT_ALLOC] = "alloc",
+	[VM_STAT_FREE] = "free",
+};
+
+static const char *counter_name[VM_STAT_NR_COUNTERS] = {
+	[VM_STAT_DESCENTS] = "descents",
+	[VM_STAT_RETRIES] = "retries",
+	[VM_STAT_OLC_RESTARTS] = "olc_restarts",
+	[VM_STAT_SPLITS] = "splits",
+	[VM_STAT_MERGES] = "merges",
+	[VM_STAT_VA_MERGES] = "va_merges",
+	[VM_STAT_FIXUPS] = "fixups",
+	[VM_STAT_FIXUP_LEVELS] = "fixup_levels",
+	[VM_STAT_META_SCANS] = "meta_scans",
+	[VM_STAT_RECLAIMED] = "reclaimed",
+	[VM_STAT_RECLAIM_SYNC] = "reclaim_sync",
+	[VM_STAT_RECLAIM_FULL] = "reclaim_full",
+	[VM_STAT_CLASS_HITS] = "class_hits",
+	[VM_STAT_CLASS_REFILLS] = "class_refills",
+	[VM_STAT_CLASS_FLUSHES] = "class_flushes",
+};
+
+struct vm_stat *vm_stat_alloc(void)
+{
+	struct vm_stat *s = calloc(1, sizeof(*s));
+
+	if (s) {
+		pthread_mutex_lock(&vm_stat_lock);
+		s->next = vm_stat_list;
+		vm_stat_list = s;
+		pthread_mutex_unlock(&vm_stat_lock);
+	}
+
+	return s;
+}
+
+void vm_stat_enable(void)
+{
+	vm_stat_enabled = true;
+}
+
+/* Other threads are expected to be quiet. */
+void vm_stat_reset(void)
+{
+	struct vm_stat *s, *next;
+
+	pthread_mutex_lock(&vm_stat_lock);
+	for (s = vm_stat_list; s; s = next) {
+		next = s->next;
+		memset(s, 0, sizeof(*s));
+		s->next = next;
+	}
+	pthread_mutex_unlock(&vm_stat_lock);
+}
+
+/* Sums up sets of all threads into "out". */
+void vm_stat_sum(struct vm_stat *out)
+{
+	struct vm_stat *s;
+	int i, j;
+
+	memset(out, 0, sizeof(*out));
+
+	pthread_mutex_lock(&vm_stat_lock);
+	for (s = vm_stat_list; s; s = s->next) {
+		for (i = 0; i < VM_STAT_NR_HISTS; i++) {
+			struct vm_stat_histogram *h = &out->hist[i];
+
+			h->count += s->hist[i].count;
+			h->sum += s->hist[i].sum;
+			if (s->hist[i].max > h->max)
+				h->max = s->hist[i].max;
+
+			for (j = 0; j < VM_STAT_NR_BUCKETS; j++)
+				h->bucket[j] += s->hist[i].bucket[j];
+		}
+
+		for (i = 0; i < VM_STAT_NR_COUNTERS; i++)
+			out->counter[i] += s->counter[i];
+
+		if (s->fixup_max_depth > out->fixup_max_depth)
+			out->fixup_max_depth = s->fixup_max_depth;
+	}
+	pthread_mutex_unlock(&vm_stat_lock);
+}
+
+/* "p" is 0..100, a value is the lowest one of its bucket. */
+ulong vm_stat_percentile(struct vm_stat_histogram *h, double p)
+{
+	ulong rank, seen = 0;
+	int i;
+
+	if (!h->count)
+		return 0;
+
+	rank = (ulong) (h->count * p / 100.0);
+	if (rank >= h->count)
+		return h->max;
+
+	for (i = 0; i < VM_STAT_NR_BUCKETS; i++) {
+		seen += h->bucket[i];
+		if (seen > rank)
+			break;
+	}
+
+	return vm_stat_bucket_value(i);
+}
+
+void vm_stat_dump_json(FILE *f)
+{
+	static const double pct[] = { 50, 90, 99, 99.9, 99.99 };
+	static const char *pct_name[] = { "p50", "p90", "p99", "p999", "p9999" };
+	struct vm_stat *s;
+	int i, j;
+
+	s = malloc(sizeof(*s));
+	if (!s)
+		return;
+
+	vm_stat_sum(s);
+
+	fprintf(f, "{\n");
+	for (i = 0; i < VM_STAT_NR_HISTS; i++) {
+		struct vm_stat_histogram *h = &s->hist[i];
+
+		fprintf(f, "  \"%s\": { \"count\": %lu, \"mean\": %lu",
+			hist_name[i], h->count, h->count ? h->sum / h->count:0);
+
+		for (j = 0; j < sizeof(pct) / sizeof(pct[0]); j++)
+			fprintf(f, ", \"%s\": %lu", pct_name[j],
+				vm_stat_percentile(h, pct[j]));
+
+		fprintf(f, ", \"max\": %lu },\n", h->max);
+	}
+
+	fprintf(f, "  \"counters\": {");
+	for (i = 0; i < VM_STAT_NR_COUNTERS; i++)
+		fprintf(f, " \"%s\": %lu,", counter_name[i], s->counter[i]);
+
+	fprintf(f, " \"fixup_max_depth\": %lu }\n}\n", s->fixup_max_depth);
+	free(s);
+}
+
+static void
+vm_stat_exit(void)
+{
+	FILE *f;
+
+	if (!strcmp(vm_stat_path, "-")) {
+		vm_stat_dump_json(stdout);
+		return;
+	}
+
+	f = fopen(vm_stat_path, "w");
+	if (f) {
+		vm_stat_dump_json(f);
+		fclose(f);
+	}
+}
+
+/* VM_STAT=<file> enables it and writes a report at exit. */
+__attribute__((constructor)) static void
+vm_stat_init(void)
+{
+	vm_stat_path = getenv("VM_STAT");
+	if (!vm_stat_path || !*vm_stat_path)
+		return;
+
+	vm_stat_enable();
+	atexit(vm_stat_exit);
+}
@@ -0,0 +1,185 @@
+#ifndef __VM_STAT_H__
+#define __VM_STAT_H__
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <time.h>
+
+/*
+ * Latency histograms and event counters. Every thread has its own
+ * set, so nothing is shared on a fast path, all of them are summed
+ * up when dumped. It is off unless vm_stat_enable() is called or
+ * VM_STAT=<file> is set, in the last case a JSON report is written
+ * to the file at exit, "-" means stdout.
+ *
+ * A histogram is log-linear: every power of two range of nsec is
+ * split into VM_STAT_SUB_BUCKETS equal buckets, so the error of a
+ * percentile is about 1 / VM_STAT_SUB_BUCKETS.
+ */
+#define VM_STAT_SUB_BITS 4
+#define VM_STAT_SUB_BUCKETS (1 << VM_STAT_SUB_BITS)
+#define VM_STAT_NR_BUCKETS \
+	((sizeof(ulong) * 8 - VM_STAT_SUB_BITS + 1) * VM_STAT_SUB_BUCKETS)
+
+enum vm_stat_hist {
+	VM_STAT_ALLOC,
+	VM_STAT_FREE,
+	VM_STAT_NR_HISTS,
+};
+
+enum vm_stat_counter {
+	VM_STAT_DESCENTS,	/* root to leaf walks of a lookup */
+	VM_STAT_RETRIES,	/* extra descents of a lookup */
+	VM_STAT_OLC_RESTARTS,	/* optimistic reads which restarted */
+	VM_STAT_SPLITS,		/* node splits */
+	VM_STAT_MERGES,		/* node merges */
+	VM_STAT_VA_MERGES,	/* freed areas merged with neighbours */
+	VM_STAT_FIXUPS,		/* metadata updates */
+	VM_STAT_FIXUP_LEVELS,	/* levels they have gone up in total */
+	VM_STAT_META_SCANS,	/* nodes scanned to update metadata */
+	VM_STAT_RECLAIMED,	/* areas merged by a reclaimer */
+	VM_STAT_RECLAIM_SYNC,	/* drains done by allocators */
+	VM_STAT_RECLAIM_FULL,	/* frees which found a queue full */
+	VM_STAT_CLASS_HITS,	/* allocs served by a size class list */
+	VM_STAT_CLASS_REFILLS,	/* lists refilled from the tree */
+	VM_STAT_CLASS_FLUSHES,	/* lists given back to the tree */
+	VM_STAT_NR_COUNTERS,
+};
+
+struct vm_stat_histogram {
+	ulong count;
+	ulong sum;
+	ulong max;
+	ulong bucket[VM_STAT_NR_BUCKETS];
+};
+
+struct vm_stat {
+	struct vm_stat_histogram hist[VM_STAT_NR_HISTS];
+	ulong counter[VM_STAT_NR_COUNTERS];
+	ulong fixup_max_depth;
+	struct vm_stat *next;
+};
+
+extern bool vm_stat_enabled;
+extern __thread struct vm_stat *vm_stat_this;
+
+extern struct vm_stat *vm_stat_alloc(void);
+extern void vm_stat_enable(void);
+extern void vm_stat_reset(void);
+extern void vm_stat_sum(struct vm_stat *);
+extern ulong vm_stat_percentile(struct vm_stat_histogram *, double);
+extern void vm_stat_dump_json(FILE *);
+
+static __always_inline struct vm_stat *
+vm_stat_get(void)
+{
+	if (unlikely(!vm_stat_this))
+		vm_stat_this = vm_stat_alloc();
+
+	return vm_stat_this;
+}
+
+static __always_inline int
+vm_stat_bucket(ulong v)
+{
+	int shift;
+
+	if (v < VM_STAT_SUB_BUCKETS)
+		return v;
+
+	/* An MSB position minus sub-bucket bits. */
+	shift = (sizeof(ulong) * 8 - 1) - __builtin_clzl(v) - VM_STAT_SUB_BITS;
+	return ((shift + 1) << VM_STAT_SUB_BITS) +
+		(v >> shift) - VM_STAT_SUB_BUCKETS;
+}
+
+/* The lowest value of a bucket. */
+static __always_inline ulong
+vm_stat_bucket_value(int i)
+{
+	int shift = (i >> VM_STAT_SUB_BITS) - 1;
+
+	if (shift < 0)
+		return i;
+
+	return (ulong) (VM_STAT_SUB_BUCKETS + (i & (VM_STAT_SUB_BUCKETS - 1)))
+		<< shift;
+}
+
+static __always_inline void
+vm_stat_add(enum vm_stat_counter c, ulong v)
+{
+	struct vm_stat *s;
+
+	if (likely(!vm_stat_enabled))
+		return;
+
+	s = vm_stat_get();
+	if (likely(s))
+		s->counter[c] += v;
+}
+
+#define vm_stat_inc(c) vm_stat_add(c, 1)
+
+/* A number of levels a metadata update has gone up. */
+static __always_inline void
+vm_stat_fixup(ulong depth)
+{
+	struct vm_stat *s;
+
+	if (likely(!vm_stat_enabled))
+		return;
+
+	s = vm_stat_get();
+	if (likely(s)) {
+		s->counter[VM_STAT_FIXUPS]++;
+		s->counter[VM_STAT_FIXUP_LEVELS] += depth;
+		if (depth > s->fixup_max_depth)
+			s->fixup_max_depth = depth;
+	}
+}
+
+static __always_inline ulong
+vm_stat_now(void)
+{
+	struct timespec t;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &t);
+	return (t.tv_sec * 1000000000UL) + t.tv_nsec;
+}
+
+/* Zero when disabled, it is passed to vm_stat_latency() as is. */
+static __always_inline ulong
+vm_stat_time(void)
+{
+	if (likely(!vm_stat_enabled))
+		return 0;
+
+	return vm_stat_now();
+}
+
+static __always_inline void
+vm_stat_latency(enum vm_stat_hist h, ulong start)
+{
+	struct vm_stat_histogram *hist;
+	struct vm_stat *s;
+	ulong nsec;
+
+	if (likely(!start))
+		return;
+
+	s = vm_stat_get();
+	if (unlikely(!s))
+		return;
+
+	nsec = vm_stat_now() - start;
+	hist = &s->hist[h];
+
+	hist->bucket[vm_stat_bucket(nsec)]++;
+	hist->count++;
+	hist->sum += nsec;
+	if (nsec > hist->max)
+		hist->max = nsec;
+}
+
+#endif
@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "vm.h"
+#include "vm_stat.h"
+#include "vm_trace.h"
+
+struct vm_trace *vm_tracer;
+
+/* Records are buffered by stdio, it is flushed on stop. */
+#define VM_TRACE_BUF_SIZE (1UL << 20)
+
+int vm_trace_start(const char *path)
+{
+	struct vm_trace_hdr hdr;
+	struct vm_trace *t;
+
+	if (vm_tracer)
+		return -1;
+
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		return -1;
+
+	t->f = fopen(path, "w");
+	if (!t->f) {
+		free(t);
+		return -1;
+	}
+
+	(void) setvbuf(t->f, NULL, _IOFBF, VM_TRACE_BUF_SIZE);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, VM_TRACE_MAGIC, sizeof(VM_TRACE_MAGIC));
+	hdr.version = VM_TRACE_VERSION;
+	hdr.rec_size = sizeof(struct vm_trace_rec);
+
+	if (fwrite(&hdr, sizeof(hdr), 1, t->f) != 1) {
+		fclose(t->f);
+		free(t);
+		return -1;
+	}
+
+	pthread_mutex_init(&t->lock, NULL);
+	t->start = vm_stat_now();
+	vm_tracer = t;
+
+	return 0;
+}
+
+/* Nobody is expected to allocate or free at this point. */
+void vm_trace_stop(void)
+{
+	struct vm_trace *t = vm_tracer;
+
+	if (!t)
+		return;
+
+	vm_tracer = NULL;
+
+	fclose(t->f);
+	pthread_mutex_destroy(&t->lock);
+	free(t);
+}
+
+void vm_trace_record(enum vm_trace_op op, ulong addr, ulong size,
+	ulong align, ulong vstart, ulong vend)
+{
+	struct vm_trace *t = vm_tracer;
+	struct vm_trace_rec rec;
+
+	rec.op = op;
+	rec.addr = addr;
+	rec.size = size;
+	rec.align = align;
+	rec.vstart = vstart;
+	rec.vend = vend;
+
+	/* Under the lock, so timestamps go in order. */
+	pthread_mutex_lock(&t->lock);
+	rec.ts = vm_stat_now() - t->start;
+	if (fwrite(&rec, sizeof(rec), 1, t->f) == 1)
+		t->nr_recs++;
+	pthread_mutex_unlock(&t->lock);
+}
+
+static void
+vm_trace_exit(void)
+{
+	vm_trace_stop();
+}
+
+/* VM_TRACE=<file> records everything till exit. */
+__attribute__((constructor)) static void
+vm_trace_init(void)
+{
+	const char *path = getenv("VM_TRACE");
+
+	if (!path || !*path)
+		return;
+
+	if (!vm_trace_start(path))
+		atexit(vm_trace_exit);
+}
@@ -0,0 +1,69 @@
+#ifndef __VM_TRACE_H__
+#define __VM_TRACE_H__
+
+#include <stdio.h>
+#include <pthread.h>
+
+/*
+ * Trace of alloc and free requests. A file is a header followed by
+ * fixed size records in order they have been done. A free refers
+ * to an allocation by its address, so a replay does not depend on
+ * where areas are placed by an allocator under test.
+ *
+ * It is written by vm_trace_start() ... vm_trace_stop() or during
+ * the whole run if VM_TRACE=<file> is set. See replay.c.
+ */
+#define VM_TRACE_MAGIC "VMTRACE"
+#define VM_TRACE_VERSION 1
+
+enum vm_trace_op {
+	VM_TRACE_ALLOC = 1,
+	VM_TRACE_FREE = 2,
+};
+
+struct vm_trace_hdr {
+	char magic[8];
+	unsigned int version;
+	unsigned int rec_size;
+} __attribute__((packed));
+
+struct vm_trace_rec {
+	u8 op;
+	ulong ts;		/* nsec since a trace is started */
+	ulong addr;		/* va_start, zero if an alloc has failed */
+	ulong size;
+	ulong align;		/* zero for a free */
+	ulong vstart;		/* zero for a free */
+	ulong vend;		/* zero for a free */
+} __attribute__((packed));
+
+struct vm_trace {
+	FILE *f;
+	ulong start;
+	ulong nr_recs;
+	pthread_mutex_t lock;
+};
+
+extern struct vm_trace *vm_tracer;
+
+extern int vm_trace_start(const char *);
+extern void vm_trace_stop(void);
+extern void vm_trace_record(enum vm_trace_op, ulong, ulong,
+	ulong, ulong, ulong);
+
+/* Hooks, a single branch when nothing is traced. */
+static __always_inline void
+vm_trace_alloc(ulong addr, ulong size, ulong align, ulong vstart, ulong vend)
+{
+	if (unlikely(vm_tracer))
+		vm_trace_record(VM_TRACE_ALLOC, addr, size, align, vstart, vend);
+}
+
+static __always_inline void
+vm_trace_free(ulong addr, ulong size)
+{
+	if (unlikely(vm_tracer))
+		vm_trace_record(VM_TRACE_FREE, addr, size, 0, 0, 0);
+}
+
+#endif
@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "vm.h"
+#include "vm_ops.h"
+#include "vm_zone.h"
+
+/* A hash of a thread, zero means it is not calculated yet. */
+static __thread unsigned int zone_hash;
+
+static __always_inline int
+home_zone(struct vmap_zones *vz)
+{
+	if (unlikely(!zone_hash))
+		zone_hash = ((unsigned int) gettid() * 2654435761U) | 1;
+
+	return (zone_hash >> 16) % vz->nr_zones;
+}
+
+/*
+ * An i-th zone to try, it goes around the home one: h, h + 1,
+ * h - 1, h + 2, h - 2 and so on. First nr_zones are distinct.
+ */
+static __always_inline int
+nth_neighbour_zone(struct vmap_zones *vz, int home, int i)
+{
+	int offset = (i & 1) ? (i + 1) >> 1 : -(i >> 1);
+
+	return ((home + offset) % vz->nr_zones + vz->nr_zones) % vz->nr_zones;
+}
+
+static __always_inline struct vmap_zone *
+addr_to_zone(struct vmap_zones *vz, ulong addr)
+{
+	ulong i = (addr - vz->vstart) / vz->zone_size;
+
+	/* The last one also takes a remainder. */
+	if (i >= vz->nr_zones)
+		i = vz->nr_zones - 1;
+
+	return &vz->zone[i];
+}
+
+struct vmap_area *
+vmap_zones_alloc(struct vmap_zones *vz, ulong size, ulong align)
+{
+	int i, home = home_zone(vz);
+	struct vmap_zone *zone;
+	struct vmap_area *va;
+
+	for (i = 0; i < vz->nr_zones; i++) {
+		zone = &vz->zone[nth_neighbour_zone(vz, home, i)];
+
+		pthread_spin_lock(&zone->lock);
+		va = alloc_vmap_area(&zone->root, size, align,
+			zone->vstart, zone->vend);
+		pthread_spin_unlock(&zone->lock);
+
+		if (va)
+			return va;
+	}
+
+	return NULL;
+}
+
+int vmap_zones_free(struct vmap_zones *vz, struct vmap_area *va)
+{
+	struct vmap_zone *zone;
+	int rv;
+
+	if (unlikely(!va))
+		return -1;
+
+	zone = addr_to_zone(vz, va->va_start);
+
+	pthread_spin_lock(&zone->lock);
+	rv = free_vmap_area(&zone->root, va);
+	pthread_spin_unlock(&zone->lock);
+
+	return rv;
+}
+
+/*
+ * Walks leafs of every zone. An area can not cross a zone border,
+ * so the biggest free one is the biggest among zones.
+ */
+void vmap_zones_stat(struct vmap_zones *vz, struct vmap_zones_stat *st)
+{
+	struct vmap_zone *zone;
+	struct vm_frag f;
+	int i;
+
+	st->free = st->largest = st->nr_areas = 0;
+
+	for (i = 0; i < vz->nr_zones; i++) {
+		zone = &vz->zone[i];
+
+		pthread_spin_lock(&zone->lock);
+		vm_frag_scan(&zone->root, &f);
+		pthread_spin_unlock(&zone->lock);
+
+		st->free += f.free_bytes;
+		st->nr_areas += f.nr_free;
+		if (f.largest > st->largest)
+			st->largest = f.largest;
+	}
+}
+
+int vmap_zones_init(struct vmap_zones *vz, int nr_zones,
+		ulong vstart, ulong vend)
+{
+	struct vmap_zone *zone;
+	int i;
+
+	if (nr_zones <= 0)
+		return -1;
+
+	/* Every zone is at least one page. */
+	vz->zone_size = ((vend - vstart) / nr_zones) & ~(PAGE_SIZE - 1);
+	if (!vz->zone_size)
+		return -1;
+
+	vz->zone = aligned_alloc(64, nr_zones * sizeof(*vz->zone));
+	if (unlikely(!vz->zone))
+		return -1;
+
+	vz->nr_zones = nr_zones;
+	vz->vstart = vstart;
+	vz->vend = vend;
+
+	for (i = 0; i < nr_zones; i++) {
+		zone = &vz->zone[i];
+		zone->vstart = vstart + vz->zone_size * i;
+		zone->vend = (i + 1 == nr_zones) ? vend:
+			zone->vstart + vz->zone_size;
+
+		pthread_spin_init(&zone->lock, PTHREAD_PROCESS_PRIVATE);
+		if (vm_init_free_space(&zone->root, zone->vstart, zone->vend))
+			BUG();
+	}
+
+	return 0;
+}
+
+/* Everything has to be freed back already. */
+void vmap_zones_destroy(struct vmap_zones *vz)
+{
+	struct vmap_zone *zone;
+	int i;
+
+	for (i = 0; i < vz->nr_zones; i++) {
+		zone = &vz->zone[i];
+
+		BUG_ON(zone->root.node->entries != 1);
+		vmap_area_free(bpn_get_val(zone->root.node, 0));
+		bpt_root_destroy(&zone->root);
+		pthread_spin_destroy(&zone->lock);
+	}
+
+	free(vz->zone);
+	vz->zone = NULL;
+	vz->nr_zones = 0;
+}
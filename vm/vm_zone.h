@@ -0,0 +1,40 @@
+#ifndef __VM_ZONE_H__
+#define __VM_ZONE_H__
+
+#include <pthread.h>
+
+/*
+ * Address range partitioned zones. [vstart, vend) is split into N
+ * equal parts, every part is an independent tree with its own lock.
+ * A thread allocates from its home zone and falls back to neighbour
+ * ones when it is exhausted. An area is freed to the zone it belongs
+ * to, a zone is found by its address.
+ */
+struct vmap_zone {
+	struct bpt_root root;
+	pthread_spinlock_t lock;
+	ulong vstart;
+	ulong vend;
+} __attribute__((aligned(64)));
+
+struct vmap_zones {
+	struct vmap_zone *zone;
+	int nr_zones;
+	ulong zone_size;
+	ulong vstart;
+	ulong vend;
+};
+
+struct vmap_zones_stat {
+	ulong free;			/* total free space */
+	ulong largest;			/* biggest free area */
+	ulong nr_areas;			/* number of free areas */
+};
+
+extern int vmap_zones_init(struct vmap_zones *, int, ulong, ulong);
+extern void vmap_zones_destroy(struct vmap_zones *);
+extern struct vmap_area *vmap_zones_alloc(struct vmap_zones *, ulong, ulong);
+extern int vmap_zones_free(struct vmap_zones *, struct vmap_area *);
+extern void vmap_zones_stat(struct vmap_zones *, struct vmap_zones_stat *);
+
+#endif